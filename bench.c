@@ -0,0 +1,467 @@
+#include "disk.h"
+#include "fs.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark harness for the fs.h API. Each benchmark prints one JSON object per line to stdout:
+// {"bench":"seq_read","io_size":4096,"ops":...,"bytes":...,"secs":...,"ops_per_sec":...,
+//  "mb_per_sec":...,"lat_ns":{"min":...,"p50":...,"p90":...,"p99":...,"p999":...,"max":...},"flags":"..."}
+// The first line describes the run. Build with `make bench` and run ./bench -h for the options
+
+#define MAX_FILES 256   // Files the benchmark disk is made with (the churn benchmark fills them all)
+#define MIB (1024 * 1024)
+
+static const char * disk_name = "bench_fs";
+static struct fs_options opts;
+static char flag_names[128] = "";
+static size_t file_bytes = 64 * MIB;    // Size of the files used by the read/write/truncate benchmarks
+static int rand_ops = 20000;            // Operations per random access benchmark
+static int rounds = 20;                 // Rounds of the churn, mount and large file benchmarks
+static uint64_t rng = 0x9e3779b97f4a7c15ull;
+static const char * trace_name = NULL;  // Block trace of the run to save (for the replay tool)
+#define TRACE_RECORDS (1 << 20)
+
+// Latencies of the operations of the running benchmark
+static uint64_t * lat = NULL;
+static size_t lat_count = 0;
+static size_t lat_cap = 0;
+static uint64_t bench_start;
+
+static char * io_buf;   // Biggest I/O size, filled with a pattern
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t next_rand(){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void fail(const char * what){
+    fprintf(stderr, "ERROR: %s failed\n", what);
+    exit(1);
+}
+
+static void begin(){
+    lat_count = 0;
+    bench_start = now_ns();
+}
+
+static void sample(uint64_t ns){
+    if (lat_count == lat_cap){
+        lat_cap = lat_cap ? 2 * lat_cap : 4096;
+        lat = (uint64_t *) realloc(lat, lat_cap * sizeof(uint64_t));
+        if (lat == NULL)
+            fail("realloc");
+    }
+    lat[lat_count++] = ns;
+}
+
+static int cmp_u64(const void * a, const void * b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(double p){
+    size_t i = (size_t) (p * (double) (lat_count - 1) + 0.5);
+    return lat[i];
+}
+
+// Ends the running benchmark and prints its line. Throughput is over the benchmark's wall time,
+// so setup done between timed operations (like remounting) must happen before begin()
+static void report(const char * name, size_t io_size, uint64_t bytes){
+    double secs = (double) (now_ns() - bench_start) / 1e9;
+    if (lat_count == 0)
+        return;
+    qsort(lat, lat_count, sizeof(uint64_t), cmp_u64);
+    printf("{\"bench\":\"%s\",\"io_size\":%zu,\"ops\":%zu,\"bytes\":%llu,\"secs\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+           "\"lat_ns\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+           "\"flags\":\"%s\"}\n",
+           name, io_size, lat_count, (unsigned long long) bytes, secs,
+           lat_count / secs, bytes / secs / MIB,
+           (unsigned long long) lat[0], (unsigned long long) percentile(0.50),
+           (unsigned long long) percentile(0.90), (unsigned long long) percentile(0.99),
+           (unsigned long long) percentile(0.999), (unsigned long long) lat[lat_count - 1],
+           flag_names);
+    fflush(stdout);
+}
+
+static void do_mount(){
+    if (mount_fs_opts(disk_name, &opts) != 0)
+        fail("mount_fs_opts");
+}
+
+static void do_umount(){
+    if (umount_fs(disk_name) != 0)
+        fail("umount_fs");
+}
+
+// Unmounts and mounts again so the next benchmark starts with a cold block cache
+static void remount(){
+    do_umount();
+    do_mount();
+}
+
+static int open_new(const char * name){
+    if (fs_create(name) != 0)
+        fail("fs_create");
+    int fd = fs_open(name);
+    if (fd < 0)
+        fail("fs_open");
+    return fd;
+}
+
+// Writes file_bytes to a new file in 1 MiB calls, leaving it open
+static int fill_file(const char * name){
+    int fd = open_new(name);
+    for (size_t done = 0; done < file_bytes; done += MIB)
+        if (fs_write(fd, io_buf, MIB) != MIB)
+            fail("fs_write");
+    return fd;
+}
+
+static void bench_mount(const char * suffix){
+    char name[32];
+    do_umount();
+    begin();
+    for (int i = 0; i < rounds; i++){
+        uint64_t t = now_ns();
+        do_mount();
+        sample(now_ns() - t);
+        do_umount();
+    }
+    snprintf(name, sizeof(name), "mount%s", suffix);
+    report(name, 0, 0);
+
+    begin();
+    for (int i = 0; i < rounds; i++){
+        do_mount();
+        uint64_t t = now_ns();
+        do_umount();
+        sample(now_ns() - t);
+    }
+    snprintf(name, sizeof(name), "umount%s", suffix);
+    report(name, 0, 0);
+    do_mount();
+}
+
+// Creates, opens, closes and deletes every file the disk can hold, over and over
+static void bench_churn(){
+    char names[MAX_FILES][16];
+    int fds[MAX_FILES];
+    uint64_t create = 0, open = 0, close = 0, delete = 0;
+    for (int i = 0; i < MAX_FILES; i++)
+        snprintf(names[i], sizeof(names[i]), "churn%d", i);
+
+    uint64_t * all = (uint64_t *) malloc(4 * (size_t) rounds * MAX_FILES * sizeof(uint64_t));
+    if (all == NULL)
+        fail("malloc");
+    for (int r = 0; r < rounds; r++){
+        for (int i = 0; i < MAX_FILES; i++){
+            uint64_t t = now_ns();
+            if (fs_create(names[i]) != 0)
+                fail("fs_create");
+            all[create++] = now_ns() - t;
+        }
+        for (int i = 0; i < MAX_FILES; i++){
+            uint64_t t = now_ns();
+            if ((fds[i] = fs_open(names[i])) < 0)
+                fail("fs_open");
+            all[(size_t) rounds * MAX_FILES + open++] = now_ns() - t;
+            t = now_ns();
+            if (fs_close(fds[i]) != 0)
+                fail("fs_close");
+            all[2 * (size_t) rounds * MAX_FILES + close++] = now_ns() - t;
+        }
+        for (int i = 0; i < MAX_FILES; i++){
+            uint64_t t = now_ns();
+            if (fs_delete(names[i]) != 0)
+                fail("fs_delete");
+            all[3 * (size_t) rounds * MAX_FILES + delete++] = now_ns() - t;
+        }
+    }
+
+    // The operations interleave, so each one's throughput is over the sum of its own latencies
+    static const char * what[] = {"create", "open", "close", "delete"};
+    for (int k = 0; k < 4; k++){
+        begin();
+        uint64_t total = 0;
+        for (size_t i = 0; i < (size_t) rounds * MAX_FILES; i++){
+            sample(all[k * (size_t) rounds * MAX_FILES + i]);
+            total += all[k * (size_t) rounds * MAX_FILES + i];
+        }
+        bench_start = now_ns() - total;
+        report(what[k], 0, 0);
+    }
+    free(all);
+}
+
+static void bench_seq(size_t io_size){
+    int fd = open_new("seq");
+    begin();
+    for (size_t done = 0; done < file_bytes; done += io_size){
+        uint64_t t = now_ns();
+        if (fs_write(fd, io_buf, io_size) != (int) io_size)
+            fail("fs_write");
+        sample(now_ns() - t);
+    }
+    report("seq_write", io_size, file_bytes);
+    if (fs_close(fd) != 0)
+        fail("fs_close");
+
+    remount();
+    if ((fd = fs_open("seq")) < 0)
+        fail("fs_open");
+    char * buf = (char *) malloc(io_size);
+    if (buf == NULL)
+        fail("malloc");
+    begin();
+    for (size_t done = 0; done < file_bytes; done += io_size){
+        uint64_t t = now_ns();
+        if (fs_read(fd, buf, io_size) != (int) io_size)
+            fail("fs_read");
+        sample(now_ns() - t);
+    }
+    report("seq_read", io_size, file_bytes);
+    free(buf);
+    if (fs_close(fd) != 0 || fs_delete("seq") != 0)
+        fail("fs_delete");
+}
+
+// Random fs_lseek + fs_read (or fs_write) of io_size bytes at multiples of io_size in file fd
+static void bench_random(int fd, size_t io_size, int write){
+    size_t slots = file_bytes / io_size;
+    char * buf = (char *) malloc(io_size);
+    if (buf == NULL)
+        fail("malloc");
+    begin();
+    for (int i = 0; i < rand_ops; i++){
+        off_t offset = (off_t) (next_rand() % slots * io_size);
+        uint64_t t = now_ns();
+        if (fs_lseek(fd, offset) != 0)
+            fail("fs_lseek");
+        if ((write ? fs_write(fd, io_buf, io_size) : fs_read(fd, buf, io_size)) != (int) io_size)
+            fail(write ? "fs_write" : "fs_read");
+        sample(now_ns() - t);
+    }
+    report(write ? "rand_write" : "rand_read", io_size, (uint64_t) rand_ops * io_size);
+    free(buf);
+}
+
+// Seeks alone, then seeks each followed by a small read, all over file fd
+static void bench_lseek(int fd){
+    char buf[64];
+    begin();
+    for (int i = 0; i < 5 * rand_ops; i++){
+        off_t offset = (off_t) (next_rand() % file_bytes);
+        uint64_t t = now_ns();
+        if (fs_lseek(fd, offset) != 0)
+            fail("fs_lseek");
+        sample(now_ns() - t);
+    }
+    report("lseek", 0, 0);
+
+    begin();
+    for (int i = 0; i < 5 * rand_ops; i++){
+        off_t offset = (off_t) (next_rand() % (file_bytes - sizeof(buf)));
+        uint64_t t = now_ns();
+        if (fs_lseek(fd, offset) != 0)
+            fail("fs_lseek");
+        if (fs_read(fd, buf, sizeof(buf)) != (int) sizeof(buf))
+            fail("fs_read");
+        sample(now_ns() - t);
+    }
+    report("lseek_read", sizeof(buf), (uint64_t) 5 * rand_ops * sizeof(buf));
+}
+
+static void bench_append(size_t io_size){
+    int fd = open_new("append");
+    size_t ops = file_bytes / io_size < 200000 ? file_bytes / io_size : 200000;
+    begin();
+    for (size_t i = 0; i < ops; i++){
+        uint64_t t = now_ns();
+        if (fs_write(fd, io_buf, io_size) != (int) io_size)
+            fail("fs_write");
+        sample(now_ns() - t);
+    }
+    report("append", io_size, ops * io_size);
+    if (fs_close(fd) != 0 || fs_delete("append") != 0)
+        fail("fs_delete");
+}
+
+// Truncates a file of file_bytes to nothing, then deletes a file of file_bytes
+static void bench_large(){
+    int n = rounds < 5 ? rounds : 5;
+    uint64_t trunc_lat[5], delete_lat[5];
+    for (int i = 0; i < n; i++){
+        int fd = fill_file("large");
+        uint64_t t = now_ns();
+        if (fs_truncate(fd, 0) != 0)
+            fail("fs_truncate");
+        trunc_lat[i] = now_ns() - t;
+        if (fs_close(fd) != 0 || fs_delete("large") != 0)
+            fail("fs_delete");
+        // A journaled disk only reuses freed blocks once they're checkpointed, which umount_fs does
+        remount();
+
+        fd = fill_file("large");
+        if (fs_close(fd) != 0)
+            fail("fs_close");
+        t = now_ns();
+        if (fs_delete("large") != 0)
+            fail("fs_delete");
+        delete_lat[i] = now_ns() - t;
+        remount();
+    }
+
+    uint64_t total = 0;
+    begin();
+    for (int i = 0; i < n; i++){
+        sample(trunc_lat[i]);
+        total += trunc_lat[i];
+    }
+    bench_start = now_ns() - total;
+    report("truncate_large", 0, (uint64_t) n * file_bytes);
+
+    total = 0;
+    begin();
+    for (int i = 0; i < n; i++){
+        sample(delete_lat[i]);
+        total += delete_lat[i];
+    }
+    bench_start = now_ns() - total;
+    report("delete_large", 0, (uint64_t) n * file_bytes);
+}
+
+static void usage(const char * prog){
+    fprintf(stderr,
+            "usage: %s [-d disk] [-o flags] [-s file_mib] [-n rand_ops] [-r rounds] [-t trace] [-q]\n"
+            "  -d disk      disk file to make (default bench_fs, removed at the end)\n"
+            "  -o flags     comma separated: extents,journal,prealloc,mmap,noreadahead,aiothreads,delalloc\n"
+            "  -s file_mib  size of the read/write/truncate files in MiB (default 64)\n"
+            "  -n rand_ops  operations per random access benchmark (default 20000)\n"
+            "  -r rounds    rounds of the churn, mount and large file (at most 5) benchmarks (default 20)\n"
+            "  -t trace     save a block trace of the run (its newest %d transfers) for ./replay\n"
+            "  -q           quick run with small sizes (for smoke tests)\n", prog, TRACE_RECORDS);
+    exit(2);
+}
+
+static void parse_flags(char * list){
+    static const struct { const char * name; int flag; } names[] = {
+        {"extents", FS_FORMAT_EXTENTS}, {"journal", FS_FORMAT_JOURNAL}, {"prealloc", FS_FORMAT_PREALLOC},
+        {"mmap", FS_MOUNT_MMAP}, {"noreadahead", FS_MOUNT_NO_READAHEAD},
+        {"aiothreads", FS_MOUNT_AIO_THREADS}, {"delalloc", FS_MOUNT_DELALLOC},
+    };
+    snprintf(flag_names, sizeof(flag_names), "%s", list);
+    for (char * name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")){
+        size_t i;
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+            if (strcmp(name, names[i].name) == 0)
+                break;
+        if (i == sizeof(names) / sizeof(names[0])){
+            fprintf(stderr, "ERROR: unknown flag %s\n", name);
+            exit(2);
+        }
+        opts.flags |= names[i].flag;
+    }
+}
+
+int main(int argc, char ** argv){
+    int c;
+    while ((c = getopt(argc, argv, "d:o:s:n:r:t:qh")) != -1){
+        switch (c){
+        case 'd': disk_name = optarg; break;
+        case 'o': parse_flags(optarg); break;
+        case 's': file_bytes = (size_t) atoi(optarg) * MIB; break;
+        case 'n': rand_ops = atoi(optarg); break;
+        case 'r': rounds = atoi(optarg); break;
+        case 't': trace_name = optarg; break;
+        case 'q':
+            file_bytes = 4 * MIB;
+            rand_ops = 2000;
+            rounds = 3;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (file_bytes < MIB || file_bytes > 1024 * MIB || rand_ops <= 0 || rounds <= 0)
+        usage(argv[0]);
+
+    // Room for the seq and rand files together with a large file, and the metadata
+    opts.max_files = MAX_FILES;
+    opts.num_blocks = (int) (3 * file_bytes / BLOCK_SIZE) + 4096;
+    io_buf = (char *) malloc(MIB);
+    if (io_buf == NULL)
+        fail("malloc");
+    for (int i = 0; i < MIB; i++)
+        io_buf[i] = (char) ('a' + i % 26);
+
+    printf("{\"config\":{\"disk\":\"%s\",\"flags\":\"%s\",\"num_blocks\":%d,\"max_files\":%d,"
+           "\"file_bytes\":%zu,\"rand_ops\":%d,\"rounds\":%d}}\n",
+           disk_name, flag_names, opts.num_blocks, opts.max_files, file_bytes, rand_ops, rounds);
+
+    uint64_t t = now_ns();
+    if (make_fs_opts(disk_name, &opts) != 0)
+        fail("make_fs_opts");
+    begin();
+    sample(now_ns() - t);
+    bench_start = t;
+    report("make_fs", 0, 0);
+    if (trace_name != NULL && fs_trace_start(TRACE_RECORDS) != 0)
+        fail("fs_trace_start");
+    do_mount();
+
+    bench_mount("_empty");
+    bench_churn();
+
+    static const size_t seq_sizes[] = {512, 4096, 65536, MIB};
+    for (size_t i = 0; i < sizeof(seq_sizes) / sizeof(seq_sizes[0]); i++)
+        bench_seq(seq_sizes[i]);
+
+    int fd = fill_file("rand");
+    if (fs_close(fd) != 0)
+        fail("fs_close");
+    remount();
+    if ((fd = fs_open("rand")) < 0)
+        fail("fs_open");
+    static const size_t rand_sizes[] = {512, 4096, 65536};
+    for (size_t i = 0; i < sizeof(rand_sizes) / sizeof(rand_sizes[0]); i++)
+        bench_random(fd, rand_sizes[i], 0);
+    for (size_t i = 0; i < sizeof(rand_sizes) / sizeof(rand_sizes[0]); i++)
+        bench_random(fd, rand_sizes[i], 1);
+    bench_lseek(fd);
+    if (fs_close(fd) != 0)
+        fail("fs_close");
+
+    bench_append(64);
+    bench_append(1024);
+    bench_large();
+
+    // Mounting a disk with files on it reads more metadata than an empty one
+    for (int i = 0; i < MAX_FILES / 2; i++){
+        char name[16];
+        snprintf(name, sizeof(name), "small%d", i);
+        fd = open_new(name);
+        if (fs_write(fd, io_buf, 1000) != 1000 || fs_close(fd) != 0)
+            fail("fs_write");
+    }
+    bench_mount("");
+
+    do_umount();
+    if (trace_name != NULL && (fs_trace_save(trace_name) != 0 || fs_trace_stop() != 0))
+        fail("fs_trace_save");
+    unlink(disk_name);
+    free(io_buf);
+    free(lat);
+    return 0;
+}
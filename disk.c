@@ -8,35 +8,334 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE /* <linux/fs.h> has its own, disk.h's is the one used here */
 
 #include "disk.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifndef DISK_IO_WORKERS
+#define DISK_IO_WORKERS 4 /* threads serving requests without io_uring */
+#endif
+
 /******************************************************************************/
-static int active = 0; /* is the virtual disk open (active) */
-static int handle; /* file handle to virtual disk       */
+enum { IO_NONE, IO_URING, IO_THREADS, IO_MAP };
+
+/* everything about one open disk; a thread works on the disk picked with   */
+/* disk_use, by default the one disk a process used to be limited to        */
+struct disk {
+	int active; /* is the virtual disk open (active) */
+	int handle; /* file handle to virtual disk       */
+	char *map; /* disk mapping (mmap backend only)  */
+	int blocks; /* number of blocks on the open disk */
+	disk_hook hook; /* told about each transfer (see disk_set_hook) */
+
+	/* block trace: a ring of trace_size records, trace_next is the number
+	 * ever taken (the newest trace_size of them are kept) */
+	struct disk_trace_rec *trace;
+	unsigned long trace_size;
+	unsigned long trace_next;
+	uint64_t trace_epoch; /* CLOCK_MONOTONIC ns at disk_trace_start */
+	int trace_users;      /* threads writing or saving records right now */
+
+	/* asynchronous engine state (guarded by io_lock) */
+	int io_mode;
+	pthread_mutex_t io_lock;
+	pthread_cond_t io_cond;
+	struct disk_io *io_queue, *io_queue_tail; /* submitted, not started */
+	struct disk_io *io_done, *io_done_tail;   /* completed, not reaped  */
+	int io_depth;     /* most requests started at once               */
+	int io_inflight;  /* submitted and not completed                 */
+	int io_started;   /* io_uring: handed to the kernel              */
+	int io_reaping;   /* io_uring: a thread is waiting in the kernel */
+	int io_stopping;  /* thread pool: workers should exit            */
+	pthread_t io_workers[DISK_IO_WORKERS];
+
+	/* io_uring rings, mapped from ring_fd */
+	int ring_fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+#define DISK_INIT { .io_mode = IO_NONE, .io_lock = PTHREAD_MUTEX_INITIALIZER, \
+		    .io_cond = PTHREAD_COND_INITIALIZER, .ring_fd = -1 }
+
+static struct disk default_disk = DISK_INIT;
+static __thread struct disk *disk = &default_disk;
 /******************************************************************************/
 
+struct disk *disk_new()
+{
+	struct disk *d;
+
+	if (!(d = malloc(sizeof(*d)))) {
+		perror("disk_new: cannot allocate disk");
+		return NULL;
+	}
+	*d = (struct disk) DISK_INIT;
+
+	return d;
+}
+
+void disk_free(struct disk *d)
+{
+	if (d && d != &default_disk) {
+		free(d->trace);
+		pthread_mutex_destroy(&d->io_lock);
+		pthread_cond_destroy(&d->io_cond);
+		free(d);
+	}
+}
+
+struct disk *disk_use(struct disk *d)
+{
+	struct disk *prev = disk;
+
+	disk = d ? d : &default_disk;
+
+	return prev;
+}
+
+void disk_set_hook(disk_hook hook)
+{
+	disk->hook = hook;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int disk_trace_start(int records)
+{
+	struct disk_trace_rec *trace;
+
+	if (records <= 0) {
+		fprintf(stderr, "disk_trace_start: invalid number of records\n");
+		return -1;
+	}
+	if (disk->trace) {
+		fprintf(stderr, "disk_trace_start: already tracing\n");
+		return -1;
+	}
+	if (!(trace = calloc(records, sizeof(*trace)))) {
+		perror("disk_trace_start: cannot allocate trace");
+		return -1;
+	}
+
+	disk->trace_size = records;
+	disk->trace_next = 0;
+	disk->trace_epoch = now_ns();
+	__atomic_store_n(&disk->trace, trace, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* take the ring for writing or saving records (NULL if not tracing): the
+ * count goes up before the pointer is read again, so disk_trace_stop, which
+ * clears the pointer before waiting for the count, never frees it under us */
+static struct disk_trace_rec *trace_get()
+{
+	struct disk_trace_rec *trace;
+
+	if (!__atomic_load_n(&disk->trace, __ATOMIC_ACQUIRE))
+		return NULL;
+	__atomic_fetch_add(&disk->trace_users, 1, __ATOMIC_SEQ_CST);
+	if (!(trace = __atomic_load_n(&disk->trace, __ATOMIC_SEQ_CST)))
+		__atomic_fetch_sub(&disk->trace_users, 1, __ATOMIC_RELEASE);
+
+	return trace;
+}
+
+static void trace_put()
+{
+	__atomic_fetch_sub(&disk->trace_users, 1, __ATOMIC_RELEASE);
+}
+
+int disk_trace_stop()
+{
+	struct disk_trace_rec *trace;
+
+	if (!(trace = __atomic_exchange_n(&disk->trace, NULL, __ATOMIC_SEQ_CST))) {
+		fprintf(stderr, "disk_trace_stop: not tracing\n");
+		return -1;
+	}
+
+	/* background threads may be recording a transfer right now */
+	while (__atomic_load_n(&disk->trace_users, __ATOMIC_ACQUIRE) > 0)
+		sched_yield();
+	free(trace);
+
+	return 0;
+}
+
+int disk_trace_save(const char *name)
+{
+	struct disk_trace_hdr hdr;
+	unsigned long next, first, i;
+	struct disk_trace_rec *trace, *rec;
+	FILE *f;
+
+	if (!(trace = trace_get())) {
+		fprintf(stderr, "disk_trace_save: not tracing\n");
+		return -1;
+	}
+
+	next = __atomic_load_n(&disk->trace_next, __ATOMIC_ACQUIRE);
+	first = (next > disk->trace_size) ? next - disk->trace_size : 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DISK_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.rec_size = sizeof(struct disk_trace_rec);
+	hdr.count = next - first;
+	hdr.dropped = first;
+	hdr.blocks = disk->blocks;
+	for (i = first; i < next; ++i) {
+		rec = &trace[i % disk->trace_size];
+		if (rec->block + rec->count > hdr.blocks)
+			hdr.blocks = rec->block + rec->count;
+	}
+
+	if (!(f = fopen(name, "wb"))) {
+		perror("disk_trace_save: cannot create trace file");
+		trace_put();
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto fail;
+	/* oldest first: the end of the ring, then its start */
+	for (i = first; i < next; ) {
+		unsigned long at = i % disk->trace_size;
+		unsigned long n = disk->trace_size - at;
+
+		if (n > next - i)
+			n = next - i;
+		if (fwrite(&trace[at], sizeof(struct disk_trace_rec), n, f) != n)
+			goto fail;
+		i += n;
+	}
+	trace_put();
+	if (fclose(f) != 0) {
+		perror("disk_trace_save: cannot write trace file");
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	perror("disk_trace_save: cannot write trace file");
+	trace_put();
+	fclose(f);
+	return -1;
+}
+
+/* tell the hook and the trace about a transfer, in the thread asking for it */
+static void note_io(int block, int count, int write, int async)
+{
+	struct disk_trace_rec *trace, *rec;
+	unsigned long i;
+	int tag = 0;
+
+	if (disk->hook)
+		tag = disk->hook(block, count, write);
+
+	if (!(trace = trace_get()))
+		return;
+
+	/* the count field is 16 bits: longer transfers take several records */
+	do {
+		int n = (count > UINT16_MAX) ? UINT16_MAX : count;
+
+		i = __atomic_fetch_add(&disk->trace_next, 1, __ATOMIC_RELAXED);
+		rec = &trace[i % disk->trace_size];
+		rec->time = now_ns() - disk->trace_epoch;
+		rec->block = block;
+		rec->count = n;
+		rec->flags = (write ? DISK_TRACE_WRITE : 0) |
+			     (async ? DISK_TRACE_ASYNC : 0);
+		rec->tag = tag;
+		block += n;
+		count -= n;
+	} while (count > 0);
+	trace_put();
+}
+
 int make_disk(const char *name)
 {
-	int f, cnt;
-	char buf[BLOCK_SIZE];
+	return make_disk_size(name, DISK_BLOCKS);
+}
+
+int make_disk_size(const char *name, int size)
+{
+	int f;
 
 	if (!name) {
 		fprintf(stderr, "make_disk: invalid file name\n");
 		return -1;
 	}
 
+	if (size <= 0) {
+		fprintf(stderr, "make_disk: invalid disk size\n");
+		return -1;
+	}
+
 	if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
 		perror("make_disk: cannot open file");
 		return -1;
 	}
 
-	memset(buf, 0, BLOCK_SIZE);
-	for (cnt = 0; cnt < DISK_BLOCKS; ++cnt) {
-		if (write(f, buf, BLOCK_SIZE) < 0) {
-			perror("make_disk: failed to write");
-			return -1;
-		}
+	/* setting the length leaves a hole that reads as zeros, so no block
+	 * has to be written */
+	if (ftruncate(f, (off_t) size * BLOCK_SIZE) < 0) {
+		perror("make_disk: failed to set disk size");
+		close(f);
+		return -1;
+	}
+
+	close(f);
+
+	return 0;
+}
+
+int make_disk_alloc(const char *name, int size)
+{
+	int f, err;
+
+	if (make_disk_size(name, size) < 0)
+		return -1;
+
+	if ((f = open(name, O_WRONLY)) < 0) {
+		perror("make_disk: cannot open file");
+		return -1;
+	}
+
+	/* allocates without writing where the file system supports it (glibc
+	 * falls back to writing zeros otherwise) */
+	if ((err = posix_fallocate(f, 0, (off_t) size * BLOCK_SIZE)) != 0) {
+		errno = err;
+		perror("make_disk: failed to allocate disk");
+		close(f);
+		return -1;
 	}
 
 	close(f);
@@ -47,13 +346,14 @@ int make_disk(const char *name)
 int open_disk(const char *name)
 {
 	int f;
+	struct stat st;
 
 	if (!name) {
 		fprintf(stderr, "open_disk: invalid file name\n");
 		return -1;
 	}
 
-	if (active) {
+	if (disk->active) {
 		fprintf(stderr, "open_disk: disk is already open\n");
 		return -1;
 	}
@@ -63,28 +363,107 @@ int open_disk(const char *name)
 		return -1;
 	}
 
-	handle = f;
-	active = 1;
+	if (fstat(f, &st) < 0) {
+		perror("open_disk: cannot stat file");
+		close(f);
+		return -1;
+	}
+
+	disk->handle = f;
+	disk->blocks = st.st_size / BLOCK_SIZE;
+	disk->active = 1;
+
+	return 0;
+}
+
+int open_disk_mmap(const char *name)
+{
+	void *m;
+
+	if (open_disk(name) < 0)
+		return -1;
+
+	m = mmap(NULL, (size_t)disk->blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED, disk->handle, 0);
+	if (m == MAP_FAILED) {
+		perror("open_disk_mmap: cannot map disk");
+		close_disk();
+		return -1;
+	}
+
+	disk->map = m;
+
+	return 0;
+}
+
+int sync_disk()
+{
+	if (!disk->active) {
+		fprintf(stderr, "sync_disk: no open disk\n");
+		return -1;
+	}
+
+	if (disk->map) {
+		if (msync(disk->map, (size_t)disk->blocks * BLOCK_SIZE, MS_SYNC) < 0) {
+			perror("sync_disk: failed to msync");
+			return -1;
+		}
+	} else if (fdatasync(disk->handle) < 0) {
+		perror("sync_disk: failed to fdatasync");
+		return -1;
+	}
 
 	return 0;
 }
 
 int close_disk()
 {
-	if (!active) {
+	int ret = 0;
+
+	if (!disk->active) {
 		fprintf(stderr, "close_disk: no open disk\n");
 		return -1;
 	}
 
-	close(handle);
+	if (disk->io_mode != IO_NONE && disk_io_stop() < 0)
+		ret = -1;
+
+	if (disk->map) {
+		if (msync(disk->map, (size_t)disk->blocks * BLOCK_SIZE, MS_SYNC) < 0) {
+			perror("close_disk: failed to msync");
+			ret = -1;
+		}
+		munmap(disk->map, (size_t)disk->blocks * BLOCK_SIZE);
+		disk->map = NULL;
+	}
+
+	close(disk->handle);
 
-	active = handle = 0;
+	disk->active = disk->handle = disk->blocks = 0;
 
-	return 0;
+	return ret;
+}
+
+void *block_ptr(int block)
+{
+	if (!disk->active || !disk->map || (block < 0) || (block >= disk->blocks))
+		return NULL;
+
+	return disk->map + (size_t)block * BLOCK_SIZE;
+}
+
+int disk_size()
+{
+	if (!disk->active) {
+		fprintf(stderr, "disk_size: no open disk\n");
+		return -1;
+	}
+
+	return disk->blocks;
 }
 
 int is_disk_open(){
-	if(active)
+	if(disk->active)
 		return 1;
 	else
 		return 0;
@@ -92,50 +471,544 @@ int is_disk_open(){
 
 int block_write(int block, const void *buf)
 {
-	if (!active) {
-		fprintf(stderr, "block_write: disk not active\n");
+	return block_write_range(block, 1, buf);
+}
+
+int block_read(int block, void *buf)
+{
+	return block_read_range(block, 1, buf);
+}
+
+/* check that count blocks starting at block are on an open disk */
+static int check_range(const char *fn, int block, int count)
+{
+	if (!disk->active) {
+		fprintf(stderr, "%s: disk not active\n", fn);
 		return -1;
 	}
 
-	if ((block < 0) || (block >= DISK_BLOCKS)) {
-		fprintf(stderr, "block_write: block index out of bounds\n");
+	if ((block < 0) || (count < 0) || (block > disk->blocks - count)) {
+		fprintf(stderr, "%s: block index out of bounds\n", fn);
 		return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_write: failed to lseek");
+	return 0;
+}
+
+/* block_write_range without telling the hook (async requests were counted
+ * when submitted) */
+static int write_range(int block, int count, const void *buf)
+{
+	off_t pos = (off_t)block * BLOCK_SIZE;
+	size_t left = (size_t)count * BLOCK_SIZE;
+	ssize_t n;
+
+	if (check_range("block_write_range", block, count) < 0)
 		return -1;
+
+	if (disk->map) {
+		memcpy(disk->map + pos, buf, left);
+		return 0;
+	}
+
+	while (left > 0) {
+		if ((n = pwrite(disk->handle, buf, left, pos)) < 0) {
+			perror("block_write_range: failed to write");
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		pos += n;
+		left -= n;
 	}
 
-	if (write(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_write: failed to write");
+	return 0;
+}
+
+/* block_read_range without telling the hook */
+static int read_range(int block, int count, void *buf)
+{
+	off_t pos = (off_t)block * BLOCK_SIZE;
+	size_t left = (size_t)count * BLOCK_SIZE;
+	ssize_t n;
+
+	if (check_range("block_read_range", block, count) < 0)
 		return -1;
+
+	if (disk->map) {
+		memcpy(buf, disk->map + pos, left);
+		return 0;
+	}
+
+	while (left > 0) {
+		if ((n = pread(disk->handle, buf, left, pos)) < 0) {
+			perror("block_read_range: failed to read");
+			return -1;
+		}
+		if (n == 0) {
+			fprintf(stderr, "block_read_range: unexpected end of disk\n");
+			return -1;
+		}
+		buf = (char *)buf + n;
+		pos += n;
+		left -= n;
 	}
 
 	return 0;
 }
 
-int block_read(int block, void *buf)
+int block_write_range(int block, int count, const void *buf)
+{
+	note_io(block, count, 1, 0);
+	return write_range(block, count, buf);
+}
+
+int block_read_range(int block, int count, void *buf)
+{
+	note_io(block, count, 0, 0);
+	return read_range(block, count, buf);
+}
+
+/* move count blocks starting at block to/from bufs[0..count-1], IOV_MAX
+ * blocks per system call; a short transfer restarts at the first block not
+ * completely done */
+static int block_rwv(const char *fn, int write, int block, int count,
+		     void * const bufs[])
 {
-	if (!active) {
-		fprintf(stderr, "block_read: disk not active\n");
+	struct iovec iov[IOV_MAX];
+	ssize_t n;
+	int i, batch;
+
+	if (check_range(fn, block, count) < 0)
 		return -1;
+
+	note_io(block, count, write, 0);
+
+	if (disk->map) {
+		for (i = 0; i < count; ++i) {
+			if (write)
+				memcpy(disk->map + (size_t)(block + i) * BLOCK_SIZE, bufs[i], BLOCK_SIZE);
+			else
+				memcpy(bufs[i], disk->map + (size_t)(block + i) * BLOCK_SIZE, BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	while (count > 0) {
+		batch = (count < IOV_MAX) ? count : IOV_MAX;
+		for (i = 0; i < batch; ++i) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+
+		if (write)
+			n = pwritev(disk->handle, iov, batch, (off_t)block * BLOCK_SIZE);
+		else
+			n = preadv(disk->handle, iov, batch, (off_t)block * BLOCK_SIZE);
+		if (n < 0) {
+			perror(fn);
+			return -1;
+		}
+		if (n < BLOCK_SIZE) {
+			/* finish the partial block on its own */
+			if ((write ? write_range(block, 1, bufs[0])
+				   : read_range(block, 1, bufs[0])) < 0)
+				return -1;
+			n = BLOCK_SIZE;
+		}
+
+		n /= BLOCK_SIZE;
+		block += n;
+		bufs += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int block_writev(int block, int count, const void * const bufs[])
+{
+	return block_rwv("block_writev", 1, block, count, (void * const *)bufs);
+}
+
+int block_readv(int block, int count, void * const bufs[])
+{
+	return block_rwv("block_readv", 0, block, count, bufs);
+}
+
+/* append io to a request list */
+static void io_push(struct disk_io **head, struct disk_io **tail,
+		    struct disk_io *io)
+{
+	io->next = NULL;
+	if (*head)
+		(*tail)->next = io;
+	else
+		*head = io;
+	*tail = io;
+}
+
+/* take the first request off a list (NULL if empty) */
+static struct disk_io *io_pop(struct disk_io **head)
+{
+	struct disk_io *io = *head;
+
+	if (io)
+		*head = io->next;
+	return io;
+}
+
+/* run a request synchronously, setting its result */
+static void io_run(struct disk_io *io)
+{
+	if (io->write)
+		io->result = write_range(io->block, io->count, io->buf);
+	else
+		io->result = read_range(io->block, io->count, io->buf);
+}
+
+/* mark a request complete (io_lock held) */
+static void io_complete(struct disk_io *io)
+{
+	io_push(&disk->io_done, &disk->io_done_tail, io);
+	disk->io_inflight--;
+	pthread_cond_broadcast(&disk->io_cond);
+}
+
+/* thread pool worker: run queued requests until disk_io_stop */
+static void *io_worker(void *arg)
+{
+	struct disk_io *io;
+
+	disk = arg;
+	pthread_mutex_lock(&disk->io_lock);
+	for (;;) {
+		while (!disk->io_queue && !disk->io_stopping)
+			pthread_cond_wait(&disk->io_cond, &disk->io_lock);
+		if (!disk->io_queue)
+			break;
+
+		io = io_pop(&disk->io_queue);
+		pthread_mutex_unlock(&disk->io_lock);
+		io_run(io);
+		pthread_mutex_lock(&disk->io_lock);
+		io_complete(io);
 	}
+	pthread_mutex_unlock(&disk->io_lock);
+
+	return NULL;
+}
+
+/* set up an io_uring with room for depth requests and map its rings */
+static int uring_setup(int depth)
+{
+	struct io_uring_params p;
 
-	if ((block < 0) || (block >= DISK_BLOCKS)) {
-		fprintf(stderr, "block_read: block index out of bounds\n");
+	memset(&p, 0, sizeof(p));
+	disk->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (disk->ring_fd < 0)
 		return -1;
+
+	disk->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	disk->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	disk->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (disk->cq_ring_size > disk->sq_ring_size)
+			disk->sq_ring_size = disk->cq_ring_size;
+		disk->cq_ring_size = disk->sq_ring_size;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_read: failed to lseek");
+	disk->sq_ring = mmap(NULL, disk->sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, disk->ring_fd, IORING_OFF_SQ_RING);
+	if (disk->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		disk->cq_ring = disk->sq_ring;
+	else {
+		disk->cq_ring = mmap(NULL, disk->cq_ring_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, disk->ring_fd, IORING_OFF_CQ_RING);
+		if (disk->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+	disk->sqes = mmap(NULL, disk->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, disk->ring_fd, IORING_OFF_SQES);
+	if (disk->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	disk->sq_head = (unsigned *)((char *)disk->sq_ring + p.sq_off.head);
+	disk->sq_tail = (unsigned *)((char *)disk->sq_ring + p.sq_off.tail);
+	disk->sq_mask = (unsigned *)((char *)disk->sq_ring + p.sq_off.ring_mask);
+	disk->sq_array = (unsigned *)((char *)disk->sq_ring + p.sq_off.array);
+	disk->cq_head = (unsigned *)((char *)disk->cq_ring + p.cq_off.head);
+	disk->cq_tail = (unsigned *)((char *)disk->cq_ring + p.cq_off.tail);
+	disk->cq_mask = (unsigned *)((char *)disk->cq_ring + p.cq_off.ring_mask);
+	disk->cqes = (struct io_uring_cqe *)((char *)disk->cq_ring + p.cq_off.cqes);
+
+	/* the completion ring is at least as big, so it never overflows */
+	disk->io_depth = p.sq_entries;
+	return 0;
+
+fail_cq:
+	if (disk->cq_ring != disk->sq_ring)
+		munmap(disk->cq_ring, disk->cq_ring_size);
+fail_sq:
+	munmap(disk->sq_ring, disk->sq_ring_size);
+fail:
+	close(disk->ring_fd);
+	disk->ring_fd = -1;
+	return -1;
+}
+
+/* release the io_uring */
+static void uring_teardown()
+{
+	munmap(disk->sqes, disk->sqes_size);
+	if (disk->cq_ring != disk->sq_ring)
+		munmap(disk->cq_ring, disk->cq_ring_size);
+	munmap(disk->sq_ring, disk->sq_ring_size);
+	close(disk->ring_fd);
+	disk->ring_fd = -1;
+}
+
+/* queue the rest of a request in the submission ring (io_lock held) */
+static void uring_push(struct disk_io *io)
+{
+	unsigned tail = *disk->sq_tail;
+	unsigned idx = tail & *disk->sq_mask;
+	struct io_uring_sqe *sqe = &disk->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = disk->handle;
+	sqe->addr = (unsigned long)((char *)io->buf + io->done);
+	sqe->len = (size_t)io->count * BLOCK_SIZE - io->done;
+	sqe->off = (off_t)io->block * BLOCK_SIZE + io->done;
+	sqe->user_data = (unsigned long)io;
+	disk->sq_array[idx] = idx;
+	__atomic_store_n(disk->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* hand new ring entries to the kernel (io_lock held), or wait for a
+ * completion if wait is set (without io_lock, so nothing is submitted) */
+static int uring_enter(int wait)
+{
+	unsigned pending = 0;
+	int ret;
+
+	if (!wait)
+		pending = *disk->sq_tail - __atomic_load_n(disk->sq_head, __ATOMIC_ACQUIRE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, disk->ring_fd, pending, wait ? 1 : 0,
+			      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && errno != EAGAIN && errno != EBUSY) {
+		perror("disk_io: io_uring_enter failed");
 		return -1;
 	}
 
-	if (read(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_read: failed to read");
+	return 0;
+}
+
+/* start queued requests while there is room in the ring (io_lock held) */
+static void uring_start_queued()
+{
+	int n = 0;
+
+	while (disk->io_queue && disk->io_started < disk->io_depth) {
+		uring_push(io_pop(&disk->io_queue));
+		disk->io_started++;
+		n++;
+	}
+	if (n)
+		uring_enter(0);
+}
+
+/* move finished requests from the completion ring to the done list,
+ * resubmitting the rest of short transfers (io_lock held) */
+static void uring_collect()
+{
+	unsigned head = *disk->cq_head;
+	unsigned tail = __atomic_load_n(disk->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct disk_io *io;
+	size_t len;
+
+	for (; head != tail; head++) {
+		cqe = &disk->cqes[head & *disk->cq_mask];
+		io = (struct disk_io *)(unsigned long)cqe->user_data;
+		len = (size_t)io->count * BLOCK_SIZE;
+
+		if (cqe->res > 0 && io->done + cqe->res < len) {
+			io->done += cqe->res;
+			uring_push(io);
+			uring_enter(0);
+			continue;
+		}
+		if (cqe->res < 0 || (cqe->res == 0 && len > 0)) {
+			errno = cqe->res < 0 ? -cqe->res : EIO;
+			perror(io->write ? "disk_io: failed to write" : "disk_io: failed to read");
+			io->result = -1;
+		} else
+			io->result = 0;
+		disk->io_started--;
+		io_complete(io);
+	}
+	__atomic_store_n(disk->cq_head, head, __ATOMIC_RELEASE);
+	uring_start_queued();
+}
+
+int disk_io_start(int depth, int flags)
+{
+	int i;
+
+	if (!disk->active) {
+		fprintf(stderr, "disk_io_start: disk not active\n");
+		return -1;
+	}
+	if (disk->io_mode != IO_NONE) {
+		fprintf(stderr, "disk_io_start: already started\n");
 		return -1;
 	}
+	if (depth <= 0)
+		depth = 1;
+
+	disk->io_queue = disk->io_done = NULL;
+	disk->io_inflight = disk->io_started = disk->io_reaping = disk->io_stopping = 0;
+	disk->io_depth = depth;
+
+	if (disk->map) {
+		disk->io_mode = IO_MAP;
+		return 0;
+	}
+
+	if (!(flags & DISK_IO_THREADS) && uring_setup(depth) == 0) {
+		disk->io_mode = IO_URING;
+		return 0;
+	}
+
+	for (i = 0; i < DISK_IO_WORKERS; ++i) {
+		if (pthread_create(&disk->io_workers[i], NULL, io_worker, disk) != 0) {
+			fprintf(stderr, "disk_io_start: cannot start worker thread\n");
+			pthread_mutex_lock(&disk->io_lock);
+			disk->io_stopping = 1;
+			pthread_cond_broadcast(&disk->io_cond);
+			pthread_mutex_unlock(&disk->io_lock);
+			while (i-- > 0)
+				pthread_join(disk->io_workers[i], NULL);
+			return -1;
+		}
+	}
+	disk->io_mode = IO_THREADS;
+
+	return 0;
+}
+
+int disk_io_submit(struct disk_io *io)
+{
+	if (disk->io_mode == IO_NONE) {
+		fprintf(stderr, "disk_io_submit: engine not started\n");
+		return -1;
+	}
+	if (check_range("disk_io_submit", io->block, io->count) < 0)
+		return -1;
+
+	io->done = 0;
+	io->result = -1;
+	note_io(io->block, io->count, io->write, 1);
+
+	pthread_mutex_lock(&disk->io_lock);
+	disk->io_inflight++;
+	if (disk->io_mode == IO_MAP) {
+		io_run(io);
+		io_complete(io);
+	} else if (disk->io_mode == IO_URING && disk->io_started < disk->io_depth) {
+		uring_push(io);
+		disk->io_started++;
+		uring_enter(0);
+	} else {
+		io_push(&disk->io_queue, &disk->io_queue_tail, io);
+		pthread_cond_signal(&disk->io_cond);
+	}
+	pthread_mutex_unlock(&disk->io_lock);
 
 	return 0;
 }
+
+int disk_io_reap(struct disk_io **done, int max, int wait)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&disk->io_lock);
+	for (;;) {
+		if (disk->io_mode == IO_URING)
+			uring_collect();
+		while (n < max && disk->io_done)
+			done[n++] = io_pop(&disk->io_done);
+		if (n > 0 || !wait || disk->io_inflight == 0)
+			break;
+
+		/* one thread waits in the kernel, the others for it to collect */
+		if (disk->io_mode != IO_URING || disk->io_reaping) {
+			pthread_cond_wait(&disk->io_cond, &disk->io_lock);
+			continue;
+		}
+		disk->io_reaping = 1;
+		pthread_mutex_unlock(&disk->io_lock);
+		uring_enter(1);
+		pthread_mutex_lock(&disk->io_lock);
+		disk->io_reaping = 0;
+		pthread_cond_broadcast(&disk->io_cond);
+	}
+	pthread_mutex_unlock(&disk->io_lock);
+
+	return n;
+}
+
+int disk_io_stop()
+{
+	int i;
+
+	if (disk->io_mode == IO_NONE)
+		return 0;
+
+	/* requests still in flight finish, completed ones are dropped */
+	pthread_mutex_lock(&disk->io_lock);
+	while (disk->io_inflight > 0) {
+		if (disk->io_mode == IO_URING) {
+			uring_collect();
+			if (disk->io_inflight == 0)
+				break;
+			pthread_mutex_unlock(&disk->io_lock);
+			uring_enter(1);
+			pthread_mutex_lock(&disk->io_lock);
+		} else
+			pthread_cond_wait(&disk->io_cond, &disk->io_lock);
+	}
+	disk->io_done = NULL;
+	disk->io_stopping = 1;
+	pthread_cond_broadcast(&disk->io_cond);
+	pthread_mutex_unlock(&disk->io_lock);
+
+	if (disk->io_mode == IO_THREADS)
+		for (i = 0; i < DISK_IO_WORKERS; ++i)
+			pthread_join(disk->io_workers[i], NULL);
+	else if (disk->io_mode == IO_URING)
+		uring_teardown();
+	disk->io_mode = IO_NONE;
+
+	return 0;
+}
+
+const char *disk_io_backend()
+{
+	switch (disk->io_mode) {
+	case IO_URING:
+		return "io_uring";
+	case IO_THREADS:
+		return "threads";
+	case IO_MAP:
+		return "mmap";
+	default:
+		return "none";
+	}
+}
@@ -1,20 +1,126 @@
 #ifndef _DISK_H_
 #define _DISK_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 /******************************************************************************/
-#define DISK_BLOCKS  15000      /* number of blocks on the disk                */
+#define DISK_BLOCKS  15000      /* default number of blocks on the disk        */
 #define BLOCK_SIZE   4096      /* block size on "disk"                        */
 
 /******************************************************************************/
+/* a process can have many disks open at once: each thread works on the       */
+/* disk it picked with disk_use (the default one until then)                  */
+struct disk;
+struct disk *disk_new();       /* state for one more disk (not open yet)      */
+void disk_free(struct disk *d);/* release a disk made by disk_new (closed)    */
+struct disk *disk_use(struct disk *d);
+                               /* make the calling thread's disk calls use d  */
+                               /* (NULL for the default disk), returning the  */
+                               /* disk they used before                       */
+
+typedef int (*disk_hook)(int block, int count, int write);
+void disk_set_hook(disk_hook hook);
+                               /* call hook(block, count, write) before each  */
+                               /* transfer of the calling thread's disk, in   */
+                               /* the thread asking for it (NULL for none);   */
+                               /* it returns the tag of the trace record      */
+
+/******************************************************************************/
+/* block trace: a disk can record its transfers in a ring of records (the     */
+/* newest are kept), saved to a file as a struct disk_trace_hdr followed by   */
+/* the records, oldest first                                                  */
+#define DISK_TRACE_MAGIC "DISKTRC1"
+#define DISK_TRACE_WRITE 0x1   /* the transfer was a write                    */
+#define DISK_TRACE_ASYNC 0x2   /* it was submitted to the async engine        */
+
+struct disk_trace_rec {
+	uint64_t time;         /* ns since disk_trace_start                   */
+	uint32_t block;        /* first block                                 */
+	uint16_t count;        /* number of blocks                            */
+	uint8_t flags;         /* DISK_TRACE_*                                */
+	uint8_t tag;           /* returned by the disk's hook (0 without one) */
+};
+
+struct disk_trace_hdr {
+	char magic[8];         /* DISK_TRACE_MAGIC                            */
+	uint32_t rec_size;     /* sizeof(struct disk_trace_rec)               */
+	uint32_t blocks;       /* blocks the disk had (or the records reach)  */
+	uint64_t count;        /* records in the file                         */
+	uint64_t dropped;      /* older records overwritten in the ring       */
+};
+
+int disk_trace_start(int records);
+                               /* record the transfers of the calling         */
+                               /* thread's disk, keeping the newest records   */
+                               /* (open or not, across close_disk)            */
+int disk_trace_stop();         /* stop recording and free the records (once   */
+                               /* no thread is recording a transfer)          */
+int disk_trace_save(const char *name);
+                               /* write the records to trace file name        */
+/******************************************************************************/
+
 int make_disk(const char *name);     /* create an empty, virtual disk file          */
+int make_disk_size(const char *name, int size);
+                               /* create an empty disk of size blocks (a      */
+                               /* sparse file, reads as zeros)                */
+int make_disk_alloc(const char *name, int size);
+                               /* same, with the file's space reserved        */
 int open_disk(const char *name);     /* open a virtual disk (file)                  */
+int open_disk_mmap(const char *name);
+                               /* open a virtual disk and map it into memory  */
 int close_disk();              /* close a previously opened disk (file)       */
+int sync_disk();               /* flush disk contents to stable storage       */
 int is_disk_open();
+int disk_size();               /* number of blocks on the open disk           */
+void *block_ptr(int block);    /* address of a block in the disk mapping      */
+                               /* (NULL unless opened with open_disk_mmap)    */
 
 int block_write(int block, const void *buf);
                                /* write a block of size BLOCK_SIZE to disk    */
 int block_read(int block, void *buf);
                                /* read a block of size BLOCK_SIZE from disk   */
+int block_write_range(int block, int count, const void *buf);
+                               /* write count consecutive blocks from buf     */
+int block_read_range(int block, int count, void *buf);
+                               /* read count consecutive blocks into buf      */
+int block_writev(int block, int count, const void * const bufs[]);
+                               /* write count consecutive blocks, one buffer  */
+                               /* per block (gathered in one system call)     */
+int block_readv(int block, int count, void * const bufs[]);
+                               /* read count consecutive blocks, one buffer   */
+                               /* per block (scattered in one system call)    */
+/******************************************************************************/
+/* asynchronous block I/O: requests are handed to disk_io_submit and come     */
+/* back through disk_io_reap once complete. io_uring serves them when the     */
+/* kernel has it, otherwise a pool of threads doing pread/pwrite (a mapped    */
+/* disk completes them at once)                                               */
+
+#define DISK_IO_THREADS  0x1   /* disk_io_start: use the thread pool even if  */
+                               /* io_uring is available                       */
+
+struct disk_io {
+	int block;             /* first block                                 */
+	int count;             /* number of blocks                            */
+	void *buf;             /* count * BLOCK_SIZE bytes                    */
+	int write;             /* nonzero to write buf, zero to read into it  */
+	int result;            /* 0 on success, -1 on failure (once reaped)   */
+	void *data;            /* for the caller                              */
+
+	size_t done;           /* used by disk.c while the request is queued  */
+	struct disk_io *next;
+};
+
+int disk_io_start(int depth, int flags);
+                               /* start the engine with depth requests in     */
+                               /* flight at most (after open_disk)            */
+int disk_io_submit(struct disk_io *io);
+                               /* start a request                             */
+int disk_io_reap(struct disk_io **done, int max, int wait);
+                               /* return up to max completed requests in      */
+                               /* done, waiting for one if wait is set        */
+int disk_io_stop();            /* wait for requests in flight and stop        */
+const char *disk_io_backend(); /* "io_uring", "threads", "mmap" or "none"     */
 /******************************************************************************/
 
 #endif
@@ -1,55 +1,583 @@
+#define _GNU_SOURCE     // For pthread_rwlockattr_setkind_np
 #include "fs.h"
 #include "disk.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-
-#define MAX_NUM_FILES 64
+#include <stddef.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#define MAX_NUM_FILES 64        // Default number of files (directory entries and inodes) made by make_fs
+#define MAX_FILES_LIMIT 65535   // Most files a disk can be made with (inode numbers are 16 bits)
 #define MAX_OPEN_FILES 32
 
-// Global variables of disk
+// inode file types
+#define FILE_TYPE_REGULAR 1     // Data mapped by direct, single and double indirect blocks
+#define FILE_TYPE_EXTENT 2      // Data mapped by (start, length) extents
+#define FILE_TYPE_INLINE 3      // Data kept in the inode itself (files of up to INODE_INLINE bytes)
+#define INODE_SIZE 256                                      // Bytes of an inode in the inode table
+#define INODE_INLINE (INODE_SIZE - 2 * (int) sizeof(uint32_t)) // Bytes of data an inline inode holds
+#define INODE_EXTENTS 5                                     // Extents that fit in the inode itself
+#define BLOCK_EXTENTS ((int) (BLOCK_SIZE / sizeof(struct extent)))    // Extents that fit in the extent block
+#define EXTENT_GOAL 32                                      // Free blocks wanted after the start of a new extent
+#define PTRS_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(uint32_t)))  // Block numbers in an indirection block
+#define BLOCK_UNWRITTEN 0x80000000u     // Set in a block number (or an extent's start) mapped by fs_fallocate
+                                        // and not written yet: reads as zeros without touching the disk
 
 // Superblock
+#define FS_MAGIC 0x53465342u    // "BSFS" in the superblock's first word, set by make_fs
+#define FS_VERSION 1            // On-disk layout version; mount_fs refuses any other
 struct super_block {
-    uint16_t dentries;
-    uint16_t free_inode_bitmap;
-    uint16_t free_data_bitmap;
-    uint16_t inode_table;
+    uint32_t magic;     // FS_MAGIC
+    uint32_t version;   // FS_VERSION
+    uint32_t dentries;
+    uint32_t free_inode_bitmap;
+    uint32_t free_data_bitmap;
+    uint32_t inode_table;
+    uint32_t flags;     // FS_FORMAT_* options the disk was made with
+    uint32_t max_files; // Number of directory entries and inodes
+    uint32_t num_blocks;    // Size of the disk in blocks
+    uint32_t journal;       // FS_FORMAT_JOURNAL: first block of the journal (after the inode table)
+    uint32_t journal_blocks;    // FS_FORMAT_JOURNAL: blocks in the journal, its header included
+};
+
+// Extents: a run of length disk blocks starting at start, mapped to consecutive file blocks
+struct extent {
+    uint32_t start;
+    uint32_t length;
 };
-struct super_block * curSuper_block;
 
 // inodes
 struct inode {
     uint32_t file_type;
     uint32_t file_size;
-    uint16_t direct_offset[10];
-    uint16_t single_indirect_offset;
-    uint16_t double_indirect_offset;
+    union {
+        struct {
+            union {
+                uint32_t direct_offset[10];
+                struct extent extents[INODE_EXTENTS];   // Used instead when file_type is FILE_TYPE_EXTENT
+            };
+            uint32_t single_indirect_offset;    // FILE_TYPE_EXTENT: block holding the extents after the first 5
+            uint32_t double_indirect_offset;
+        };
+        char inline_data[INODE_INLINE];     // FILE_TYPE_INLINE: the file's bytes (zeros past file_size)
+    };
 };
-struct inode * curTable;
+#define INODES_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(struct inode)))
 
 // Directory Entries
 struct dir_entry {
+    uint16_t inode_number;
     uint8_t is_used;
-    uint8_t inode_number;
     char name[15];
 };
-struct dir_entry * curDir;
-int file_count;
+#define DIR_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(struct dir_entry)))   // Entries never straddle blocks
+
+// Directory index: hash table from file name to directory entry, rebuilt at mount_fs and kept up
+// to date by fs_create/fs_delete (guarded by dir_lock like the directory itself)
+#define DIR_BUCKETS (vol->max_files * 2)
 
 // File descriptors: Contain inode block #, if it's open, and file offset
 struct fd {
     uint8_t open;
     uint16_t inode;
     int file_offset;
+    pthread_mutex_t lock;   // Held for a whole read/write/seek so the offset moves atomically
+    int ra_next;            // Offset a sequential fs_read would start at (where the last one ended)
+    int ra_window;          // Readahead window in blocks (0 until reads look sequential)
+    int ra_queued;          // First file block not yet handed to the readahead thread
+};
+
+// Block cache: fixed number of write-back block buffers between fs.c and disk.c
+#ifndef CACHE_BLOCKS
+#define CACHE_BLOCKS 256
+#endif
+#define CACHE_BUCKETS (CACHE_BLOCKS * 2)
+
+struct cache_entry {
+    int block;          // Disk block held by this entry (-1 if unused)
+    uint8_t dirty;      // Set if data differs from the copy on disk
+    uint8_t referenced; // CLOCK reference bit, cleared as the hand sweeps past
+    uint8_t busy;       // Set while a thread reads or writes back data without the cache lock
+    int next;           // Next entry in the same hash bucket (-1 ends the chain)
+    int pins;           // Number of cache_pin callers using data in place (never evicted while > 0)
+    char data[BLOCK_SIZE];
+};
+
+// Readahead: fs_read spots sequential reads on a descriptor and queues the file blocks after them,
+// and a background thread reads those blocks (and the indirection blocks mapping them) into the cache
+#ifndef READAHEAD_BLOCKS
+#define READAHEAD_BLOCKS 64     // Largest readahead window in blocks (0 turns readahead off)
+#endif
+#define READAHEAD_MIN 4         // Window used when a descriptor first looks sequential
+#define READAHEAD_QUEUE 16      // Requests waiting for the thread (more are dropped)
+
+struct readahead {
+    int inum;       // File to read ahead in
+    int first;      // First file block
+    int count;      // Number of file blocks
+};
+void readahead_run(int inum, int first, int count);    // Defined after bmap, which it uses
+
+// Asynchronous I/O: fs_aio_read/fs_aio_write map the request, copy partial and cached blocks right
+// away, and hand runs of whole blocks to the disk.c engine. A request completes once all of its
+// disk requests have been reaped, and fs_aio_wait hands it back
+#define AIO_DEPTH 256       // Disk requests the engine keeps in flight at once
+#define AIO_REAP 64         // Disk completions collected per call into disk.c
+
+// A disk request handed to the engine. Writes are listed in aioWrites until they're reaped, so a
+// cache miss on one of their blocks takes the data being written instead of the old disk copy
+struct aio_io {
+    struct disk_io io;      // First, so the struct disk_io the engine hands back is the aio_io
+    struct aio_io * prev;
+    struct aio_io * next;
+};
+
+// Delayed allocation (FS_MOUNT_DELALLOC): bytes written past the end of a file go to a buffer of
+// the inode instead of getting disk blocks right away. The blocks are only allocated when the
+// buffer is flushed (once it holds DELALLOC_BLOCKS blocks, at fs_fsync, fs_sync, async writes and
+// umount_fs, and before each journal commit), all at once so they can come from one contiguous run
+#ifndef DELALLOC_BLOCKS
+#define DELALLOC_BLOCKS 256
+#endif
+
+struct delalloc {
+    char * data;    // Bytes following the end of the file on disk (the inode's file_size)
+    int len;        // Bytes buffered (fs_sync looks at it without the inode lock, so set atomically)
+    int size;       // Bytes allocated for data
+};
+int delalloc_flush_all();   // Defined after fs_write_blocks, which it uses
+
+// Journal (FS_FORMAT_JOURNAL): changed metadata blocks are written to the journal as one transaction
+// (descriptor blocks listing the home blocks, their images, then a commit block with a checksum)
+// and only reach their home blocks after that, through the cache. Changes hold journal_lock shared,
+// and a commit takes it exclusively just long enough to copy the changed blocks, so every change
+// made before a commit starts goes out with it (group commit). Indirection and extent blocks
+// changed since the last commit are kept in a table of their own instead of the cache, so the
+// cache can't write them home first
+#ifndef JOURNAL_BLOCKS
+#define JOURNAL_BLOCKS 1024     // Default journal size in blocks (header included)
+#endif
+#ifndef JOURNAL_COMMIT_MS
+#define JOURNAL_COMMIT_MS 1000  // Longest time a change waits for the commit thread
+#endif
+#define JOURNAL_MAGIC 0x4a524e4c    // Journal header
+#define JOURNAL_DESC 0x4a445343     // Descriptor block
+#define JOURNAL_COMMIT 0x4a434d54   // Commit block
+#define JOURNAL_TAGS ((BLOCK_SIZE - 4 * (int) sizeof(uint32_t)) / (int) sizeof(uint32_t))
+#define JOURNAL_BUCKETS 1024
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t seq;       // Transactions older than this were checkpointed and aren't replayed
+};
+
+struct journal_desc {
+    uint32_t magic;
+    uint32_t seq;       // Transaction the descriptor belongs to
+    uint32_t count;     // Blocks in the transaction
+    uint32_t descs;     // Descriptor blocks in front of the images
+    uint32_t tags[JOURNAL_TAGS];    // Home block of each image (JOURNAL_TAGS per descriptor)
+};
+
+struct journal_commit {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t count;
+    uint32_t checksum;  // Over the tags and images, so a torn transaction isn't replayed
+};
+
+// Indirection or extent block changed since it was last committed
+struct jblock {
+    int block;
+    uint32_t seq;       // Transaction that last changed it
+    int pins;           // cache_pin callers using data in place
+    int dead;           // Freed while pinned: dropped once unpinned, never committed
+    struct jblock * next;   // Next block in the same hash bucket
+    char data[BLOCK_SIZE];
+};
+
+// Block freed while journaling: it stays used in curFreeData until the transaction freeing it is
+// committed (file data) or checkpointed (indirection and extent blocks, whose old images may still
+// be replayed from the journal)
+struct jfree {
+    uint32_t block;
+    uint32_t seq;
+    uint32_t meta;
+};
+
+void journal_forget(int block);     // Defined after the allocator, which uses it
+
+// Mounted volume: everything mount_fs sets up for one disk. Every function works on the calling
+// thread's volume, vol, which is the one mounted by mount_fs unless an fsv_ call switched the thread
+// to another one (see vol_enter), so a process can have many disks mounted at once
+struct fs_volume {
+    struct disk * disk;     // disk.c state of the volume's disk (NULL for the one mount_fs uses)
+
+    // Superblock, inode table and directory
+    struct super_block * curSuper_block;
+    struct inode * curTable;
+    uint8_t * tableLoaded;  // One byte per inode table block, set once the block was read from disk
+    uint32_t * inodeSeq;    // Per inode: last transaction that changed the file (what fs_fsync waits for)
+    struct dir_entry * curDir;
+    int file_count;
+    int max_files;          // Directory entries and inodes on the mounted disk
+    int de_hint;            // Next-fit cursor: free directory entry search starts here
+    int * dirBuckets;       // Directory index: first directory entry in each bucket (-1 if empty)
+    int * dirNext;          // Next directory entry in the same bucket (-1 ends the chain)
+
+    // File descriptors
+    struct fd fileDescriptors[MAX_OPEN_FILES];
+    int fd_count;
+
+    // Free bitmaps
+    uint8_t * curFreeInodes;
+    uint8_t * curFreeData;
+    uint8_t * diskFreeData;     // Data bitmap as it's saved: with a journal, blocks freed since the last
+                                // commit (or checkpoint) are free here but not yet in curFreeData
+    int num_blocks;     // Blocks on the mounted disk (bits in curFreeData)
+    int alloc_hint;     // Next-fit cursor: data block search starts here
+
+    // Metadata blocks (superblock, directory, bitmaps, inode table) changed since they were last saved,
+    // one byte per block. Set by fs_create/fs_delete/fs_write/fs_truncate and the allocator
+    uint8_t * metaDirty;
+    int meta_end;       // First block after the inode table
+    int data_start;     // First block after the journal (meta_end without one)
+    uint8_t * indirMap; // One bit per block, set for blocks used as indirection or extent blocks
+                        // (their kind in the statistics and the block trace)
+
+    // Locks, always taken in this order: journal_lock (held shared by every change, see below),
+    // dir_lock (directory and inode bitmap), fd_table_lock (descriptor table), a descriptor's lock (its
+    // offset), an inode's lock (its data and mapping), alloc_lock (data bitmap and alloc_hint),
+    // jblock_lock (journaled indirection blocks), then cache_lock (block cache)
+    pthread_mutex_t dir_lock;
+    pthread_mutex_t fd_table_lock;
+    pthread_rwlock_t * inode_locks;     // One per inode, allocated at mount_fs
+    pthread_mutex_t alloc_lock;
+
+    // Block cache
+    struct cache_entry * blockCache;
+    int cacheBuckets[CACHE_BUCKETS];
+    int cache_hand;
+    int disk_mapped;    // Set when the disk is mmap'd: the cache is skipped and blocks are used in place
+    struct aio_io * aioWrites;  // Async writes in flight, newest first
+    pthread_mutex_t cache_lock; // Guards the above
+    pthread_cond_t cache_cond;  // Signalled when an entry stops being busy
+
+    // Readahead
+    struct readahead raQueue[READAHEAD_QUEUE];
+    int ra_head;        // Oldest queued request
+    int ra_count;       // Number of queued requests
+    int ra_running;     // Set while the readahead thread runs (between mount_fs and umount_fs)
+    pthread_t ra_thread;
+    pthread_mutex_t ra_lock;    // Guards the queue, taken after any other lock
+    pthread_cond_t ra_cond;
+
+    // Asynchronous I/O
+    struct fs_aio * aioDone;        // Completed requests not yet returned by fs_aio_wait
+    struct fs_aio * aioDoneTail;
+    int aio_inflight;               // Requests submitted and not yet completed
+    int aio_reaping;                // Set while a thread collects disk completions
+    int * aioPending;               // Per inode: requests in flight (delete and truncate wait for 0)
+    pthread_mutex_t aio_lock;       // Guards the above, taken after any other lock but cache_lock
+    pthread_cond_t aio_cond;
+
+    struct delalloc * delayed;  // Per inode, NULL unless mounted with FS_MOUNT_DELALLOC
+
+    // Journal
+    int journaling;             // Set when the mounted disk was made with FS_FORMAT_JOURNAL
+    uint32_t jseq;              // Running transaction (changes since the last commit started)
+    uint32_t jdone;             // Last committed transaction
+    uint32_t jsynced;           // Last transaction committed with a sync (also used without a journal)
+    int jhead;                  // Next free block of the log (after the journal header)
+    int jdirty;                 // Blocks changed in the running transaction (wakes the commit thread)
+    struct jblock * jBuckets[JOURNAL_BUCKETS];
+    struct jfree * jFreed;      // Guarded by alloc_lock
+    int jfreed_count;
+    int jfreed_size;
+    int jcommitting;            // Set while a thread runs a commit
+    int jrunning;               // Set while the commit thread runs
+    pthread_t jthread;
+    pthread_rwlock_t journal_lock;      // Writer-preferring, set up by mount_fs
+    pthread_mutex_t jblock_lock;        // Guards jBuckets, taken before cache_lock
+    pthread_mutex_t jcommit_lock;       // Guards jcommitting, jdone, jsynced and jrunning
+    pthread_cond_t jcommit_cond;        // Signalled when a commit finishes
+    pthread_cond_t jwake_cond;          // Wakes the commit thread early
+    int jwake;                  // Set when the commit thread was woken early
+};
+
+// Initial state of a volume: unmounted, with its locks ready
+#define VOLUME_INIT { \
+    .fileDescriptors = { [0 ... MAX_OPEN_FILES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } }, \
+    .dir_lock = PTHREAD_MUTEX_INITIALIZER, .fd_table_lock = PTHREAD_MUTEX_INITIALIZER, \
+    .alloc_lock = PTHREAD_MUTEX_INITIALIZER, .cache_lock = PTHREAD_MUTEX_INITIALIZER, \
+    .cache_cond = PTHREAD_COND_INITIALIZER, \
+    .ra_lock = PTHREAD_MUTEX_INITIALIZER, .ra_cond = PTHREAD_COND_INITIALIZER, \
+    .aio_lock = PTHREAD_MUTEX_INITIALIZER, .aio_cond = PTHREAD_COND_INITIALIZER, \
+    .jblock_lock = PTHREAD_MUTEX_INITIALIZER, .jcommit_lock = PTHREAD_MUTEX_INITIALIZER, \
+    .jcommit_cond = PTHREAD_COND_INITIALIZER, .jwake_cond = PTHREAD_COND_INITIALIZER }
+
+struct fs_volume default_volume = VOLUME_INIT;     // Mounted by mount_fs
+__thread struct fs_volume * vol = &default_volume;
+
+// Block helper that tells what kind of block (enum fs_io_kind) block is, for the statistics and
+// the block trace
+int block_kind(int block){
+    if (block < vol->meta_end)
+        return FS_IO_META;
+    if (block < vol->data_start)
+        return FS_IO_JOURNAL;
+    if (vol->indirMap != NULL && block < vol->num_blocks &&
+        (__atomic_load_n(&vol->indirMap[block / 8], __ATOMIC_RELAXED) & (0x80 >> block % 8)))
+        return FS_IO_INDIRECT;
+    return FS_IO_DATA;
+}
+
+// Block helper that records whether block is used as an indirection or extent block
+void block_set_indirect(int block, int set){
+    if (vol->indirMap == NULL || block < 0 || block >= vol->num_blocks)
+        return;
+    uint8_t mask = 0x80 >> block % 8;
+    int was = (__atomic_load_n(&vol->indirMap[block / 8], __ATOMIC_RELAXED) & mask) != 0;
+    if (set && !was)
+        __atomic_fetch_or(&vol->indirMap[block / 8], mask, __ATOMIC_RELAXED);
+    else if (!set && was)
+        __atomic_fetch_and(&vol->indirMap[block / 8], (uint8_t) ~mask, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Statistics (fs_get_stats): each thread counts into a struct fs_stats of its own, so counting
+// takes no lock and no cache line is shared between threads. Only a slot's thread changes it (with
+// relaxed atomic stores, so fs_get_stats can add the slots up at any time), and its counts move to
+// statsRetired when the thread exits. fs_reset_stats doesn't touch the slots: it saves the totals
+// in statsBase, which fs_get_stats subtracts. Building with FS_NO_STATS leaves all of it out
+#define STATS_WORDS ((int) (sizeof(struct fs_stats) / sizeof(uint64_t)))
+
+#ifndef FS_NO_STATS
+struct stats_slot {
+    struct fs_stats s;
+    struct stats_slot * prev;
+    struct stats_slot * next;
+};
+
+struct stats_slot * statsThreads;   // Slots of live threads
+struct fs_stats statsRetired;       // Counts of the threads that exited
+struct fs_stats statsBase;          // Totals at the last fs_reset_stats
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;   // Guards the three above
+pthread_key_t stats_key;            // Runs stats_exit when a thread with a slot exits
+pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+__thread struct stats_slot * stats_mine;
+
+// Statistics helper that adds every counter of src to dst (or takes them away if sign is -1)
+void stats_add_all(struct fs_stats * dst, const struct fs_stats * src, int sign){
+    uint64_t * d = (uint64_t *) dst;
+    const uint64_t * w = (const uint64_t *) src;
+    for (int i = 0; i < STATS_WORDS; i++){
+        uint64_t n = __atomic_load_n(&w[i], __ATOMIC_RELAXED);
+        d[i] = (sign > 0) ? d[i] + n : d[i] - n;
+    }
+}
+
+// Statistics helper run at thread exit: folds the thread's counts into statsRetired
+void stats_exit(void * arg){
+    struct stats_slot * slot = (struct stats_slot *) arg;
+    pthread_mutex_lock(&stats_lock);
+    stats_add_all(&statsRetired, &slot->s, 1);
+    if (slot->prev != NULL)
+        slot->prev->next = slot->next;
+    else
+        statsThreads = slot->next;
+    if (slot->next != NULL)
+        slot->next->prev = slot->prev;
+    pthread_mutex_unlock(&stats_lock);
+    stats_mine = NULL;
+    free(slot);
+}
+
+void stats_key_init(){
+    pthread_key_create(&stats_key, stats_exit);
+}
+
+// Statistics helper that returns the calling thread's counters, setting them up on first use
+// (NULL if there's no memory for them, in which case nothing is counted)
+struct fs_stats * stats_get(){
+    if (stats_mine != NULL)
+        return &stats_mine->s;
+
+    pthread_once(&stats_once, stats_key_init);
+    struct stats_slot * slot = (struct stats_slot *) calloc(1, sizeof(struct stats_slot));
+    if (slot == NULL)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    slot->next = statsThreads;
+    if (statsThreads != NULL)
+        statsThreads->prev = slot;
+    statsThreads = slot;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, slot);
+    stats_mine = slot;
+    return &slot->s;
+}
+
+// Statistics helper that adds n to one of the calling thread's counters
+void stat_add(uint64_t * counter, uint64_t n){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+#define STAT_ADD(field, n) do { \
+    struct fs_stats * stats_ = stats_get(); \
+    if (stats_ != NULL) \
+        stat_add(&stats_->field, (n)); \
+} while (0)
+
+// Statistics helper that returns the histogram bucket of a latency (see struct fs_op_stats)
+int stats_bucket(uint64_t ns){
+    if (ns < 8)
+        return (int) ns;
+    if (ns >= (uint64_t) 1 << 40)
+        return FS_STATS_BUCKETS - 1;
+    int e = 63 - __builtin_clzll(ns);
+    return (e - 2) * 8 + (int) ((ns >> (e - 3)) & 7);
+}
+
+// Statistics helper that counts a transfer of count blocks from block
+void stats_io(int block, int count, int write){
+    struct fs_stats * stats = stats_get();
+    if (stats == NULL)
+        return;
+
+    uint64_t blocks[FS_IO_KINDS] = {0};
+    for (int i = 0; i < count; i++)
+        blocks[block_kind(block + i)]++;
+    struct fs_io_stats * io = &stats->io[block_kind(block)];
+    stat_add(write ? &io->writes : &io->reads, 1);
+    for (int k = 0; k < FS_IO_KINDS; k++){
+        if (blocks[k] > 0)
+            stat_add(write ? &stats->io[k].write_blocks : &stats->io[k].read_blocks, blocks[k]);
+    }
+}
+#else
+#define STAT_ADD(field, n) do { } while (0)
+#endif
+
+// Call of an fs.h function: OP_BEGIN at the top of the function notes which one the thread is in
+// (cur_op, for the block trace) until it returns, and times it for the statistics
+__thread int cur_op = -1;
+
+struct op_timer {
+    int op;
+    int prev;           // Operation the thread was in before (-1 for none)
+    uint64_t start;
 };
-struct fd fileDescriptors[MAX_OPEN_FILES];
-int fd_count;
 
-// Free bitmaps global variables
-uint8_t * curFreeInodes;
-uint8_t * curFreeData;
+int op_enter(int op){
+    int prev = cur_op;
+    cur_op = op;
+    return prev;
+}
+
+void op_done(struct op_timer * t){
+    cur_op = t->prev;
+#ifndef FS_NO_STATS
+    uint64_t ns = stats_now() - t->start;
+    struct fs_stats * stats = stats_get();
+    if (stats == NULL)
+        return;
+    stat_add(&stats->ops[t->op].calls, 1);
+    stat_add(&stats->ops[t->op].total_ns, ns);
+    stat_add(&stats->ops[t->op].hist[stats_bucket(ns)], 1);
+#endif
+}
+
+#ifndef FS_NO_STATS
+#define OP_BEGIN(op) struct op_timer op_timer_ __attribute__((cleanup(op_done))) = { (op), op_enter(op), stats_now() }
+#else
+#define OP_BEGIN(op) struct op_timer op_timer_ __attribute__((cleanup(op_done))) = { (op), op_enter(op), 0 }
+#endif
+
+// Hook disk.c calls before each transfer of count blocks from block (see disk_set_hook): counts it
+// and returns its trace tag, the kind of block and the fs.h call the thread is in
+int io_hook(int block, int count, int write){
+#ifndef FS_NO_STATS
+    stats_io(block, count, write);
+#endif
+    return FS_TRACE_TAG(cur_op, block_kind(block));
+}
+
+// Statistics function that copies the counts since the last fs_reset_stats into stats
+int fs_get_stats(struct fs_stats *stats){
+    if (stats == NULL){
+        printf("ERROR: No buffer for statistics\n");
+        return -1;
+    }
+    memset(stats, 0, sizeof(struct fs_stats));
+#ifndef FS_NO_STATS
+    pthread_mutex_lock(&stats_lock);
+    stats_add_all(stats, &statsRetired, 1);
+    for (struct stats_slot * slot = statsThreads; slot != NULL; slot = slot->next)
+        stats_add_all(stats, &slot->s, 1);
+    stats_add_all(stats, &statsBase, -1);
+    pthread_mutex_unlock(&stats_lock);
+#endif
+    return 0;
+}
+
+// Statistics function that starts every count over from zero
+int fs_reset_stats(){
+#ifndef FS_NO_STATS
+    pthread_mutex_lock(&stats_lock);
+    memset(&statsBase, 0, sizeof(struct fs_stats));
+    stats_add_all(&statsBase, &statsRetired, 1);
+    for (struct stats_slot * slot = statsThreads; slot != NULL; slot = slot->next)
+        stats_add_all(&statsBase, &slot->s, 1);
+    pthread_mutex_unlock(&stats_lock);
+#endif
+    return 0;
+}
+
+// Statistics function that returns the latency (in ns, the middle of its histogram bucket) below
+// which a fraction p of the calls fall (0 if there were none)
+uint64_t fs_stats_percentile(const struct fs_op_stats *op, double p){
+    uint64_t total = 0;
+    for (int i = 0; i < FS_STATS_BUCKETS; i++)
+        total += op->hist[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (p * (double) total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    int i = 0;
+    for (; i < FS_STATS_BUCKETS - 1; i++){
+        seen += op->hist[i];
+        if (seen > rank)
+            break;
+    }
+    if (i < 8)
+        return (uint64_t) i;
+    int e = i / 8 + 2;
+    uint64_t width = (uint64_t) 1 << (e - 3);
+    return (uint64_t) (8 + i % 8) * width + width / 2;
+}
+
+const char * fs_stats_op_name(int op){
+    static const char * names[FS_OP_COUNT] = {
+        "open", "close", "create", "delete", "read", "write", "pread", "pwrite", "preadv",
+        "pwritev", "aio_read", "aio_write", "aio_wait", "get_filesize", "listfiles", "lseek",
+        "llseek", "truncate", "fallocate", "fsync", "sync",
+    };
+    return (op >= 0 && op < FS_OP_COUNT) ? names[op] : "unknown";
+}
 
 // Bitwise helper function that takes a bitmap and returns nth bit (0 or 1)
 int getNbit(uint8_t * bitmap, int size, int n){
@@ -65,14 +593,87 @@ int getNbit(uint8_t * bitmap, int size, int n){
     return ((bitmap[arrIndex] >> (7 - shift)) & 1);
 }
 
+// Bitwise helper function that loads bits [64 * w, 64 * w + 63] of a bitmap into one word.
+// Bit n of the bitmap lands in bit (63 - n % 64) so the first bit is the most significant one,
+// and bits past size read as 0 (used) so scans never run off the end.
+uint64_t getNword(uint8_t * bitmap, int size, int w){
+    int first = w * 8;
+    int nbytes = (size + 7) / 8;
+    uint64_t word = 0;
+
+    if (first + 8 <= nbytes){
+        memcpy(&word, bitmap + first, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+    }
+    else{
+        for (int i = 0; i < 8; i++){
+            word <<= 8;
+            if (first + i < nbytes)
+                word |= bitmap[first + i];
+        }
+    }
+
+    // Clear bits that are past the end of the bitmap
+    int valid = size - w * 64;
+    if (valid < 64)
+        word &= ~(~(uint64_t) 0 >> valid);
+    return word;
+}
+
+// Bitwise helper function that finds first bit equal to value at or after start (-1 if none)
+int findNbit(uint8_t * bitmap, int size, int start, int value){
+    if (start < 0)
+        start = 0;
+    if (start >= size)
+        return -1;
+
+    int nwords = (size + 63) / 64;
+    int w = start / 64;
+
+    // Searching for 0's is a search for 1's in the inverted word (bits past the end become 1's,
+    // which is fine since anything found past size is reported as not found).
+    // Mask off the bits before start in the first word, then scan a whole word at a time
+    uint64_t word = getNword(bitmap, size, w);
+    if (!value)
+        word = ~word;
+    word &= ~(uint64_t) 0 >> (start % 64);
+
+    while (1){
+        if (word){
+            STAT_ADD(bitmap_words, w - start / 64 + 1);
+            int n = w * 64 + __builtin_clzll(word);
+            return n < size ? n : -1;
+        }
+        if (++w >= nwords){
+            STAT_ADD(bitmap_words, w - start / 64);
+            return -1;
+        }
+        word = getNword(bitmap, size, w);
+        if (!value)
+            word = ~word;
+    }
+}
+
 // Bitwise helper function that finds first 1 in a bitmap (first free block number)
 int find1stFree(uint8_t * bitmap, int size){
-    // Iterate through all bits and return the first 1
-    for (int i = 0; i < size; i++){
-        if (getNbit(bitmap, size, i))
-            return i;
-    }
     // If no 1's are found, return -1 (no available block numbers)
+    return findNbit(bitmap, size, 0, 1);
+}
+
+// Bitwise helper function that finds the first run of n 1's at or after start (-1 if none)
+int findFreeRun(uint8_t * bitmap, int size, int n, int start){
+    int run_start = findNbit(bitmap, size, start, 1);
+    while (run_start >= 0){
+        // The run ends at the next 0 (or the end of the bitmap)
+        int run_end = findNbit(bitmap, size, run_start, 0);
+        if (run_end < 0)
+            run_end = size;
+        if (run_end - run_start >= n)
+            return run_start;
+        run_start = findNbit(bitmap, size, run_end, 1);
+    }
     return -1;
 }
 
@@ -101,299 +702,2090 @@ void setNbit(uint8_t * bitmap, int size, int n, int value){
     }
 }
 
-// Disk function that creates new disk and initializes global variables
-int make_fs(const char *disk_name){
-    // Only way for code to fail is if it fails to create the disk
-    if (make_disk(disk_name) != 0){
-        printf("ERROR: Unable to create disk with name %s\n", disk_name);
-        return -1;
-    }
-
-    if (open_disk(disk_name) != 0){
-        printf("ERROR: Unable to open disk with name %s\n", disk_name);
-        return -1;
-    }
+// Bitmap helper function that sets bits first through last - 1 to 1, a whole byte at a time
+// between the partial bytes at either end
+void setNbits(uint8_t * bitmap, int size, int first, int last){
+    while (first < last && first % 8 != 0)
+        setNbit(bitmap, size, first++, 1);
+    while (last > first && last % 8 != 0)
+        setNbit(bitmap, size, --last, 1);
+    if (first < last)
+        memset(bitmap + first / 8, 0xff, (last - first) / 8);
+}
 
-    // Initialize file system datastructures:
+// Metadata helper that marks a metadata block as changed, to be saved by the next commit (or umount_fs)
+void meta_mark(int block){
+    if (vol->metaDirty != NULL && !__atomic_exchange_n(&vol->metaDirty[block], 1, __ATOMIC_RELAXED))
+        __atomic_fetch_add(&vol->jdirty, 1, __ATOMIC_RELAXED);
+}
 
-    // 1. Initialize a superblock with file system metadata and write to disk
-    curSuper_block = (struct super_block *) malloc(sizeof(struct super_block));
-    curSuper_block->dentries = 1;
-    curSuper_block->free_data_bitmap = 2;
-    curSuper_block->free_inode_bitmap = 3;
-    curSuper_block->inode_table = 4;
-    
-    // Use a buffer with all unused bytes set to 0 (clear garbage before write)
-    char block_buf[BLOCK_SIZE];
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curSuper_block, sizeof(struct super_block));
-    
-    if (block_write(0, block_buf) != 0){
-        printf("ERROR: Failed to write super block to disk\n");
-        return -1;
-    }
+// Allocator helper that marks data block block used, called with alloc_lock held
+void data_bitmap_use(int block){
+    setNbit(vol->curFreeData, vol->num_blocks, block, 0);
+    if (vol->diskFreeData != vol->curFreeData)
+        setNbit(vol->diskFreeData, vol->num_blocks, block, 0);
+    meta_mark(vol->curSuper_block->free_data_bitmap + block / (8 * BLOCK_SIZE));
+}
 
-    // 2. Set up inodes, allocate memory, and set inode table
-    curTable = (struct inode *) malloc(MAX_NUM_FILES * sizeof(struct inode));
-    for (int i = 0; i < MAX_OPEN_FILES; i++){
-        curTable[i].double_indirect_offset = 0;
-        curTable[i].single_indirect_offset = 0;
+// Set when alloc_block finds the disk full, so an fs.h call knows a failure was for lack of space
+// (see journal_reclaim). Callers clear it first
+__thread int alloc_failed = 0;
+
+// Allocator helper function that takes the next free data block after the last allocation
+// (next-fit, wrapping to the start of the disk) and marks it used. Returns -1 if disk is full
+int alloc_block(){
+    pthread_mutex_lock(&vol->alloc_lock);
+    int block = findNbit(vol->curFreeData, vol->num_blocks, vol->alloc_hint, 1);
+    if (block < 0)
+        block = find1stFree(vol->curFreeData, vol->num_blocks);
+    if (block >= 0){
+        data_bitmap_use(block);
+        vol->alloc_hint = block + 1;
     }
-    
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curTable, MAX_NUM_FILES * sizeof(struct inode));
-    if (block_write(4, block_buf) != 0){
-        printf("ERROR: Failed to write inode table to disk\n");
-        return -1;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    STAT_ADD(alloc_calls, 1);
+    if (block >= 0)
+        STAT_ADD(alloc_blocks, 1);
+    else{
+        STAT_ADD(alloc_failures, 1);
+        alloc_failed = 1;
     }
+    return block;
+}
 
-    // 3. Set up directory entries and entry array (can only be MAX_NUM_FILES at a time)
-    curDir = (struct dir_entry *) malloc(MAX_NUM_FILES * sizeof(struct dir_entry));
-    for (int i = 0; i < MAX_OPEN_FILES; i++){
-        curDir[i].is_used = 0;
-        curDir[i].inode_number = 0;
-        strcpy(curDir[i].name, "");
+// Allocator helper function that takes a contiguous run of n free data blocks and marks them
+// used, returning the first block of the run (or -1 if no run that long exists)
+int alloc_run(int n){
+    pthread_mutex_lock(&vol->alloc_lock);
+    int start = findFreeRun(vol->curFreeData, vol->num_blocks, n, vol->alloc_hint);
+    if (start < 0)
+        start = findFreeRun(vol->curFreeData, vol->num_blocks, n, 0);
+    if (start >= 0){
+        for (int i = start; i < start + n; i++)
+            data_bitmap_use(i);
+        vol->alloc_hint = start + n;
     }
-    file_count = 0;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    STAT_ADD(alloc_calls, 1);
+    if (start >= 0)
+        STAT_ADD(alloc_blocks, n);
+    else
+        STAT_ADD(alloc_failures, 1);
+    return start;
+}
 
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curDir, MAX_NUM_FILES * sizeof(struct dir_entry));
-    if (block_write(1, block_buf) != 0){
-        printf("ERROR: Failed to write directory entry block to disk\n");
-        return -1;
+// Run of data blocks taken for a write before it starts, handed out in order by alloc_data
+struct reserve {
+    int next;   // Next block of the run
+    int left;   // Blocks left in the run
+};
+
+// Allocator helper function that takes up to n contiguous free data blocks into res. If no run
+// that long is free, the longest run found by halving n is taken instead (the blocks that don't
+// fit come from alloc_block)
+void reserve_take(struct reserve * res, int n){
+    res->left = 0;
+    for (; n > 1; n /= 2){
+        int start = alloc_run(n);
+        if (start >= 0){
+            res->next = start;
+            res->left = n;
+            return;
+        }
     }
+}
 
-    // 4. inode free bitmap and initialize to all ones (uses uint8 so same functions can be used)
-    curFreeInodes = (uint8_t *) malloc(8 * sizeof(uint8_t));
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        setNbit(curFreeInodes, MAX_NUM_FILES, i, 1);
+// Allocator helper function that returns the next block of a reserved run, or a free block from
+// alloc_block once the run is used up (res may be NULL). Returns -1 if the disk is full
+int alloc_data(struct reserve * res){
+    if (res != NULL && res->left > 0){
+        res->left--;
+        return res->next++;
     }
+    return alloc_block();
+}
 
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curFreeInodes, 8 * sizeof(uint8_t));
-    if (block_write(3, block_buf) != 0){
-        printf("ERROR: Failed to write inode free bitmap to disk\n");
-        return -1;
+// Allocator helper function that gives back the blocks of a run that weren't used. Nothing on
+// disk points at them, so they're free again right away (even while journaling)
+void reserve_release(struct reserve * res){
+    pthread_mutex_lock(&vol->alloc_lock);
+    for (; res->left > 0; res->left--, res->next++){
+        setNbit(vol->curFreeData, vol->num_blocks, res->next, 1);
+        if (vol->diskFreeData != vol->curFreeData)
+            setNbit(vol->diskFreeData, vol->num_blocks, res->next, 1);
+        meta_mark(vol->curSuper_block->free_data_bitmap + res->next / (8 * BLOCK_SIZE));
     }
+    pthread_mutex_unlock(&vol->alloc_lock);
+}
 
-    // 5. Data free bitmap and initialize to ones (except for what's used for bitmaps and superblock)
-    curFreeData = (uint8_t *) malloc(DISK_BLOCKS / 8 * sizeof(uint8_t));
-    for (int i = 5; i < DISK_BLOCKS; i++){
-        setNbit(curFreeData, DISK_BLOCKS, i, 1);
+// Allocator helper that returns a block to the free bitmap. While journaling, it's only free in
+// diskFreeData until the transaction freeing it is committed (meta not set) or checkpointed (meta
+// set), see journal_release
+void block_release(int block, int meta){
+    pthread_mutex_lock(&vol->alloc_lock);
+    if (!vol->journaling)
+        setNbit(vol->curFreeData, vol->num_blocks, block, 1);
+    else{
+        if (vol->jfreed_count == vol->jfreed_size){
+            int size = vol->jfreed_size ? vol->jfreed_size * 2 : 1024;
+            struct jfree * grown = (struct jfree *) realloc(vol->jFreed, size * sizeof(struct jfree));
+            if (grown == NULL){
+                // Leave the block used rather than let it be handed out too early
+                pthread_mutex_unlock(&vol->alloc_lock);
+                printf("ERROR: Failed to free block %d\n", block);
+                return;
+            }
+            vol->jFreed = grown;
+            vol->jfreed_size = size;
+        }
+        vol->jFreed[vol->jfreed_count].block = block;
+        vol->jFreed[vol->jfreed_count].seq = vol->jseq;
+        vol->jFreed[vol->jfreed_count].meta = meta;
+        vol->jfreed_count++;
+        setNbit(vol->diskFreeData, vol->num_blocks, block, 1);
     }
+    meta_mark(vol->curSuper_block->free_data_bitmap + block / (8 * BLOCK_SIZE));
+    pthread_mutex_unlock(&vol->alloc_lock);
+    STAT_ADD(freed_blocks, 1);
+}
+
+// Allocator helper function that returns a data block to the free bitmap
+void free_block(int block){
+    block_release(block, 0);
+}
+
+// Allocator helper function that returns an indirection or extent block to the free bitmap
+void free_meta_block(int block){
+    block_set_indirect(block, 0);
+    journal_forget(block);
+    block_release(block, 1);
+}
 
-    for (int j = 0; j < 5; j++){
-        setNbit(curFreeData, DISK_BLOCKS, j, 0);
+// Journal helper that makes the blocks freed by transactions up to done free in curFreeData, so
+// they can be handed out again. Indirection and extent blocks are only released when meta is set
+// (at a checkpoint, once no journaled image of them can be replayed)
+void journal_release(uint32_t done, int meta){
+    pthread_mutex_lock(&vol->alloc_lock);
+    int kept = 0;
+    for (int i = 0; i < vol->jfreed_count; i++){
+        if (vol->jFreed[i].seq <= done && (meta || !vol->jFreed[i].meta))
+            setNbit(vol->curFreeData, vol->num_blocks, vol->jFreed[i].block, 1);
+        else
+            vol->jFreed[kept++] = vol->jFreed[i];
     }
+    vol->jfreed_count = kept;
+    pthread_mutex_unlock(&vol->alloc_lock);
+}
 
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curFreeData, DISK_BLOCKS / 8 * sizeof(uint8_t));
-    if (block_write(2, block_buf) != 0){
-        printf("ERROR: Failed to write data free bitmap to disk\n");
-        return -1;
+// Journal helper that returns the journaled copy of block (NULL if it has none). Called with jblock_lock
+struct jblock * jblock_find(int block){
+    struct jblock * j = vol->jBuckets[block % JOURNAL_BUCKETS];
+    while (j != NULL && j->block != block)
+        j = j->next;
+    return j;
+}
+
+// Journal helper that unlinks and frees a journaled block. Called with jblock_lock
+void jblock_drop(struct jblock * j){
+    struct jblock ** link = &vol->jBuckets[j->block % JOURNAL_BUCKETS];
+    while (*link != j)
+        link = &(*link)->next;
+    *link = j->next;
+    free(j);
+}
+
+// Journal function that forgets the journaled copy of a freed block (it's never committed)
+void journal_forget(int block){
+    if (!vol->journaling)
+        return;
+
+    pthread_mutex_lock(&vol->jblock_lock);
+    struct jblock * j = jblock_find(block);
+    if (j != NULL){
+        if (j->pins > 0)
+            j->dead = 1;
+        else
+            jblock_drop(j);
     }
+    pthread_mutex_unlock(&vol->jblock_lock);
+}
 
-    // 6. Set all file descriptors to be closed
-    for (int i = 0; i < MAX_OPEN_FILES; i++){
-        fileDescriptors[i].open = 0;
-        fileDescriptors[i].file_offset = 0;
+// Cache helper function that allocates the block cache with every entry unused
+int cache_init(){
+    // A mapped disk already is a cache of the disk file, so don't keep a second copy
+    vol->disk_mapped = (block_ptr(0) != NULL);
+    if (vol->disk_mapped){
+        vol->blockCache = NULL;
+        return 0;
     }
-    fd_count = 0;
 
-    if (close_disk() != 0){
-        printf("ERROR: Failed to close disk created\n");
+    vol->blockCache = (struct cache_entry *) malloc(CACHE_BLOCKS * sizeof(struct cache_entry));
+    if (vol->blockCache == NULL){
+        printf("ERROR: Failed to allocate block cache\n");
         return -1;
     }
-
+    for (int i = 0; i < CACHE_BLOCKS; i++){
+        vol->blockCache[i].block = -1;
+        vol->blockCache[i].dirty = 0;
+        vol->blockCache[i].referenced = 0;
+        vol->blockCache[i].busy = 0;
+        vol->blockCache[i].next = -1;
+        vol->blockCache[i].pins = 0;
+    }
+    for (int i = 0; i < CACHE_BUCKETS; i++)
+        vol->cacheBuckets[i] = -1;
+    vol->cache_hand = 0;
     return 0;
 }
 
-// Disk function that mounts an existing virtual disk using a given name
-int mount_fs(const char *disk_name){
-    // Check if disk exists and, if so, open it
-    if (open_disk(disk_name) < 0)
-        return -1;
-    
-    // Read in super block and dynamically allocate memory for all global metadata datastructures
+// Cache helper function that returns the entry index holding block (or -1 if not cached)
+int cache_lookup(int block){
+    int i = vol->cacheBuckets[block % CACHE_BUCKETS];
+    while (i >= 0 && vol->blockCache[i].block != block)
+        i = vol->blockCache[i].next;
+    return i;
+}
 
-    // 1. Read in the superblock from the 1st block of the disk
-    curSuper_block = (struct super_block *) malloc(sizeof(struct super_block));
+// Cache helper function that removes an entry from its hash bucket chain
+void cache_unlink(int entry){
+    int * link = &vol->cacheBuckets[vol->blockCache[entry].block % CACHE_BUCKETS];
+    while (*link != entry)
+        link = &vol->blockCache[*link].next;
+    *link = vol->blockCache[entry].next;
+    vol->blockCache[entry].next = -1;
+}
 
-    char block_buf[BLOCK_SIZE];
-    if (block_read(0, block_buf) < 0){
-        printf("ERROR: Failed to read from superblock\n");
-        return -1;
+// Cache helper that waits until no entry for block..block+count-1 is busy. Called with cache_lock
+void cache_wait_range(int block, int count){
+    for (int i = 0; i < count; i++){
+        int entry = cache_lookup(block + i);
+        if (entry >= 0 && vol->blockCache[entry].busy){
+            pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+            i = -1;
+        }
     }
-    memcpy(curSuper_block, block_buf, sizeof(struct super_block));
+}
 
-    int block_dir = curSuper_block->dentries;
-    int block_freedata = curSuper_block->free_data_bitmap;
-    int block_freeinode = curSuper_block->free_inode_bitmap;
-    int block_inodes = curSuper_block->inode_table;
+// Cache helper function that picks a victim entry with CLOCK, writing it back if dirty. The write
+// back lets go of cache_lock, with the entry busy so threads wanting that block wait for it
+int cache_evict(){
+    // Two full sweeps clear every reference bit, so after that only pinned or busy entries are
+    // left. Busy ones become free again soon, so wait for one and sweep again
+    int busy = 0;
+    for (int sweep = 0; sweep < 3 * CACHE_BLOCKS; sweep++){
+        struct cache_entry * e = &vol->blockCache[vol->cache_hand];
+        int entry = vol->cache_hand;
+        vol->cache_hand = (vol->cache_hand + 1) % CACHE_BLOCKS;
+
+        if (e->busy)
+            busy = 1;
+        if (e->pins > 0 || e->busy){
+            if (sweep == 3 * CACHE_BLOCKS - 1 && busy){
+                pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+                busy = 0;
+                sweep = -1;
+            }
+            continue;
+        }
 
-    // 2. Load inode table based on superblock
-    curTable = (struct inode *) malloc(MAX_NUM_FILES * sizeof(struct inode));
-    if (block_read(block_inodes, block_buf) < 0){
-        printf("ERROR: Failed to load inode table\n");
-        return -1;
-    }
-    // Only read bytes need
-    memcpy(curTable, block_buf, MAX_NUM_FILES * sizeof(struct inode));
+        // Give recently used entries a second chance
+        if (e->block >= 0 && e->referenced){
+            e->referenced = 0;
+            continue;
+        }
 
-    // 3. Load directory entries based on superblock
-    curDir = (struct dir_entry *) malloc(MAX_NUM_FILES * sizeof(struct dir_entry));
-    if (block_read(block_dir, block_buf) < 0){
-        printf("ERROR: Failed to load directory entries\n");
-        return -1;
+        if (e->block >= 0){
+            if (e->dirty){
+                e->busy = 1;
+                pthread_mutex_unlock(&vol->cache_lock);
+                int ret = block_write(e->block, e->data);
+                pthread_mutex_lock(&vol->cache_lock);
+                e->busy = 0;
+                pthread_cond_broadcast(&vol->cache_cond);
+                if (ret < 0){
+                    printf("ERROR: Failed to write back cached block %d\n", e->block);
+                    return -1;
+                }
+                STAT_ADD(cache_writebacks, 1);
+            }
+            STAT_ADD(cache_evictions, 1);
+            cache_unlink(entry);
+            e->block = -1;
+            e->dirty = 0;
+        }
+        return entry;
     }
-    memcpy(curDir, block_buf, MAX_NUM_FILES * sizeof(struct dir_entry));
+    printf("ERROR: Every cached block is pinned\n");
+    return -1;
+}
 
-    file_count = 0;
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        if (curDir[i].is_used){
-            file_count++;
+// Cache helper that copies the data an async write in flight is putting in block to data, returning
+// 1 (or 0 if no write in flight covers block). The newest write wins. Called with cache_lock
+int aio_written(int block, char * data){
+    for (struct aio_io * a = vol->aioWrites; a != NULL; a = a->next){
+        if (block >= a->io.block && block < a->io.block + a->io.count){
+            memcpy(data, (const char *) a->io.buf + (size_t) (block - a->io.block) * BLOCK_SIZE, BLOCK_SIZE);
+            return 1;
         }
     }
+    return 0;
+}
 
-    // 4. Load inode free bitmap based on superblock
-    curFreeInodes = (uint8_t *) malloc(8 * sizeof(uint8_t));
-    if (block_read(block_freeinode, block_buf) < 0){
-        printf("ERROR: Failed to load free inode bitmap\n");
-        return -1;
+// Cache helper function that returns the entry for block, loading it if load is set: from disk, or
+// from an async write in flight to it (left dirty, since the disk may still hold the old copy).
+// Called with cache_lock, which is let go of for disk transfers: the disk read is done with the
+// entry busy, so only threads wanting this block wait for it, not the whole cache
+struct cache_entry * cache_get(int block, int load){
+    while (1){
+        int entry = cache_lookup(block);
+        if (entry >= 0 && vol->blockCache[entry].busy){
+            pthread_cond_wait(&vol->cache_cond, &vol->cache_lock);
+            continue;
+        }
+        if (entry >= 0){
+            if (load)
+                STAT_ADD(cache_hits, 1);
+            vol->blockCache[entry].referenced = 1;
+            return &vol->blockCache[entry];
+        }
+
+        // Writing back the victim may let another thread cache the block meanwhile (the victim
+        // is left free)
+        entry = cache_evict();
+        if (entry < 0)
+            return NULL;
+        if (cache_lookup(block) >= 0)
+            continue;
+
+        if (load)
+            STAT_ADD(cache_misses, 1);
+        struct cache_entry * e = &vol->blockCache[entry];
+        e->block = block;
+        e->dirty = 0;
+        e->referenced = 1;
+        e->next = vol->cacheBuckets[block % CACHE_BUCKETS];
+        vol->cacheBuckets[block % CACHE_BUCKETS] = entry;
+        if (load && aio_written(block, e->data))
+            e->dirty = 1;
+        else if (load){
+            e->busy = 1;
+            pthread_mutex_unlock(&vol->cache_lock);
+            int ret = block_read(block, e->data);
+            pthread_mutex_lock(&vol->cache_lock);
+            e->busy = 0;
+            pthread_cond_broadcast(&vol->cache_cond);
+            if (ret < 0){
+                cache_unlink(entry);
+                e->block = -1;
+                return NULL;
+            }
+        }
+        return e;
     }
-    memcpy(curFreeInodes, block_buf, 8 * sizeof(uint8_t));
+}
 
-    // 5. Load data free bitmap based on superblock
-    curFreeData = (uint8_t *) malloc(DISK_BLOCKS / 8 * sizeof(uint8_t));
-    if (block_read(block_freedata, block_buf) < 0){
-        printf("ERROR: Failed to load free data bitmap\n");
-        return -1;
+// Cache function that returns the contents of block without copying them (NULL on error). The
+// block stays in the cache until it's released with cache_unpin, and must not be changed through it
+const char * cache_pin(int block){
+    if ((block < 0) || (block >= vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
+        return NULL;
     }
-    memcpy(curFreeData, block_buf, DISK_BLOCKS / 8 * sizeof(uint8_t));
 
-    // 6. Initialize all file descriptors to closed and offset 0
-    for (int i = 0; i < MAX_OPEN_FILES; i++){
-        fileDescriptors[i].open = 0;
-        fileDescriptors[i].file_offset = 0;
+    // A journaled indirection block is newer than any copy in the cache
+    if (vol->journaling){
+        pthread_mutex_lock(&vol->jblock_lock);
+        struct jblock * j = jblock_find(block);
+        if (j != NULL)
+            j->pins++;
+        pthread_mutex_unlock(&vol->jblock_lock);
+        if (j != NULL)
+            return j->data;
     }
-    fd_count = 0;
+    if (vol->disk_mapped)
+        return block_ptr(block);
+
+    pthread_mutex_lock(&vol->cache_lock);
+    struct cache_entry * e = cache_get(block, 1);
+    if (e != NULL)
+        e->pins++;
+    pthread_mutex_unlock(&vol->cache_lock);
+
+    if (e == NULL)
+        return NULL;
+    return e->data;
+}
 
-    return 0;
+// Cache helper that tells whether data (returned by cache_pin) is in the cache or the mapped disk
+// rather than a journaled block
+int cache_owns(const char * data){
+    uintptr_t p = (uintptr_t) data;
+    if (vol->disk_mapped){
+        uintptr_t map = (uintptr_t) block_ptr(0);
+        return p >= map && p < map + (uintptr_t) vol->num_blocks * BLOCK_SIZE;
+    }
+    return p >= (uintptr_t) vol->blockCache && p < (uintptr_t) (vol->blockCache + CACHE_BLOCKS);
 }
 
-// Disk function that unmounts virtual disk and saves any changes made to file system
-int umount_fs(const char *disk_name){
+// Cache function that releases a block returned by cache_pin
+void cache_unpin(const char * data){
+    if (vol->journaling && !cache_owns(data)){
+        struct jblock * j = (struct jblock *) (data - offsetof(struct jblock, data));
+        pthread_mutex_lock(&vol->jblock_lock);
+        if (--j->pins == 0 && j->dead)
+            jblock_drop(j);
+        pthread_mutex_unlock(&vol->jblock_lock);
+        return;
+    }
+    if (vol->disk_mapped)
+        return;
 
-    // Second, save all metadata to the disk (only need to write superblock once)
+    struct cache_entry * e = (struct cache_entry *) (data - offsetof(struct cache_entry, data));
+    pthread_mutex_lock(&vol->cache_lock);
+    e->pins--;
+    pthread_mutex_unlock(&vol->cache_lock);
+}
 
-    // Directory entries, then free allocated memory
-    // Use a buffer with all unused bytes set to 0 (clear garbage before write)
-    char block_buf[BLOCK_SIZE];
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curDir, MAX_NUM_FILES * sizeof(struct dir_entry));
-    if (block_write(1, block_buf) != 0){
-        printf("ERROR: Failed to write directory entry block to disk\n");
+// Cache function with the same contract as block_read, served from the cache when possible
+int cache_read(int block, void *buf){
+    if ((block < 0) || (block >= vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
         return -1;
     }
-    free(curDir);
 
-    // Free data bitmap, then free allocated memory
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curFreeData, DISK_BLOCKS / 8 * sizeof(uint8_t));
-    if (block_write(2, block_buf) != 0){
-        printf("ERROR: Failed to write data free bitmap to disk\n");
-        return -1;
+    if (vol->journaling){
+        pthread_mutex_lock(&vol->jblock_lock);
+        struct jblock * j = jblock_find(block);
+        if (j != NULL)
+            memcpy(buf, j->data, BLOCK_SIZE);
+        pthread_mutex_unlock(&vol->jblock_lock);
+        if (j != NULL)
+            return 0;
     }
-    free(curFreeData);
+    if (vol->disk_mapped)
+        return block_read(block, buf);
+
+    pthread_mutex_lock(&vol->cache_lock);
+    struct cache_entry * e = cache_get(block, 1);
+    if (e != NULL)
+        memcpy(buf, e->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&vol->cache_lock);
+    return e == NULL ? -1 : 0;
+}
 
-    // Free inode bitmap, then free allocated memory
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curFreeInodes, 8 * sizeof(uint8_t));
-    if (block_write(3, block_buf) != 0){
-        printf("ERROR: Failed to write inode free bitmap to disk\n");
+// Cache function with the same contract as block_write, deferring the disk write until eviction or flush
+int cache_write(int block, const void *buf){
+    if ((block < 0) || (block >= vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
         return -1;
     }
-    free(curFreeInodes);
 
-    // Inode table, then free allocated memory
-    memset(block_buf, 0, sizeof(block_buf));
-    memcpy(block_buf, curTable, MAX_NUM_FILES * sizeof(struct inode));
-    if (block_write(4, block_buf) != 0){
-        printf("ERROR: Failed to write inode table to disk\n");
-        return -1;
-    }
-    free(curTable);
+    if (vol->disk_mapped)
+        return block_write(block, buf);
 
-    // Close all file descriptors
-    for (int i = 0; i < MAX_OPEN_FILES; i++){
-        fileDescriptors[i].open = 0;
-        fileDescriptors[i].file_offset = 0;
+    // Whole block is overwritten, so there's no need to read the old contents first
+    pthread_mutex_lock(&vol->cache_lock);
+    struct cache_entry * e = cache_get(block, 0);
+    if (e != NULL){
+        memcpy(e->data, buf, BLOCK_SIZE);
+        e->dirty = 1;
     }
-    fd_count = 0;
+    pthread_mutex_unlock(&vol->cache_lock);
+    return e == NULL ? -1 : 0;
+}
 
-    // Last, close the disk after all metadata was written to it
-    if (close_disk() < 0){
-        printf("ERROR: Failed to close disk\n");
+// Journal function with the same contract as cache_write, for indirection and extent blocks. While
+// journaling, the block is kept out of the cache (cache_read and cache_pin find it first) until
+// the transaction changing it has been committed, so it can't be written home before that
+int journal_write(int block, const void *buf){
+    block_set_indirect(block, 1);
+    if (!vol->journaling)
+        return cache_write(block, buf);
+    if ((block < 0) || (block >= vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
         return -1;
     }
 
-    // Return success once closed
+    pthread_mutex_lock(&vol->jblock_lock);
+    struct jblock * j = jblock_find(block);
+    if (j == NULL){
+        j = (struct jblock *) malloc(sizeof(struct jblock));
+        if (j == NULL){
+            pthread_mutex_unlock(&vol->jblock_lock);
+            printf("ERROR: Failed to allocate journal block\n");
+            return -1;
+        }
+        j->block = block;
+        j->seq = 0;
+        j->pins = 0;
+        j->next = vol->jBuckets[block % JOURNAL_BUCKETS];
+        vol->jBuckets[block % JOURNAL_BUCKETS] = j;
+    }
+    if (j->seq != vol->jseq)
+        __atomic_fetch_add(&vol->jdirty, 1, __ATOMIC_RELAXED);
+    memcpy(j->data, buf, BLOCK_SIZE);
+    j->seq = vol->jseq;
+    j->dead = 0;
+    pthread_mutex_unlock(&vol->jblock_lock);
     return 0;
 }
 
-// Helper function that checks if file descriptor is valid
-int validfd(int fd){
+// Cache function with the same contract as cache_read, for indirection and extent blocks
+int indir_read(int block, void *buf){
+    block_set_indirect(block, 1);
+    return cache_read(block, buf);
+}
 
-    // Check if fd is within range
-    if (fd < 0 || fd >= MAX_OPEN_FILES){
-        printf("ERROR: invalid file descriptor\n");
+// Cache function with the same contract as cache_pin, for indirection and extent blocks
+const char * indir_pin(int block){
+    block_set_indirect(block, 1);
+    return cache_pin(block);
+}
+
+// Cache function that reads count consecutive disk blocks into buf. Blocks that aren't cached
+// are read straight from disk with one read (bypassing the cache so large reads don't evict
+// everything), then the cached copy of any block in the range is used in place of the disk copy.
+// The caller holds the lock of the inode owning the blocks, so none of them can become dirty
+// while the disk is read without holding the cache lock
+int cache_read_range(int block, int count, void *buf){
+    if ((block < 0) || (count < 0) || (block + count > vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
         return -1;
     }
+    if (vol->disk_mapped)
+        return block_read_range(block, count, buf);
+
+    pthread_mutex_lock(&vol->cache_lock);
+    cache_wait_range(block, count);
+    int cached = 0;
+    for (int i = 0; i < count; i++){
+        if (cache_lookup(block + i) >= 0)
+            cached++;
+    }
 
-    // Check if fd is open
-    if (fileDescriptors[fd].open != 1){
-        printf("ERROR: Not an open file descriptor\n");
-        return -1;
+    STAT_ADD(cache_hits, cached);
+    STAT_ADD(cache_misses, count - cached);
+
+    // Nothing cached: no need to hold the cache lock over the disk read
+    if (cached == 0){
+        pthread_mutex_unlock(&vol->cache_lock);
+        return block_read_range(block, count, buf);
     }
 
-    //Otherwise, return valid
-    return 0;
+    int ret = 0;
+    if (cached < count && block_read_range(block, count, buf) < 0)
+        ret = -1;
+    for (int i = 0; ret == 0 && i < count; i++){
+        int entry = cache_lookup(block + i);
+        if (entry >= 0)
+            memcpy((char *) buf + i * BLOCK_SIZE, vol->blockCache[entry].data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&vol->cache_lock);
+    return ret;
 }
 
-// File system helper function that checks if a file exists, if it does return inode number
-int fs_exists(const char * name){
-    // Iterate through all directories. If file exists and matches the name, return 0 for success
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        if(strcmp(curDir[i].name, name) == 0 && curDir[i].is_used){
-            return curDir[i].inode_number;
+// Cache function that writes count consecutive disk blocks from buf straight to disk with one
+// write, updating any cached copies so the cache never holds stale data. Cached copies are
+// updated (and left dirty) first, so an eviction racing with the disk write still writes new data
+int cache_write_range(int block, int count, const void *buf){
+    if ((block < 0) || (count < 0) || (block + count > vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
+        return -1;
+    }
+    if (vol->disk_mapped)
+        return block_write_range(block, count, buf);
+
+    int cached = 0;
+    pthread_mutex_lock(&vol->cache_lock);
+    cache_wait_range(block, count);
+    for (int i = 0; i < count; i++){
+        int entry = cache_lookup(block + i);
+        if (entry >= 0){
+            memcpy(vol->blockCache[entry].data, (const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+            vol->blockCache[entry].dirty = 1;
+            cached++;
         }
     }
-    // If not found, return -1
-    return -1;
-}
+    pthread_mutex_unlock(&vol->cache_lock);
 
-// File system helper function that checks if there are any open file descriptors of the file
-int fs_isopen(const char * name){
-    // Check if file exists
-    int inum = fs_exists(name);
-    if (inum < 0){
-        printf("ERROR: File %s doesn't exist\n", name);
+    if (block_write_range(block, count, buf) < 0)
         return -1;
-    }
 
-    // If open file descriptor found with same inode number, return 1
-    for (int i = 0; i < MAX_OPEN_FILES; i++){
-        if (fileDescriptors[i].inode == inum && fileDescriptors[i].open)
-            return 1;
+    // The disk now matches the cached copies
+    if (cached > 0){
+        pthread_mutex_lock(&vol->cache_lock);
+        for (int i = 0; i < count; i++){
+            int entry = cache_lookup(block + i);
+            if (entry >= 0)
+                vol->blockCache[entry].dirty = 0;
+        }
+        pthread_mutex_unlock(&vol->cache_lock);
     }
     return 0;
 }
 
-// File system function that finds the first free file descriptor and returns it
-int fs_freefd(){
-    // Iterate through all file descriptors and find if any are unused
+// Cache helper function that orders entry indexes by disk block (for qsort)
+int cache_compare(const void * a, const void * b){
+    return vol->blockCache[*(const int *) a].block - vol->blockCache[*(const int *) b].block;
+}
+
+// Cache function that writes every dirty entry back to disk (entries stay cached). Dirty blocks
+// are sorted so runs of consecutive disk blocks go out in one vectored write
+int cache_flush(){
+    if (vol->blockCache == NULL)
+        return 0;
+
+    pthread_mutex_lock(&vol->cache_lock);
+    int ret = 0;
+    int dirty[CACHE_BLOCKS];
+    int num_dirty = 0;
+    for (int i = 0; i < CACHE_BLOCKS; i++){
+        if (vol->blockCache[i].block >= 0 && vol->blockCache[i].dirty)
+            dirty[num_dirty++] = i;
+    }
+    qsort(dirty, num_dirty, sizeof(int), cache_compare);
+
+    const void * bufs[CACHE_BLOCKS];
+    int i = 0;
+    while (i < num_dirty){
+        int first = vol->blockCache[dirty[i]].block;
+        int run = 0;
+        while (i + run < num_dirty && vol->blockCache[dirty[i + run]].block == first + run){
+            bufs[run] = vol->blockCache[dirty[i + run]].data;
+            run++;
+        }
+
+        if (block_writev(first, run, bufs) < 0){
+            printf("ERROR: Failed to write back cached blocks %d-%d\n", first, first + run - 1);
+            ret = -1;
+            break;
+        }
+        for (int j = i; j < i + run; j++)
+            vol->blockCache[dirty[j]].dirty = 0;
+        STAT_ADD(cache_writebacks, run);
+        i += run;
+    }
+    pthread_mutex_unlock(&vol->cache_lock);
+    return ret;
+}
+
+// Cache function that flushes all dirty entries and releases the cache memory (even if the
+// flush failed, so nothing is left behind by a failed umount_fs)
+int cache_destroy(){
+    vol->disk_mapped = 0;
+    if (vol->blockCache == NULL)
+        return 0;
+    int ret = cache_flush();
+    free(vol->blockCache);
+    vol->blockCache = NULL;
+    return ret < 0 ? -1 : 0;
+}
+
+// Cache function that reads the blocks of block..block+count-1 that aren't cached into clean cache
+// entries (for readahead). Disk reads happen without the cache lock, one per run of missing blocks
+int cache_prefetch(int block, int count){
+    if ((block < 0) || (count < 0) || (block + count > vol->num_blocks)){
+        printf("ERROR: cache block index out of bounds\n");
+        return -1;
+    }
+    if (vol->disk_mapped || count == 0)
+        return 0;
+
+    char * buf = (char *) malloc((size_t) count * BLOCK_SIZE);
+    if (buf == NULL)
+        return -1;
+
+    int ret = 0;
+    int i = 0;
+    while (i < count){
+        // Find the next run of blocks that aren't cached
+        pthread_mutex_lock(&vol->cache_lock);
+        while (i < count && cache_lookup(block + i) >= 0)
+            i++;
+        int run = 0;
+        while (i + run < count && cache_lookup(block + i + run) < 0)
+            run++;
+        pthread_mutex_unlock(&vol->cache_lock);
+        if (run == 0)
+            break;
+
+        if (block_read_range(block + i, run, buf) < 0){
+            ret = -1;
+            break;
+        }
+        STAT_ADD(readahead_blocks, run);
+
+        // Blocks that got cached meanwhile are left alone (they may be newer than the disk), and
+        // blocks an async write is changing take its data (what was read may be the old copy)
+        pthread_mutex_lock(&vol->cache_lock);
+        for (int j = 0; j < run; j++){
+            if (cache_lookup(block + i + j) >= 0)
+                continue;
+            struct cache_entry * e = cache_get(block + i + j, 0);
+            if (e == NULL){
+                ret = -1;
+                break;
+            }
+            if (e->dirty)
+                continue;   // Cached and changed while cache_get wrote back a victim
+            if (aio_written(block + i + j, e->data))
+                e->dirty = 1;
+            else
+                memcpy(e->data, buf + (size_t) j * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&vol->cache_lock);
+        if (ret < 0)
+            break;
+        i += run;
+    }
+    free(buf);
+    return ret;
+}
+
+// Readahead thread body: runs queued requests until readahead_stop clears ra_running
+void * readahead_main(void * arg){
+    vol = arg;
+    disk_use(vol->disk);
+    pthread_mutex_lock(&vol->ra_lock);
+    while (1){
+        while (vol->ra_running && vol->ra_count == 0)
+            pthread_cond_wait(&vol->ra_cond, &vol->ra_lock);
+        if (!vol->ra_running)
+            break;
+
+        struct readahead req = vol->raQueue[vol->ra_head];
+        vol->ra_head = (vol->ra_head + 1) % READAHEAD_QUEUE;
+        vol->ra_count--;
+        pthread_mutex_unlock(&vol->ra_lock);
+        readahead_run(req.inum, req.first, req.count);
+        pthread_mutex_lock(&vol->ra_lock);
+    }
+    pthread_mutex_unlock(&vol->ra_lock);
+    return NULL;
+}
+
+// Readahead function that starts the readahead thread (not for a mapped disk, where the kernel
+// already reads ahead in the mapping)
+int readahead_start(){
+    vol->ra_head = 0;
+    vol->ra_count = 0;
+    if (READAHEAD_BLOCKS == 0 || vol->disk_mapped)
+        return 0;
+
+    vol->ra_running = 1;
+    if (pthread_create(&vol->ra_thread, NULL, readahead_main, vol) != 0){
+        printf("ERROR: Failed to start readahead thread\n");
+        vol->ra_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Readahead function that stops the readahead thread, dropping requests it hasn't started
+void readahead_stop(){
+    pthread_mutex_lock(&vol->ra_lock);
+    int running = vol->ra_running;
+    vol->ra_running = 0;
+    vol->ra_count = 0;
+    pthread_cond_signal(&vol->ra_cond);
+    pthread_mutex_unlock(&vol->ra_lock);
+    if (running)
+        pthread_join(vol->ra_thread, NULL);
+}
+
+// Readahead function that drops the queued requests for file inum (before fs_delete frees its
+// blocks). Called with the inode lock held for writing, so the thread isn't running one of them
+void readahead_drop(int inum){
+    pthread_mutex_lock(&vol->ra_lock);
+    int kept = 0;
+    for (int i = 0; i < vol->ra_count; i++){
+        struct readahead req = vol->raQueue[(vol->ra_head + i) % READAHEAD_QUEUE];
+        if (req.inum != inum)
+            vol->raQueue[(vol->ra_head + kept++) % READAHEAD_QUEUE] = req;
+    }
+    vol->ra_count = kept;
+    pthread_mutex_unlock(&vol->ra_lock);
+}
+
+// Async helper that takes a finished write off aioWrites
+void aio_unlist(struct aio_io * a){
+    pthread_mutex_lock(&vol->cache_lock);
+    if (a->prev != NULL)
+        a->prev->next = a->next;
+    else
+        vol->aioWrites = a->next;
+    if (a->next != NULL)
+        a->next->prev = a->prev;
+    pthread_mutex_unlock(&vol->cache_lock);
+}
+
+// Async helper that drops one reference on request req (the submitter holds one until it's done
+// mapping, each disk request another) and completes it when none are left. Called with aio_lock
+void aio_put(struct fs_aio * req){
+    if (--req->pending > 0)
+        return;
+
+    if (req->error)
+        req->result = -1;
+    vol->aioPending[req->inum]--;
+    vol->aio_inflight--;
+    req->next = NULL;
+    if (vol->aioDone)
+        vol->aioDoneTail->next = req;
+    else
+        vol->aioDone = req;
+    vol->aioDoneTail = req;
+    pthread_cond_broadcast(&vol->aio_cond);
+}
+
+// Async helper that collects finished disk requests and completes their file requests, waiting
+// for one if wait is set. Called with aio_lock, which is dropped while waiting on the disk. Only
+// one thread collects at a time, the others wait for it to finish
+void aio_reap_locked(int wait){
+    if (vol->aio_reaping){
+        if (wait)
+            pthread_cond_wait(&vol->aio_cond, &vol->aio_lock);
+        return;
+    }
+
+    vol->aio_reaping = 1;
+    pthread_mutex_unlock(&vol->aio_lock);
+    struct disk_io * ios[AIO_REAP];
+    int n = disk_io_reap(ios, AIO_REAP, wait);
+    pthread_mutex_lock(&vol->aio_lock);
+
+    for (int i = 0; i < n; i++){
+        struct fs_aio * req = ios[i]->data;
+        if (ios[i]->result < 0)
+            req->error = 1;
+        if (ios[i]->write)
+            aio_unlist((struct aio_io *) ios[i]);
+        free(ios[i]);
+        aio_put(req);
+    }
+    vol->aio_reaping = 0;
+    pthread_cond_broadcast(&vol->aio_cond);
+}
+
+// Async helper that waits until no request on inode inum is in flight (before its blocks are freed)
+void aio_wait_inode(int inum){
+    pthread_mutex_lock(&vol->aio_lock);
+    while (vol->aioPending[inum] > 0)
+        aio_reap_locked(1);
+    pthread_mutex_unlock(&vol->aio_lock);
+}
+
+// Async helper that hands a disk read or write of count blocks at buf to the engine for request req.
+// A write is listed in aioWrites before the engine can start it
+int aio_submit(struct fs_aio * req, int block, int count, void * buf, int write){
+    struct aio_io * a = (struct aio_io *) malloc(sizeof(struct aio_io));
+    if (a == NULL)
+        return -1;
+    struct disk_io * io = &a->io;
+    io->block = block;
+    io->count = count;
+    io->buf = buf;
+    io->write = write;
+    io->data = req;
+    if (write){
+        pthread_mutex_lock(&vol->cache_lock);
+        a->prev = NULL;
+        a->next = vol->aioWrites;
+        if (vol->aioWrites != NULL)
+            vol->aioWrites->prev = a;
+        vol->aioWrites = a;
+        pthread_mutex_unlock(&vol->cache_lock);
+    }
+
+    pthread_mutex_lock(&vol->aio_lock);
+    req->pending++;
+    pthread_mutex_unlock(&vol->aio_lock);
+    if (disk_io_submit(io) < 0){
+        pthread_mutex_lock(&vol->aio_lock);
+        req->pending--;
+        pthread_mutex_unlock(&vol->aio_lock);
+        if (write)
+            aio_unlist(a);
+        free(a);
+        return -1;
+    }
+    return 0;
+}
+
+// Async helper that reads count whole blocks into buf: through the engine for request aio when none
+// of them are cached, otherwise (or without a request) with cache_read_range
+int aio_read_range(struct fs_aio * aio, int block, int count, void * buf){
+    if (aio != NULL){
+        int cached = 0;
+        if (!vol->disk_mapped){
+            pthread_mutex_lock(&vol->cache_lock);
+            for (int i = 0; i < count; i++){
+                if (cache_lookup(block + i) >= 0)
+                    cached++;
+            }
+            pthread_mutex_unlock(&vol->cache_lock);
+        }
+        if (cached == 0 && aio_submit(aio, block, count, buf, 0) == 0)
+            return 0;
+    }
+    return cache_read_range(block, count, buf);
+}
+
+// Async helper that writes count whole blocks from buf: cached copies are updated right away (and
+// left dirty) and the disk write goes through the engine for request aio. Without a request, or if
+// the engine refuses it, the write is done with cache_write_range
+int aio_write_range(struct fs_aio * aio, int block, int count, const void * buf){
+    if (aio != NULL){
+        if (!vol->disk_mapped){
+            pthread_mutex_lock(&vol->cache_lock);
+            cache_wait_range(block, count);
+            for (int i = 0; i < count; i++){
+                int entry = cache_lookup(block + i);
+                if (entry >= 0){
+                    memcpy(vol->blockCache[entry].data, (const char *) buf + i * BLOCK_SIZE, BLOCK_SIZE);
+                    vol->blockCache[entry].dirty = 1;
+                }
+            }
+            pthread_mutex_unlock(&vol->cache_lock);
+        }
+        if (aio_submit(aio, block, count, (void *) buf, 1) == 0)
+            return 0;
+    }
+    return cache_write_range(block, count, buf);
+}
+
+// Directory index helper that hashes a file name (FNV-1a over at most the stored name length)
+int dir_hash(const char * name){
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof(((struct dir_entry *) 0)->name) && name[i]; i++){
+        h ^= (uint8_t) name[i];
+        h *= 16777619u;
+    }
+    return h % DIR_BUCKETS;
+}
+
+// Directory index helper that adds a used directory entry to the hash table
+void dir_index_add(int entry){
+    int bucket = dir_hash(vol->curDir[entry].name);
+    vol->dirNext[entry] = vol->dirBuckets[bucket];
+    vol->dirBuckets[bucket] = entry;
+}
+
+// Directory index helper that removes a directory entry from the hash table
+void dir_index_remove(int entry){
+    int * link = &vol->dirBuckets[dir_hash(vol->curDir[entry].name)];
+    while (*link >= 0 && *link != entry)
+        link = &vol->dirNext[*link];
+    if (*link == entry)
+        *link = vol->dirNext[entry];
+    vol->dirNext[entry] = -1;
+}
+
+// Directory index helper that rebuilds the hash table from the used directory entries
+void dir_index_build(){
+    for (int i = 0; i < DIR_BUCKETS; i++)
+        vol->dirBuckets[i] = -1;
+    for (int i = 0; i < vol->max_files; i++){
+        vol->dirNext[i] = -1;
+        if (vol->curDir[i].is_used)
+            dir_index_add(i);
+    }
+}
+
+// Directory entry helper that finds the used directory entry with the given name (-1 if none)
+int de_find(const char * name){
+    for (int i = vol->dirBuckets[dir_hash(name)]; i >= 0; i = vol->dirNext[i]){
+        if (strncmp(name, vol->curDir[i].name, sizeof(vol->curDir[i].name)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Layout helper functions giving the number of blocks each metadata structure takes for a given
+// number of files
+int dir_blocks(int files){
+    return (files + DIR_PER_BLOCK - 1) / DIR_PER_BLOCK;
+}
+
+int inode_bitmap_blocks(int files){
+    return (files + 8 * BLOCK_SIZE - 1) / (8 * BLOCK_SIZE);
+}
+
+int data_bitmap_blocks(int blocks){
+    return (blocks + 8 * BLOCK_SIZE - 1) / (8 * BLOCK_SIZE);
+}
+
+int table_blocks(int files){
+    return (files + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+}
+
+// Metadata helper that writes size bytes of data to consecutive blocks starting at block, with
+// the unused bytes of the last block set to 0
+int meta_write(int block, const void * data, size_t size){
+    char block_buf[BLOCK_SIZE];
+    for (size_t done = 0; done < size; done += BLOCK_SIZE, block++){
+        size_t n = (size - done < BLOCK_SIZE) ? size - done : BLOCK_SIZE;
+        memset(block_buf, 0, sizeof(block_buf));
+        memcpy(block_buf, (const char *) data + done, n);
+        if (cache_write(block, block_buf) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Metadata helper that reads size bytes from consecutive blocks starting at block into data
+int meta_read(int block, void * data, size_t size){
+    char block_buf[BLOCK_SIZE];
+    for (size_t done = 0; done < size; done += BLOCK_SIZE, block++){
+        size_t n = (size - done < BLOCK_SIZE) ? size - done : BLOCK_SIZE;
+        if (cache_read(block, block_buf) < 0)
+            return -1;
+        memcpy((char *) data + done, block_buf, n);
+    }
+    return 0;
+}
+
+// Directory helper that reads the whole directory, DIR_PER_BLOCK entries per block
+int dir_load(){
+    for (int b = 0; b < dir_blocks(vol->max_files); b++){
+        int first = b * DIR_PER_BLOCK;
+        int count = (vol->max_files - first < DIR_PER_BLOCK) ? vol->max_files - first : DIR_PER_BLOCK;
+        int block = vol->curSuper_block->dentries + b;
+        size_t size = count * sizeof(struct dir_entry);
+        if (meta_read(block, &vol->curDir[first], size) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Inode table helper that reads the table block holding inode inum the first time it's needed.
+// Called with dir_lock held (by fs_open, fs_create and fs_delete), so every inode reached through
+// a file descriptor is already loaded
+int inode_load(int inum){
+    int b = inum / INODES_PER_BLOCK;
+    if (vol->tableLoaded[b])
+        return 0;
+
+    int first = b * INODES_PER_BLOCK;
+    int count = (vol->max_files - first < INODES_PER_BLOCK) ? vol->max_files - first : INODES_PER_BLOCK;
+    if (meta_read(vol->curSuper_block->inode_table + b, &vol->curTable[first], count * sizeof(struct inode)) < 0){
+        printf("ERROR: Failed to load inode table block %d\n", b);
+        return -1;
+    }
+    vol->tableLoaded[b] = 1;
+    return 0;
+}
+
+// Inode helper that returns the size of file inum, counting bytes buffered for delayed allocation.
+// Called with the inode lock held
+int inode_size(int inum){
+    return vol->curTable[inum].file_size + (vol->delayed != NULL ? vol->delayed[inum].len : 0);
+}
+
+// Metadata helper that marks the directory block holding directory entry entry as changed
+void dir_mark(int entry){
+    meta_mark(vol->curSuper_block->dentries + entry / DIR_PER_BLOCK);
+}
+
+// Metadata helper that marks the inode table block holding inode inum as changed
+void inode_mark(int inum){
+    meta_mark(vol->curSuper_block->inode_table + inum / INODES_PER_BLOCK);
+}
+
+// Metadata helper that fills buf with what metadata block block holds on disk, built from the
+// superblock, directory, bitmaps or inode table in memory
+void meta_image(int block, char * buf){
+    struct super_block * sb = vol->curSuper_block;
+    const char * data;
+    size_t size;
+    if (block == 0){
+        data = (const char *) sb;
+        size = sizeof(struct super_block);
+    }
+    else if (block < sb->free_data_bitmap){
+        int first = (block - sb->dentries) * DIR_PER_BLOCK;
+        int count = (vol->max_files - first < DIR_PER_BLOCK) ? vol->max_files - first : DIR_PER_BLOCK;
+        data = (const char *) &vol->curDir[first];
+        size = count * sizeof(struct dir_entry);
+    }
+    else if (block < sb->inode_table){
+        int inodes = (block >= sb->free_inode_bitmap);
+        size_t offset = (size_t) (block - (inodes ? sb->free_inode_bitmap : sb->free_data_bitmap)) * BLOCK_SIZE;
+        size_t total = inodes ? (vol->max_files + 7) / 8 : (vol->num_blocks + 7) / 8;
+        data = (const char *) (inodes ? vol->curFreeInodes : vol->diskFreeData) + offset;
+        size = (total - offset < BLOCK_SIZE) ? total - offset : BLOCK_SIZE;
+    }
+    else{
+        int first = (block - sb->inode_table) * INODES_PER_BLOCK;
+        int count = (vol->max_files - first < INODES_PER_BLOCK) ? vol->max_files - first : INODES_PER_BLOCK;
+        data = (const char *) &vol->curTable[first];
+        size = count * sizeof(struct inode);
+    }
+    memset(buf, 0, BLOCK_SIZE);
+    memcpy(buf, data, size);
+}
+
+// Metadata helper that writes every metadata block marked as changed to the cache, built from the
+// structures in memory, and clears its mark. Blocks that fail to write stay marked. Called with
+// journal_lock held exclusively (or before the file system is in use)
+int meta_flush(){
+    char block_buf[BLOCK_SIZE];
+    int ret = 0;
+    for (int b = 0; b < vol->meta_end; b++){
+        if (!vol->metaDirty[b])
+            continue;
+        meta_image(b, block_buf);
+        if (cache_write(b, block_buf) < 0)
+            ret = -1;
+        else
+            vol->metaDirty[b] = 0;
+    }
+    __atomic_store_n(&vol->jdirty, 0, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// Journal helper that checksums size bytes of data (FNV-1a over 32-bit words), continuing from h
+uint32_t journal_checksum(uint32_t h, const void * data, size_t size){
+    const uint32_t * words = (const uint32_t *) data;
+    for (size_t i = 0; i < size / sizeof(uint32_t); i++){
+        h ^= words[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Journal helper that writes the journal header: transactions older than seq are never replayed
+int journal_header_write(uint32_t seq){
+    char buf[BLOCK_SIZE];
+    struct journal_header header = { .magic = JOURNAL_MAGIC, .seq = seq };
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, &header, sizeof(header));
+    return block_write(vol->curSuper_block->journal, buf);
+}
+
+// Journal helper that empties the log before transaction seq is written to it. Every committed
+// block is written home and synced, then the header is moved to seq and synced, so nothing in the
+// log is replayed any more. Only then can indirection and extent blocks freed by the committed
+// transactions be handed out again
+int journal_checkpoint(uint32_t seq){
+    // Committed blocks still in the journal table (pinned by a reader during their commit) join
+    // the other committed blocks in the cache
+    int ret = 0;
+    pthread_mutex_lock(&vol->jblock_lock);
+    for (int i = 0; i < JOURNAL_BUCKETS; i++){
+        for (struct jblock * j = vol->jBuckets[i]; j != NULL; j = j->next){
+            if (j->seq <= vol->jdone && !j->dead && cache_write(j->block, j->data) < 0)
+                ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&vol->jblock_lock);
+
+    if (ret < 0 || cache_flush() < 0 || sync_disk() < 0){
+        printf("ERROR: Failed to checkpoint journal\n");
+        return -1;
+    }
+    if (journal_header_write(seq) < 0 || sync_disk() < 0){
+        printf("ERROR: Failed to write journal header\n");
+        return -1;
+    }
+    vol->jhead = 0;
+    journal_release(seq - 1, 1);
+    return 0;
+}
+
+// Journal helper that appends transaction seq (total blocks in log) to the log with one write,
+// checkpointing first if it doesn't fit in what's left of the log
+int journal_log(uint32_t seq, const char * log, int total){
+    int size = vol->curSuper_block->journal_blocks - 1;
+    if (vol->jhead + total > size && journal_checkpoint(seq) < 0)
+        return -1;
+
+    // A transaction bigger than the whole log is written in place (not crash-safe)
+    if (total > size){
+        const struct journal_desc * desc = (const struct journal_desc *) log;
+        for (uint32_t n = 0; n < desc->count; n++){
+            const struct journal_desc * d = (const struct journal_desc *) (log + (size_t) (n / JOURNAL_TAGS) * BLOCK_SIZE);
+            if (block_write(d->tags[n % JOURNAL_TAGS], log + (size_t) (desc->descs + n) * BLOCK_SIZE) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    if (block_write_range(vol->curSuper_block->journal + 1 + vol->jhead, total, log) < 0){
+        printf("ERROR: Failed to write journal\n");
+        return -1;
+    }
+    vol->jhead += total;
+    return 0;
+}
+
+// Journal helper that commits the running transaction. Every changed metadata block is copied
+// while holding journal_lock exclusively (so no change is half done), then the transaction goes to
+// the log with one write followed by one sync. Once it's there, the images are handed to the cache
+// and reach their home blocks whenever they're evicted or flushed. Without a journal, the changed
+// blocks go straight to the cache, which is then flushed and synced. An empty transaction only
+// flushes and syncs if sync is set. Called by one thread at a time, returns 1 if the disk was
+// synced, 0 if not and -1 on errors
+int journal_commit_run(int sync){
+    pthread_rwlock_wrlock(&vol->journal_lock);
+    uint32_t seq = vol->jseq;
+
+    if (!vol->journaling){
+        int ret = meta_flush();
+        __atomic_store_n(&vol->jseq, seq + 1, __ATOMIC_RELEASE);
+        pthread_rwlock_unlock(&vol->journal_lock);
+        if (ret < 0 || cache_flush() < 0 || sync_disk() < 0){
+            printf("ERROR: Failed to sync file system\n");
+            return -1;
+        }
+        return 1;
+    }
+
+    // Count the changed blocks to size the transaction
+    int count = 0;
+    for (int b = 0; b < vol->meta_end; b++)
+        count += vol->metaDirty[b];
+    pthread_mutex_lock(&vol->jblock_lock);
+    for (int i = 0; i < JOURNAL_BUCKETS; i++){
+        for (struct jblock * j = vol->jBuckets[i]; j != NULL; j = j->next)
+            count += (j->seq == seq && !j->dead);
+    }
+
+    // Descriptor blocks, then the images, then the commit block
+    int descs = (count + JOURNAL_TAGS - 1) / JOURNAL_TAGS;
+    int total = descs + count + 1;
+    char * log = NULL;
+    if (count > 0 && (log = (char *) calloc(total, BLOCK_SIZE)) == NULL){
+        pthread_mutex_unlock(&vol->jblock_lock);
+        pthread_rwlock_unlock(&vol->journal_lock);
+        printf("ERROR: Failed to allocate journal transaction\n");
+        return -1;
+    }
+
+    int n = 0;
+    for (int i = 0; i < JOURNAL_BUCKETS; i++){
+        for (struct jblock * j = vol->jBuckets[i]; j != NULL; j = j->next){
+            if (j->seq != seq || j->dead)
+                continue;
+            ((struct journal_desc *) (log + (size_t) (n / JOURNAL_TAGS) * BLOCK_SIZE))->tags[n % JOURNAL_TAGS] = j->block;
+            memcpy(log + (size_t) (descs + n) * BLOCK_SIZE, j->data, BLOCK_SIZE);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&vol->jblock_lock);
+    for (int b = 0; b < vol->meta_end; b++){
+        if (!vol->metaDirty[b])
+            continue;
+        vol->metaDirty[b] = 0;
+        ((struct journal_desc *) (log + (size_t) (n / JOURNAL_TAGS) * BLOCK_SIZE))->tags[n % JOURNAL_TAGS] = b;
+        meta_image(b, log + (size_t) (descs + n) * BLOCK_SIZE);
+        n++;
+    }
+    __atomic_store_n(&vol->jdirty, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&vol->jseq, seq + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&vol->journal_lock);
+
+    if (count == 0){
+        if (!sync)
+            return 0;
+        if (cache_flush() < 0 || sync_disk() < 0){
+            printf("ERROR: Failed to sync file system\n");
+            return -1;
+        }
+        return 1;
+    }
+
+    for (int d = 0; d < descs; d++){
+        struct journal_desc * desc = (struct journal_desc *) (log + (size_t) d * BLOCK_SIZE);
+        desc->magic = JOURNAL_DESC;
+        desc->seq = seq;
+        desc->count = count;
+        desc->descs = descs;
+    }
+    struct journal_commit * commit = (struct journal_commit *) (log + (size_t) (descs + count) * BLOCK_SIZE);
+    commit->magic = JOURNAL_COMMIT;
+    commit->seq = seq;
+    commit->count = count;
+    commit->checksum = journal_checksum(2166136261u, log, (size_t) (descs + count) * BLOCK_SIZE);
+
+    // File data still in the cache goes out first, so a committed file doesn't point at blocks
+    // whose contents only exist in memory
+    int ret = 0;
+    if (cache_flush() < 0 || journal_log(seq, log, total) < 0 || sync_disk() < 0)
+        ret = -1;
+
+    // The transaction is safe in the log: hand its images to the cache, drop the journaled
+    // copies nobody changed since, and let the data blocks it freed be handed out again
+    for (int i = 0; ret == 0 && i < count; i++){
+        int block = ((struct journal_desc *) (log + (size_t) (i / JOURNAL_TAGS) * BLOCK_SIZE))->tags[i % JOURNAL_TAGS];
+        if (cache_write(block, log + (size_t) (descs + i) * BLOCK_SIZE) < 0)
+            ret = -1;
+    }
+    if (ret == 0){
+        pthread_mutex_lock(&vol->jblock_lock);
+        for (int i = 0; i < JOURNAL_BUCKETS; i++){
+            struct jblock * j = vol->jBuckets[i];
+            while (j != NULL){
+                struct jblock * next = j->next;
+                if (j->pins == 0 && (j->dead || j->seq <= seq))
+                    jblock_drop(j);
+                j = next;
+            }
+        }
+        pthread_mutex_unlock(&vol->jblock_lock);
+        journal_release(seq, 0);
+        STAT_ADD(journal_commits, 1);
+        STAT_ADD(journal_blocks, count);
+    }
+    else{
+        // Nothing of the transaction may be in the log, so its changes go into the next one: the
+        // metadata blocks are marked again (their images are taken afresh then) and the journaled
+        // copies join the running transaction, so they aren't dropped as committed
+        printf("ERROR: Failed to commit journal transaction %u\n", seq);
+        for (int i = 0; i < count; i++){
+            int block = ((struct journal_desc *) (log + (size_t) (i / JOURNAL_TAGS) * BLOCK_SIZE))->tags[i % JOURNAL_TAGS];
+            if (block < vol->meta_end)
+                meta_mark(block);
+        }
+        pthread_mutex_lock(&vol->jblock_lock);
+        for (int i = 0; i < JOURNAL_BUCKETS; i++){
+            for (struct jblock * j = vol->jBuckets[i]; j != NULL; j = j->next){
+                if (j->seq == seq && !j->dead){
+                    j->seq = vol->jseq;
+                    __atomic_fetch_add(&vol->jdirty, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+        pthread_mutex_unlock(&vol->jblock_lock);
+    }
+    free(log);
+    return ret < 0 ? -1 : 1;
+}
+
+// Journal function that returns once transaction target (and every one before it) is committed,
+// and synced to disk if sync is set. Callers arriving while a commit runs wait for it, then one of
+// them commits everything that piled up meanwhile for all of them (group commit), so many callers
+// cost one sync
+int journal_commit(uint32_t target, int sync){
+    pthread_mutex_lock(&vol->jcommit_lock);
+    int ret = 0;
+    while ((sync ? vol->jsynced : vol->jdone) < target){
+        if (vol->jcommitting){
+            pthread_cond_wait(&vol->jcommit_cond, &vol->jcommit_lock);
+            continue;
+        }
+        vol->jcommitting = 1;
+        uint32_t seq = __atomic_load_n(&vol->jseq, __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&vol->jcommit_lock);
+        ret = journal_commit_run(sync);
+        pthread_mutex_lock(&vol->jcommit_lock);
+        vol->jcommitting = 0;
+        if (ret >= 0)
+            vol->jdone = seq;
+        if (ret > 0)
+            vol->jsynced = seq;
+        pthread_cond_broadcast(&vol->jcommit_cond);
+        if (ret < 0)
+            break;
+    }
+    pthread_mutex_unlock(&vol->jcommit_lock);
+    return ret < 0 ? -1 : 0;
+}
+
+// Journal function for an fs.h call that ran out of space (alloc_failed) and holds none of its
+// locks. Blocks freed while journaling are only handed out again once the transaction freeing them
+// is committed, and indirection and extent blocks once the journal is checkpointed after that, so
+// if any are waiting this commits and checkpoints right away. Returns 1 if blocks were released
+// (for the call to try again) or 0 if nothing was waiting
+int journal_reclaim(){
+    if (!vol->journaling || !alloc_failed)
+        return 0;
+    pthread_mutex_lock(&vol->alloc_lock);
+    int waiting = vol->jfreed_count;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    if (waiting == 0 || journal_commit(__atomic_load_n(&vol->jseq, __ATOMIC_ACQUIRE), 0) < 0)
+        return 0;
+
+    // Checkpoint as the committing thread, so no commit writes to the log meanwhile
+    pthread_mutex_lock(&vol->jcommit_lock);
+    while (vol->jcommitting)
+        pthread_cond_wait(&vol->jcommit_cond, &vol->jcommit_lock);
+    vol->jcommitting = 1;
+    uint32_t done = vol->jdone;
+    pthread_mutex_unlock(&vol->jcommit_lock);
+    int ret = journal_checkpoint(done + 1);
+    pthread_mutex_lock(&vol->jcommit_lock);
+    vol->jcommitting = 0;
+    pthread_cond_broadcast(&vol->jcommit_cond);
+    pthread_mutex_unlock(&vol->jcommit_lock);
+
+    pthread_mutex_lock(&vol->alloc_lock);
+    int left = vol->jfreed_count;
+    pthread_mutex_unlock(&vol->alloc_lock);
+    return ret == 0 && left < waiting;
+}
+
+// Journal function called at the start of every change to the file system (fs_create, fs_delete,
+// fs_write and the like), so a commit or fs_sync never sees it half done
+void journal_begin(){
+    pthread_rwlock_rdlock(&vol->journal_lock);
+}
+
+// Journal function called at the end of every change. Wakes the commit thread early once a
+// quarter of the log has changed
+void journal_end(){
+    pthread_rwlock_unlock(&vol->journal_lock);
+    if (vol->journaling && __atomic_load_n(&vol->jdirty, __ATOMIC_RELAXED) >= (int) (vol->curSuper_block->journal_blocks - 1) / 4){
+        pthread_mutex_lock(&vol->jcommit_lock);
+        vol->jwake = 1;
+        pthread_cond_signal(&vol->jwake_cond);
+        pthread_mutex_unlock(&vol->jcommit_lock);
+    }
+}
+
+// Journal thread body: commits every JOURNAL_COMMIT_MS, or sooner when journal_end wakes it. Data
+// buffered for delayed allocation is written out first, so it's never older than one commit
+void * journal_main(void * arg){
+    vol = arg;
+    disk_use(vol->disk);
+    pthread_mutex_lock(&vol->jcommit_lock);
+    while (vol->jrunning){
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_COMMIT_MS / 1000;
+        deadline.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (vol->jrunning && !vol->jwake){
+            if (pthread_cond_timedwait(&vol->jwake_cond, &vol->jcommit_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (!vol->jrunning)
+            break;
+        vol->jwake = 0;
+        pthread_mutex_unlock(&vol->jcommit_lock);
+        if (vol->delayed != NULL)
+            delalloc_flush_all();
+        journal_commit(__atomic_load_n(&vol->jseq, __ATOMIC_ACQUIRE), 0);
+        pthread_mutex_lock(&vol->jcommit_lock);
+    }
+    pthread_mutex_unlock(&vol->jcommit_lock);
+    return NULL;
+}
+
+// Journal helper that replays the log onto the home blocks after a crash. Transactions are taken
+// in order from the start of the log until one is missing, torn (bad checksum) or older than the
+// one before it; the log is emptied afterwards. Sets up the sequence numbers for new transactions
+int journal_replay(){
+    struct super_block * sb = vol->curSuper_block;
+    int size = sb->journal_blocks - 1;
+    if (sb->journal_blocks < 2 || sb->journal + sb->journal_blocks > (uint32_t) vol->num_blocks){
+        printf("ERROR: Superblock has an invalid journal\n");
+        return -1;
+    }
+
+    char * log = (char *) malloc((size_t) sb->journal_blocks * BLOCK_SIZE);
+    if (log == NULL || block_read_range(sb->journal, sb->journal_blocks, log) < 0){
+        free(log);
+        printf("ERROR: Failed to read journal\n");
+        return -1;
+    }
+    struct journal_header * header = (struct journal_header *) log;
+    if (header->magic != JOURNAL_MAGIC){
+        free(log);
+        printf("ERROR: Journal header is corrupted\n");
+        return -1;
+    }
+
+    uint32_t next = header->seq;    // Oldest sequence number the next transaction may have
+    int pos = 0;
+    int replayed = 0;
+    int ret = 0;
+    while (pos < size){
+        char * start = log + (size_t) (1 + pos) * BLOCK_SIZE;
+        struct journal_desc * desc = (struct journal_desc *) start;
+        if (desc->magic != JOURNAL_DESC || desc->seq < next || desc->count == 0 || desc->count > (uint32_t) size)
+            break;
+        int count = desc->count;
+        int descs = (count + JOURNAL_TAGS - 1) / JOURNAL_TAGS;
+        if (desc->descs != (uint32_t) descs || pos + descs + count + 1 > size)
+            break;
+        struct journal_commit * commit = (struct journal_commit *) (start + (size_t) (descs + count) * BLOCK_SIZE);
+        if (commit->magic != JOURNAL_COMMIT || commit->seq != desc->seq || commit->count != desc->count ||
+            commit->checksum != journal_checksum(2166136261u, start, (size_t) (descs + count) * BLOCK_SIZE))
+            break;
+
+        for (int n = 0; ret == 0 && n < count; n++){
+            uint32_t block = ((struct journal_desc *) (start + (size_t) (n / JOURNAL_TAGS) * BLOCK_SIZE))->tags[n % JOURNAL_TAGS];
+            if (block >= (uint32_t) vol->num_blocks || (block >= sb->journal && block < sb->journal + sb->journal_blocks))
+                continue;
+            if (block_write(block, start + (size_t) (descs + n) * BLOCK_SIZE) < 0)
+                ret = -1;
+        }
+        next = desc->seq + 1;
+        pos += descs + count + 1;
+        replayed++;
+    }
+    free(log);
+
+    // Make the replayed blocks stick before the header stops them from being replayed again
+    if (ret == 0 && replayed > 0 && (sync_disk() < 0 || journal_header_write(next) < 0 || sync_disk() < 0))
+        ret = -1;
+    if (ret < 0){
+        printf("ERROR: Failed to replay journal\n");
+        return -1;
+    }
+    vol->jhead = 0;
+    vol->jseq = next;
+    vol->jdone = next - 1;
+    return 0;
+}
+
+// Journal function that sets up journal_lock and the transaction numbers for fs_sync, and starts
+// journaling (and its commit thread) if enable is set. journal_replay already numbered the
+// transactions of a journaled disk
+int journal_start(int enable){
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&vol->journal_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    vol->jdirty = 0;
+    vol->jcommitting = 0;
+    vol->jwake = 0;
+    vol->jfreed_count = 0;
+    vol->journaling = enable;
+    if (!enable){
+        vol->jseq = 1;
+        vol->jdone = 0;
+    }
+    vol->jsynced = vol->jdone;
+    if (!enable)
+        return 0;
+    vol->jrunning = 1;
+    if (pthread_create(&vol->jthread, NULL, journal_main, vol) != 0){
+        printf("ERROR: Failed to start journal thread\n");
+        vol->jrunning = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Journal function that stops the commit thread and commits what's left (written in place without
+// a journal), then checkpoints the journal so the disk doesn't need replaying at the next mount_fs
+int journal_stop(){
+    if (vol->journaling){
+        pthread_mutex_lock(&vol->jcommit_lock);
+        int running = vol->jrunning;
+        vol->jrunning = 0;
+        pthread_cond_signal(&vol->jwake_cond);
+        pthread_mutex_unlock(&vol->jcommit_lock);
+        if (running)
+            pthread_join(vol->jthread, NULL);
+    }
+
+    int ret = journal_commit(vol->jseq, 0);
+    if (vol->journaling){
+        if (ret == 0 && journal_checkpoint(vol->jseq) < 0)
+            ret = -1;
+
+        // Nothing is pinned any more, so whatever is left in the table can go
+        for (int i = 0; i < JOURNAL_BUCKETS; i++){
+            while (vol->jBuckets[i] != NULL)
+                jblock_drop(vol->jBuckets[i]);
+        }
+        free(vol->jFreed);
+        vol->jFreed = NULL;
+        vol->jfreed_count = 0;
+        vol->jfreed_size = 0;
+        vol->journaling = 0;
+    }
+    pthread_rwlock_destroy(&vol->journal_lock);
+    return ret;
+}
+
+// Disk helper that clears the pointers make_fs and mount_fs set up, once the disk is open, so
+// mount_abort knows what they got to (they may hold what an earlier umount_fs freed)
+void mount_clear(){
+    vol->curSuper_block = NULL;
+    vol->indirMap = NULL;
+    vol->curTable = NULL;
+    vol->tableLoaded = NULL;
+    vol->inodeSeq = NULL;
+    vol->inode_locks = NULL;
+    vol->curDir = NULL;
+    vol->dirBuckets = NULL;
+    vol->dirNext = NULL;
+    vol->curFreeInodes = NULL;
+    vol->curFreeData = NULL;
+    vol->diskFreeData = NULL;
+    vol->metaDirty = NULL;
+    vol->aioPending = NULL;
+    vol->delayed = NULL;
+    vol->blockCache = NULL;
+}
+
+// Disk helper that undoes a make_fs or mount_fs that failed partway: stops the readahead thread,
+// frees what was allocated (without writing anything back) and closes the disk, so the volume can
+// be made or mounted again. Returns -1 for the caller to return
+int mount_abort(){
+    readahead_stop();
+    if (vol->inode_locks != NULL){
+        for (int i = 0; i < vol->max_files; i++)
+            pthread_rwlock_destroy(&vol->inode_locks[i]);
+    }
+    if (vol->diskFreeData != vol->curFreeData)
+        free(vol->diskFreeData);
+    free(vol->curFreeData);
+    free(vol->curFreeInodes);
+    free(vol->dirNext);
+    free(vol->dirBuckets);
+    free(vol->curDir);
+    free(vol->inode_locks);
+    free(vol->inodeSeq);
+    free(vol->tableLoaded);
+    free(vol->curTable);
+    free(vol->indirMap);
+    free(vol->curSuper_block);
+    free(vol->metaDirty);
+    free(vol->aioPending);
+    free(vol->delayed);
+    free(vol->blockCache);
+    mount_clear();
+    vol->disk_mapped = 0;
+    close_disk();
+    return -1;
+}
+
+// Disk function that creates new disk with default options
+int make_fs(const char *disk_name){
+    struct fs_options opts = { .flags = 0 };
+    return make_fs_opts(disk_name, &opts);
+}
+
+// Disk function that creates new disk with the given format options and initializes global variables
+int make_fs_opts(const char *disk_name, const struct fs_options *opts){
+    // Check the number of files asked for (0 means the default)
+    int files = opts->max_files ? opts->max_files : MAX_NUM_FILES;
+    if (files < 1 || files > MAX_FILES_LIMIT){
+        printf("ERROR: Number of files must be between 1 and %d\n", MAX_FILES_LIMIT);
+        return -1;
+    }
+    int blocks = opts->num_blocks ? opts->num_blocks : DISK_BLOCKS;
+    if (blocks < 1){
+        printf("ERROR: Invalid disk size %d\n", blocks);
+        return -1;
+    }
+    vol->num_blocks = blocks;
+
+    // Only way for code to fail is if it fails to create the disk (sparse, unless asked to reserve
+    // its space)
+    if (((opts->flags & FS_FORMAT_PREALLOC) ? make_disk_alloc(disk_name, blocks) : make_disk_size(disk_name, blocks)) != 0){
+        printf("ERROR: Unable to create disk with name %s\n", disk_name);
+        return -1;
+    }
+
+    if (open_disk(disk_name) != 0){
+        printf("ERROR: Unable to open disk with name %s\n", disk_name);
+        return -1;
+    }
+    mount_clear();
+
+    if (cache_init() < 0)
+        return mount_abort();
+    disk_set_hook(io_hook);
+
+    // Initialize file system datastructures:
+
+    // 1. Initialize a superblock with file system metadata and write to disk. The directory takes
+    // as many blocks as it needs starting at block 1, followed by the bitmaps and inode table
+    vol->curSuper_block = (struct super_block *) malloc(sizeof(struct super_block));
+    vol->curSuper_block->magic = FS_MAGIC;
+    vol->curSuper_block->version = FS_VERSION;
+    vol->curSuper_block->dentries = 1;
+    vol->curSuper_block->free_data_bitmap = vol->curSuper_block->dentries + dir_blocks(files);
+    vol->curSuper_block->free_inode_bitmap = vol->curSuper_block->free_data_bitmap + data_bitmap_blocks(blocks);
+    vol->curSuper_block->inode_table = vol->curSuper_block->free_inode_bitmap + inode_bitmap_blocks(files);
+    vol->curSuper_block->flags = opts->flags & (FS_FORMAT_EXTENTS | FS_FORMAT_JOURNAL);
+    vol->curSuper_block->max_files = files;
+    vol->curSuper_block->num_blocks = blocks;
+    vol->max_files = files;
+    int first_data = vol->curSuper_block->inode_table + table_blocks(files);
+
+    // The journal (if asked for) goes right after the inode table
+    vol->curSuper_block->journal = 0;
+    vol->curSuper_block->journal_blocks = 0;
+    if (opts->flags & FS_FORMAT_JOURNAL){
+        int jblocks = opts->journal_blocks ? opts->journal_blocks : JOURNAL_BLOCKS;
+        if (jblocks < 2 || jblocks >= blocks){
+            printf("ERROR: Invalid journal size %d\n", jblocks);
+            return mount_abort();
+        }
+        vol->curSuper_block->journal = first_data;
+        vol->curSuper_block->journal_blocks = jblocks;
+        first_data += jblocks;
+    }
+    if (first_data >= blocks){
+        printf("ERROR: Metadata for %d files doesn't fit on the disk\n", files);
+        return mount_abort();
+    }
+    vol->meta_end = vol->curSuper_block->inode_table + table_blocks(files);
+    vol->data_start = first_data;
+
+    // An empty journal: its header, with nothing in the log to replay
+    if (vol->curSuper_block->journal){
+        struct journal_header header = { .magic = JOURNAL_MAGIC, .seq = 1 };
+        if (meta_write(vol->curSuper_block->journal, &header, sizeof(header)) != 0){
+            printf("ERROR: Failed to write journal header to disk\n");
+            return mount_abort();
+        }
+    }
+
+    // 2. Set up inodes, allocate memory, and set inode table
+    vol->curTable = (struct inode *) calloc(files, sizeof(struct inode));
+
+    // 3. Set up directory entries and entry array (can only be max_files at a time)
+    vol->curDir = (struct dir_entry *) calloc(files, sizeof(struct dir_entry));
+    vol->file_count = 0;
+
+    // 4. inode free bitmap and initialize to all ones (uses uint8 so same functions can be used)
+    vol->curFreeInodes = (uint8_t *) calloc((files + 7) / 8, sizeof(uint8_t));
+    setNbits(vol->curFreeInodes, files, 0, files);
+
+    // 5. Data free bitmap and initialize to ones (except for what's used for metadata and the superblock)
+    vol->curFreeData = (uint8_t *) calloc((vol->num_blocks + 7) / 8, sizeof(uint8_t));
+    setNbits(vol->curFreeData, vol->num_blocks, first_data, vol->num_blocks);
+    vol->alloc_hint = 0;
+    vol->diskFreeData = vol->curFreeData;
+
+    // 6. Write the metadata blocks that differ from the new disk, which reads as zeros: the
+    // superblock and both bitmaps. The empty directory and inode table are already there
+    vol->metaDirty = (uint8_t *) calloc(vol->meta_end, sizeof(uint8_t));
+    meta_mark(0);
+    for (int b = vol->curSuper_block->free_data_bitmap; b < vol->curSuper_block->inode_table; b++)
+        meta_mark(b);
+    if (meta_flush() < 0){
+        printf("ERROR: Failed to write metadata to disk\n");
+        return mount_abort();
+    }
+    free(vol->metaDirty);
+    vol->metaDirty = NULL;
+    vol->diskFreeData = NULL;
+
+    // 7. Set all file descriptors to be closed
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        vol->fileDescriptors[i].open = 0;
+        vol->fileDescriptors[i].file_offset = 0;
+    }
+    vol->fd_count = 0;
+
+    free(vol->curSuper_block);
+    free(vol->curTable);
+    free(vol->curDir);
+    free(vol->curFreeInodes);
+    free(vol->curFreeData);
+
+    // Write all cached metadata blocks back before closing the disk
+    if (cache_destroy() < 0){
+        printf("ERROR: Failed to flush block cache to disk\n");
+        close_disk();
+        return -1;
+    }
+
+    if (close_disk() != 0){
+        printf("ERROR: Failed to close disk created\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Disk function that mounts an existing virtual disk using a given name
+int mount_fs(const char *disk_name){
+    struct fs_options opts = { .flags = 0 };
+    return mount_fs_opts(disk_name, &opts);
+}
+
+// Disk function that mounts an existing virtual disk with the given mount options
+int mount_fs_opts(const char *disk_name, const struct fs_options *opts){
+    // Check if disk exists and, if so, open it (mapped into memory if asked for)
+    if (opts->flags & FS_MOUNT_MMAP){
+        if (open_disk_mmap(disk_name) < 0)
+            return -1;
+    }
+    else if (open_disk(disk_name) < 0)
+        return -1;
+    mount_clear();
+
+    if (cache_init() < 0)
+        return mount_abort();
+    disk_set_hook(io_hook);
+    
+    // Read in super block and dynamically allocate memory for all global metadata datastructures
+
+    // 1. Read in the superblock from the 1st block of the disk
+    vol->curSuper_block = (struct super_block *) malloc(sizeof(struct super_block));
+    vol->num_blocks = disk_size();
+    if (meta_read(0, vol->curSuper_block, sizeof(struct super_block)) < 0){
+        printf("ERROR: Failed to read from superblock\n");
+        return mount_abort();
+    }
+    if (vol->curSuper_block->magic != FS_MAGIC){
+        printf("ERROR: Disk %s doesn't hold a file system made by make_fs\n", disk_name);
+        return mount_abort();
+    }
+    if (vol->curSuper_block->version != FS_VERSION){
+        printf("ERROR: Disk %s has file system version %u, only version %d is supported\n", disk_name, vol->curSuper_block->version, FS_VERSION);
+        return mount_abort();
+    }
+    if (vol->curSuper_block->num_blocks < 1 || vol->curSuper_block->num_blocks > (uint32_t) vol->num_blocks){
+        printf("ERROR: Superblock disk size doesn't match the disk\n");
+        return mount_abort();
+    }
+    vol->num_blocks = vol->curSuper_block->num_blocks;
+    vol->max_files = vol->curSuper_block->max_files;
+    if (vol->max_files < 1 || vol->max_files > MAX_FILES_LIMIT){
+        printf("ERROR: Superblock has an invalid number of files\n");
+        return mount_abort();
+    }
+    vol->meta_end = vol->curSuper_block->inode_table + table_blocks(vol->max_files);
+    vol->data_start = vol->meta_end + vol->curSuper_block->journal_blocks;
+    vol->indirMap = (uint8_t *) calloc((vol->num_blocks + 7) / 8, sizeof(uint8_t));
+
+    // A journaled disk that wasn't unmounted cleanly gets its committed transactions replayed
+    // onto the metadata blocks before any of them is read
+    if ((vol->curSuper_block->flags & FS_FORMAT_JOURNAL) && journal_replay() < 0)
+        return mount_abort();
+
+    // 2. Set up the inode table. Its blocks are only read when a file using them is first
+    // created, opened or deleted (see inode_load)
+    vol->curTable = (struct inode *) calloc(vol->max_files, sizeof(struct inode));
+    vol->tableLoaded = (uint8_t *) calloc(table_blocks(vol->max_files), sizeof(uint8_t));
+    vol->inodeSeq = (uint32_t *) calloc(vol->max_files, sizeof(uint32_t));
+    vol->inode_locks = (pthread_rwlock_t *) malloc(vol->max_files * sizeof(pthread_rwlock_t));
+    for (int i = 0; i < vol->max_files; i++)
+        pthread_rwlock_init(&vol->inode_locks[i], NULL);
+
+    // 3. Load directory entries based on superblock (all of them, for the directory index)
+    vol->curDir = (struct dir_entry *) malloc(vol->max_files * sizeof(struct dir_entry));
+    if (dir_load() < 0){
+        printf("ERROR: Failed to load directory entries\n");
+        return mount_abort();
+    }
+
+    vol->file_count = 0;
+    for (int i = 0; i < vol->max_files; i++){
+        if (vol->curDir[i].is_used){
+            vol->file_count++;
+        }
+    }
+    vol->dirBuckets = (int *) malloc(DIR_BUCKETS * sizeof(int));
+    vol->dirNext = (int *) malloc(vol->max_files * sizeof(int));
+    dir_index_build();
+    vol->de_hint = 0;
+
+    // 4. Load inode free bitmap based on superblock
+    vol->curFreeInodes = (uint8_t *) malloc((vol->max_files + 7) / 8 * sizeof(uint8_t));
+    if (meta_read(vol->curSuper_block->free_inode_bitmap, vol->curFreeInodes, (vol->max_files + 7) / 8 * sizeof(uint8_t)) < 0){
+        printf("ERROR: Failed to load free inode bitmap\n");
+        return mount_abort();
+    }
+
+    // 5. Load data free bitmap based on superblock
+    vol->curFreeData = (uint8_t *) malloc((vol->num_blocks + 7) / 8 * sizeof(uint8_t));
+    if (meta_read(vol->curSuper_block->free_data_bitmap, vol->curFreeData, (vol->num_blocks + 7) / 8 * sizeof(uint8_t)) < 0){
+        printf("ERROR: Failed to load free data bitmap\n");
+        return mount_abort();
+    }
+    vol->alloc_hint = 0;
+    vol->diskFreeData = vol->curFreeData;
+    if (vol->curSuper_block->flags & FS_FORMAT_JOURNAL){
+        vol->diskFreeData = (uint8_t *) malloc((vol->num_blocks + 7) / 8 * sizeof(uint8_t));
+        memcpy(vol->diskFreeData, vol->curFreeData, (vol->num_blocks + 7) / 8 * sizeof(uint8_t));
+    }
+    vol->metaDirty = (uint8_t *) calloc(vol->meta_end, sizeof(uint8_t));
+
+    // 6. Initialize all file descriptors to closed and offset 0
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        vol->fileDescriptors[i].open = 0;
+        vol->fileDescriptors[i].file_offset = 0;
+    }
+    vol->fd_count = 0;
+
+    // 7. Start reading ahead for sequential readers
+    if (!(opts->flags & FS_MOUNT_NO_READAHEAD) && readahead_start() < 0)
+        return mount_abort();
+
+    // 8. Start the async I/O engine (io_uring, or a thread pool without it)
+    vol->aioDone = NULL;
+    vol->aioWrites = NULL;
+    vol->aio_inflight = 0;
+    vol->aioPending = (int *) calloc(vol->max_files, sizeof(int));
+    vol->delayed = NULL;
+    if (opts->flags & FS_MOUNT_DELALLOC)
+        vol->delayed = (struct delalloc *) calloc(vol->max_files, sizeof(struct delalloc));
+    if (disk_io_start(AIO_DEPTH, (opts->flags & FS_MOUNT_AIO_THREADS) ? DISK_IO_THREADS : 0) < 0)
+        return mount_abort();
+
+    // 9. Start committing metadata changes to the journal (if the disk has one)
+    if (journal_start(vol->curSuper_block->flags & FS_FORMAT_JOURNAL) < 0)
+        return mount_abort();
+
+    return 0;
+}
+
+// Disk function that unmounts virtual disk and saves any changes made to file system
+int umount_fs(const char *disk_name){
+
+    // First, write out the data buffered for delayed allocation. If that fails (the disk is full),
+    // nothing was torn down yet and the disk stays mounted, so space can be freed and umount_fs
+    // called again
+    if (vol->delayed != NULL && delalloc_flush_all() < 0){
+        printf("ERROR: Failed to write buffered file data to disk\n");
+        return -1;
+    }
+
+    // Stop the readahead thread and finish async requests in flight so nothing touches the
+    // cache or inodes while they're freed (completed requests that weren't waited for are dropped)
+    readahead_stop();
+    pthread_mutex_lock(&vol->aio_lock);
+    while (vol->aio_inflight > 0)
+        aio_reap_locked(1);
+    vol->aioDone = NULL;
+    pthread_mutex_unlock(&vol->aio_lock);
+    disk_io_stop();
+    free(vol->aioPending);
+    vol->aioPending = NULL;
+
+    // Second, save the metadata to the disk: only the directory, bitmap and inode table blocks
+    // changed since the last commit or fs_sync are written (then the journal is checkpointed, so
+    // the disk needs no replaying). From here on a failure doesn't stop the teardown: the journal
+    // thread is gone and everything is released and closed before umount_fs returns -1
+    int ret = 0;
+    if (journal_stop() < 0){
+        printf("ERROR: Failed to write metadata to disk\n");
+        ret = -1;
+    }
+    if (vol->delayed != NULL){
+        for (int i = 0; i < vol->max_files; i++)
+            free(vol->delayed[i].data);
+        free(vol->delayed);
+        vol->delayed = NULL;
+    }
+
+    // Free the directory (and its index), bitmaps and inode table
+    free(vol->curDir);
+    free(vol->dirBuckets);
+    free(vol->dirNext);
+    if (vol->diskFreeData != vol->curFreeData)
+        free(vol->diskFreeData);
+    free(vol->curFreeData);
+    vol->diskFreeData = NULL;
+    free(vol->curFreeInodes);
+    free(vol->curTable);
+    free(vol->tableLoaded);
+    free(vol->inodeSeq);
+    free(vol->metaDirty);
+    vol->metaDirty = NULL;
+    for (int i = 0; i < vol->max_files; i++)
+        pthread_rwlock_destroy(&vol->inode_locks[i]);
+    free(vol->inode_locks);
+    free(vol->curSuper_block);
+    vol->curSuper_block = NULL;
+
+    // Close all file descriptors
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        vol->fileDescriptors[i].open = 0;
+        vol->fileDescriptors[i].file_offset = 0;
+    }
+    vol->fd_count = 0;
+
+    // Write back every dirty cached block (file data, indirection blocks, and metadata above)
+    if (cache_destroy() < 0){
+        printf("ERROR: Failed to flush block cache to disk\n");
+        ret = -1;
+    }
+
+    // Last, close the disk after all metadata was written to it
+    free(vol->indirMap);
+    vol->indirMap = NULL;
+    if (close_disk() < 0){
+        printf("ERROR: Failed to close disk\n");
+        ret = -1;
+    }
+
+    // Return success once closed
+    return ret;
+}
+
+// Helper function that checks if file descriptor is valid
+int validfd(int fd){
+
+    // Check if fd is within range
+    if (fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("ERROR: invalid file descriptor\n");
+        return -1;
+    }
+
+    // Check if fd is open
+    if (vol->fileDescriptors[fd].open != 1){
+        printf("ERROR: Not an open file descriptor\n");
+        return -1;
+    }
+
+    //Otherwise, return valid
+    return 0;
+}
+
+// Helper function that locks a file descriptor, returning -1 (without holding the lock) if it isn't open
+int fd_lock(int fd){
+    if (fd < 0 || fd >= MAX_OPEN_FILES){
+        printf("ERROR: invalid file descriptor\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&vol->fileDescriptors[fd].lock);
+    if (validfd(fd) != 0){
+        pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+        return -1;
+    }
+    return 0;
+}
+
+// File system helper function that checks if a file exists, if it does return inode number
+int fs_exists(const char * name){
+    // Look the name up in the directory index, return -1 if not found
+    int entry = de_find(name);
+    if (entry < 0)
+        return -1;
+    return vol->curDir[entry].inode_number;
+}
+
+// File system helper function that checks if there are any open file descriptors of the file
+int fs_isopen(const char * name){
+    // Check if file exists
+    int inum = fs_exists(name);
+    if (inum < 0){
+        printf("ERROR: File %s doesn't exist\n", name);
+        return -1;
+    }
+
+    // If open file descriptor found with same inode number, return 1
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        if (vol->fileDescriptors[i].inode == inum && vol->fileDescriptors[i].open)
+            return 1;
+    }
+    return 0;
+}
+
+// File system function that finds the first free file descriptor and returns it
+int fs_freefd(){
+    // Iterate through all file descriptors and find if any are unused
     for (int i = 0; i < MAX_OPEN_FILES; i++){
-        if (fileDescriptors[i].open == 0){
+        if (vol->fileDescriptors[i].open == 0){
             return i;
         }
     }
@@ -403,34 +2795,615 @@ int fs_freefd(){
 
 // Directory entry helper function that finds first directory entry index that's unused
 int de_free(){
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        if (!curDir[i].is_used)
+    // Next-fit: start after the last entry handed out so filling a large directory stays linear
+    for (int n = 0; n < vol->max_files; n++){
+        int i = (vol->de_hint + n) % vol->max_files;
+        if (!vol->curDir[i].is_used){
+            vol->de_hint = i + 1;
             return i;
+        }
     }
     return -1;
 }
 
-// Directory entry helper that finds directory entry value where open
-int de_find(const char * name){
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        if (strcmp(name, curDir[i].name) == 0)
-            return i;
+// Extent helper function that reads the extent block of an inode into more (all zeros if it has none)
+int extent_load(struct inode * node, struct extent * more){
+    if (node->single_indirect_offset == 0){
+        memset(more, 0, BLOCK_SIZE);
+        return 0;
     }
-    return -1;
+    if (indir_read(node->single_indirect_offset, more) < 0){
+        printf("ERROR: Failed to read extent block from disk\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Extent helper function that returns the nth extent of an inode (inode extents first, then the extent block)
+struct extent * extent_get(struct inode * node, struct extent * more, int n){
+    if (n < INODE_EXTENTS)
+        return &node->extents[n];
+    return &more[n - INODE_EXTENTS];
+}
+
+// Extent helper function that returns the disk block holding file block cur_block (0 if it's in a
+// hole, with BLOCK_UNWRITTEN set if it's in an unwritten extent). A hole is an extent starting at
+// block 0, which is never a data block, and everything past the last extent is one too.
+// more may be NULL if the inode has no extent block. If run isn't NULL, it's set to the number of blocks left in the extent starting at that block
+int extent_lookup(struct inode * node, struct extent * more, int cur_block, int * run){
+    int num_extents = INODE_EXTENTS + BLOCK_EXTENTS;
+    if (more == NULL)
+        num_extents = INODE_EXTENTS;
+
+    for (int i = 0; i < num_extents; i++){
+        struct extent * e = extent_get(node, more, i);
+        if (e->length == 0)
+            break;
+        if (cur_block < e->length){
+            if (run != NULL)
+                *run = e->length - cur_block;
+            return (e->start == 0) ? 0 : e->start + cur_block;
+        }
+        cur_block -= e->length;
+    }
+    return 0;
+}
+
+// Extent helper function that maps a new block at the end of the file (unwritten if flag is
+// BLOCK_UNWRITTEN). The block comes from res while it has blocks left (res may be NULL). Otherwise
+// the last extent is grown if the disk block right after it is free, or a new extent is started.
+// Sets more_dirty if the extent block changed. Returns the new disk block or -1 if the disk (or
+// extent list) is full
+int extent_append(struct inode * node, struct extent * more, int * more_dirty, struct reserve * res, uint32_t flag){
+    // Find the last extent in use
+    int count = 0;
+    while (count < INODE_EXTENTS + BLOCK_EXTENTS && extent_get(node, more, count)->length != 0)
+        count++;
+
+    int block = -1;
+    if (res != NULL && res->left > 0)
+        block = alloc_data(res);
+
+    if (count > 0){
+        struct extent * last = extent_get(node, more, count - 1);
+        int next = (last->start & ~BLOCK_UNWRITTEN) + last->length;
+        int grown = 0;
+        if (last->start == 0 || (last->start & BLOCK_UNWRITTEN) != flag)
+            grown = 0;
+        else if (block >= 0)
+            grown = (block == next && last->length < UINT32_MAX);
+        else{
+            pthread_mutex_lock(&vol->alloc_lock);
+            if (next < vol->num_blocks && last->length < UINT32_MAX && getNbit(vol->curFreeData, vol->num_blocks, next) == 1){
+                data_bitmap_use(next);
+                grown = 1;
+            }
+            pthread_mutex_unlock(&vol->alloc_lock);
+        }
+
+        if (grown){
+            last->length++;
+            if (count > INODE_EXTENTS)
+                *more_dirty = 1;
+            return next;
+        }
+    }
+
+    if (count == INODE_EXTENTS + BLOCK_EXTENTS){
+        // Put the reserved block back for reserve_release
+        if (block >= 0){
+            res->next--;
+            res->left++;
+        }
+        printf("ERROR: Reached maximum number of extents\n");
+        return -1;
+    }
+
+    // Create the extent block the first time the inode extents run out
+    if (count == INODE_EXTENTS && node->single_indirect_offset == 0){
+        int extent_block = alloc_block();
+        if (extent_block < 0){
+            if (block >= 0){
+                res->next--;
+                res->left++;
+            }
+            printf("ERROR: Disk is full\n");
+            return -1;
+        }
+        memset(more, 0, BLOCK_SIZE);
+        node->single_indirect_offset = extent_block;
+        *more_dirty = 1;
+    }
+
+    // Without a reserved block, start the extent at a free window of EXTENT_GOAL blocks and move the
+    // allocator past it, so other files allocating at the same time don't take the blocks this
+    // extent will grow into
+    if (block < 0){
+        pthread_mutex_lock(&vol->alloc_lock);
+        block = findFreeRun(vol->curFreeData, vol->num_blocks, EXTENT_GOAL, vol->alloc_hint);
+        if (block < 0)
+            block = findFreeRun(vol->curFreeData, vol->num_blocks, EXTENT_GOAL, 0);
+        if (block >= 0){
+            data_bitmap_use(block);
+            vol->alloc_hint = block + EXTENT_GOAL;
+        }
+        pthread_mutex_unlock(&vol->alloc_lock);
+    }
+    if (block < 0)
+        block = alloc_block();
+    if (block < 0){
+        printf("ERROR: Disk is full\n");
+        return -1;
+    }
+    struct extent * e = extent_get(node, more, count);
+    e->start = block | flag;
+    e->length = 1;
+    if (count >= INODE_EXTENTS)
+        *more_dirty = 1;
+    return block;
+}
+
+// Extent helper function that adds n blocks of hole at the end of the file's extents (growing the
+// last extent if it's a hole). Sets more_dirty if the extent block changed. Returns -1 if the
+// extent list (or the disk, for a new extent block) is full
+int extent_hole(struct inode * node, struct extent * more, int * more_dirty, int n){
+    int count = 0;
+    while (count < INODE_EXTENTS + BLOCK_EXTENTS && extent_get(node, more, count)->length != 0)
+        count++;
+
+    if (count > 0 && extent_get(node, more, count - 1)->start == 0){
+        extent_get(node, more, count - 1)->length += n;
+        if (count > INODE_EXTENTS)
+            *more_dirty = 1;
+        return 0;
+    }
+    if (count == INODE_EXTENTS + BLOCK_EXTENTS){
+        printf("ERROR: Reached maximum number of extents\n");
+        return -1;
+    }
+    if (count == INODE_EXTENTS && node->single_indirect_offset == 0){
+        int extent_block = alloc_block();
+        if (extent_block < 0){
+            printf("ERROR: Disk is full\n");
+            return -1;
+        }
+        memset(more, 0, BLOCK_SIZE);
+        node->single_indirect_offset = extent_block;
+    }
+    if (count >= INODE_EXTENTS)
+        *more_dirty = 1;
+    extent_get(node, more, count)->start = 0;
+    extent_get(node, more, count)->length = n;
+    return 0;
+}
+
+// Extent helper function that maps file block cur_block, in a hole or an unwritten extent, to disk
+// block block (unwritten if block has BLOCK_UNWRITTEN set). The block joins the extent before it
+// when that one ends right before it on disk and is in the same state (so filling a hole or writing
+// an unwritten extent in order keeps one extent growing), otherwise the extent is split around it.
+// When the extent list has no room for a split, a whole unwritten extent is zeroed on disk and
+// marked written instead. Sets more_dirty if the extent block changed. Returns -1 if the extent list
+// (or the disk, for a new extent block) is full
+int extent_set(struct inode * node, struct extent * more, int cur_block, uint32_t block, int * more_dirty){
+    int count = 0;
+    while (count < INODE_EXTENTS + BLOCK_EXTENTS && extent_get(node, more, count)->length != 0)
+        count++;
+
+    // Find the extent and the block's place in it
+    int i = 0;
+    while (i < count && cur_block >= (int) extent_get(node, more, i)->length){
+        cur_block -= extent_get(node, more, i)->length;
+        i++;
+    }
+    if (i == count)
+        return -1;
+    struct extent * e = extent_get(node, more, i);
+    uint32_t start = e->start & ~BLOCK_UNWRITTEN;   // 0 for a hole
+    uint32_t flag = e->start & BLOCK_UNWRITTEN;
+    if (count > INODE_EXTENTS)
+        *more_dirty = 1;
+
+    if (cur_block == 0 && i > 0){
+        struct extent * prev = extent_get(node, more, i - 1);
+        if (prev->start != 0 && (prev->start & BLOCK_UNWRITTEN) == (block & BLOCK_UNWRITTEN) &&
+            prev->start + prev->length == block && prev->length < UINT32_MAX){
+            prev->length++;
+            if (start != 0)
+                e->start++;
+            e->length--;
+            if (e->length == 0){
+                for (int j = i; j < count - 1; j++)
+                    *extent_get(node, more, j) = *extent_get(node, more, j + 1);
+                extent_get(node, more, count - 1)->start = 0;
+                extent_get(node, more, count - 1)->length = 0;
+            }
+            return 0;
+        }
+    }
+
+    // Split into the blocks before it (if any), the block, and the blocks after it
+    int before = cur_block;
+    int after = e->length - cur_block - 1;
+    int added = (before > 0) + (after > 0);
+    if (count + added > INODE_EXTENTS + BLOCK_EXTENTS){
+        if (start == 0 || (block & BLOCK_UNWRITTEN)){
+            printf("ERROR: Reached maximum number of extents\n");
+            return -1;
+        }
+
+        // No room to split: zero the whole extent on disk instead, so it can all be marked written
+        char * zeros = calloc(EXTENT_GOAL, BLOCK_SIZE);
+        if (zeros == NULL){
+            printf("ERROR: Could not allocate memory\n");
+            return -1;
+        }
+        for (uint32_t done = 0; done < e->length; done += EXTENT_GOAL){
+            int run = (e->length - done < EXTENT_GOAL) ? e->length - done : EXTENT_GOAL;
+            if (cache_write_range(start + done, run, zeros) < 0){
+                free(zeros);
+                return -1;
+            }
+        }
+        free(zeros);
+        e->start = start;
+        return 0;
+    }
+    if (count + added > INODE_EXTENTS && node->single_indirect_offset == 0){
+        int extent_block = alloc_block();
+        if (extent_block < 0){
+            printf("ERROR: Disk is full\n");
+            return -1;
+        }
+        memset(more, 0, BLOCK_SIZE);
+        node->single_indirect_offset = extent_block;
+    }
+    if (count + added > INODE_EXTENTS)
+        *more_dirty = 1;
+    for (int j = count - 1; j > i; j--)
+        *extent_get(node, more, j + added) = *extent_get(node, more, j);
+
+    int n = i;
+    if (before > 0){
+        extent_get(node, more, n)->start = e->start;
+        extent_get(node, more, n++)->length = before;
+    }
+    extent_get(node, more, n)->start = block;
+    extent_get(node, more, n++)->length = 1;
+    if (after > 0){
+        extent_get(node, more, n)->start = (start == 0) ? 0 : (start + before + 1) | flag;
+        extent_get(node, more, n)->length = after;
+    }
+    return 0;
+}
+
+// Extent helper function that frees every block of the file from file block first onwards
+// (and the extent block once no extents are left in it)
+int extent_truncate(struct inode * node, int first){
+    struct extent more[BLOCK_EXTENTS];
+    if (extent_load(node, more) < 0)
+        return -1;
+
+    int file_block = 0;
+    for (int i = 0; i < INODE_EXTENTS + BLOCK_EXTENTS; i++){
+        struct extent * e = extent_get(node, more, i);
+        if (e->length == 0)
+            break;
+
+        // Number of blocks at the front of this extent that stay in the file
+        int keep = first - file_block;
+        if (keep < 0)
+            keep = 0;
+        file_block += e->length;
+        if (keep >= e->length)
+            continue;
+
+        uint32_t start = e->start & ~BLOCK_UNWRITTEN;
+        for (uint32_t b = start + keep; start != 0 && b < start + e->length; b++)
+            free_block(b);
+        e->length = keep;
+        if (keep == 0)
+            e->start = 0;
+    }
+
+    // Release the extent block if it no longer holds any extents, otherwise save it
+    if (node->single_indirect_offset != 0){
+        if (more[0].length == 0){
+            free_meta_block(node->single_indirect_offset);
+            node->single_indirect_offset = 0;
+        }
+        else if (journal_write(node->single_indirect_offset, more) < 0){
+            printf("ERROR: Failed to update extent block\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Block map helper function that frees the blocks pointed to by indirection block *indir from
+// entry first onwards. The indirection block itself is freed (and *indir set to 0) when first is 0,
+// otherwise it's saved if anything changed
+int indir_truncate(uint32_t * indir, int first){
+    uint32_t ptrs[PTRS_PER_BLOCK];
+    if (indir_read(*indir, ptrs) < 0){
+        printf("ERROR: Failed to read indirection block from disk\n");
+        return -1;
+    }
+    int changed = 0;
+    for (int i = first; i < PTRS_PER_BLOCK; i++){
+        if (ptrs[i] == 0)
+            continue;
+        free_block(ptrs[i] & ~BLOCK_UNWRITTEN);
+        ptrs[i] = 0;
+        changed = 1;
+    }
+    if (first == 0){
+        free_meta_block(*indir);
+        *indir = 0;
+    }
+    else if (changed && journal_write(*indir, ptrs) < 0){
+        printf("ERROR: Failed to update indirection block\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Block map helper function that frees every block of a direct/indirect inode from file block
+// first onwards, and the indirection blocks left with nothing to point at. Unmapped (0) entries
+// are skipped
+int block_truncate(struct inode * node, int first){
+    for (int i = first; i < 10; i++){
+        if (node->direct_offset[i] != 0){
+            free_block(node->direct_offset[i] & ~BLOCK_UNWRITTEN);
+            node->direct_offset[i] = 0;
+        }
+    }
+
+    // Single indirection
+    first = (first > 10) ? first - 10 : 0;
+    if (node->single_indirect_offset != 0 && first < PTRS_PER_BLOCK){
+        if (indir_truncate(&node->single_indirect_offset, first) < 0)
+            return -1;
+    }
+
+    // Double indirection: the second-level blocks from the one holding first onwards
+    first = (first > PTRS_PER_BLOCK) ? first - PTRS_PER_BLOCK : 0;
+    if (node->double_indirect_offset != 0){
+        uint32_t double_block[PTRS_PER_BLOCK];
+        if (indir_read(node->double_indirect_offset, double_block) < 0){
+            printf("ERROR: Failed to read double indirection block from disk\n");
+            return -1;
+        }
+        int changed = 0;
+        for (int i = first / PTRS_PER_BLOCK; i < PTRS_PER_BLOCK; i++){
+            if (double_block[i] == 0)
+                continue;
+            int from = (i == first / PTRS_PER_BLOCK) ? first % PTRS_PER_BLOCK : 0;
+            if (indir_truncate(&double_block[i], from) < 0)
+                return -1;
+            changed |= (from == 0);
+        }
+        if (first == 0){
+            free_meta_block(node->double_indirect_offset);
+            node->double_indirect_offset = 0;
+        }
+        else if (changed && journal_write(node->double_indirect_offset, double_block) < 0){
+            printf("ERROR: Failed to update double indirection block\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Block map helper function that frees the blocks mapped at file block first onwards, whichever way
+// the inode maps them. An inline inode has no blocks, and its bytes are left to the caller
+int inode_truncate(struct inode * node, int first){
+    if (node->file_type == FILE_TYPE_INLINE)
+        return 0;
+    return (node->file_type == FILE_TYPE_EXTENT) ? extent_truncate(node, first) : block_truncate(node, first);
+}
+
+// Block map helper function that returns the disk block holding file block cur_block of an inode
+// (0 if not mapped, with BLOCK_UNWRITTEN set if it was never written, and always 0 for an inline
+// inode). Indirection and extent blocks are looked at in place in the block cache
+int bmap(struct inode * node, int cur_block){
+    const char * data;
+    int block = 0;
+
+    // Inline inode: no blocks
+    if (node->file_type == FILE_TYPE_INLINE)
+        return 0;
+
+    // Extent inode
+    if (node->file_type == FILE_TYPE_EXTENT){
+        if (node->single_indirect_offset == 0)
+            return extent_lookup(node, NULL, cur_block, NULL);
+        if ((data = indir_pin(node->single_indirect_offset)) == NULL)
+            return 0;
+        block = extent_lookup(node, (struct extent *) data, cur_block, NULL);
+        cache_unpin(data);
+        return block;
+    }
+
+    // Direct block
+    if (cur_block < 10)
+        return node->direct_offset[cur_block];
+
+    // Single indirection
+    cur_block -= 10;
+    if (cur_block < PTRS_PER_BLOCK){
+        if (node->single_indirect_offset == 0 || (data = indir_pin(node->single_indirect_offset)) == NULL)
+            return 0;
+        block = ((const uint32_t *) data)[cur_block];
+        cache_unpin(data);
+        return block;
+    }
+
+    // Double indirection
+    cur_block -= PTRS_PER_BLOCK;
+    if (cur_block < PTRS_PER_BLOCK * PTRS_PER_BLOCK){
+        if (node->double_indirect_offset == 0 || (data = indir_pin(node->double_indirect_offset)) == NULL)
+            return 0;
+        int single = ((const uint32_t *) data)[cur_block / PTRS_PER_BLOCK];
+        cache_unpin(data);
+        if (single == 0 || (data = indir_pin(single)) == NULL)
+            return 0;
+        block = ((const uint32_t *) data)[cur_block % PTRS_PER_BLOCK];
+        cache_unpin(data);
+    }
+    return block;
+}
+
+// Block map helper function that returns the first file block from b up to end that's mapped (if
+// data is set, unwritten blocks included) or a hole (if it isn't), or end if there's none. Missing
+// indirection blocks and whole extents are skipped at once
+int bmap_seek(struct inode * node, int b, int end, int data){
+    if (node->file_type == FILE_TYPE_INLINE)
+        return data ? (b < end ? b : end) : end;
+    if (node->file_type == FILE_TYPE_EXTENT){
+        struct extent more[BLOCK_EXTENTS];
+        if (extent_load(node, more) < 0)
+            return -1;
+        uint32_t file_block = 0;
+        for (int i = 0; i < INODE_EXTENTS + BLOCK_EXTENTS && b < end; i++){
+            struct extent * e = extent_get(node, more, i);
+            if (e->length == 0)
+                break;
+            file_block += e->length;
+            if (b < file_block){
+                if ((e->start != 0) == data)
+                    return b;
+                b = file_block;
+            }
+        }
+        // Everything past the last extent is a hole
+        return (data || b > end) ? end : b;
+    }
+
+    while (b < end){
+        int skip = 0;   // Blocks behind a missing indirection block
+        int block = 0;
+        if (b < 10)
+            block = node->direct_offset[b];
+        else if (b < 10 + PTRS_PER_BLOCK){
+            if (node->single_indirect_offset == 0)
+                skip = 10 + PTRS_PER_BLOCK - b;
+            else
+                block = bmap(node, b);
+        }
+        else if (node->double_indirect_offset == 0)
+            skip = end - b;
+        else{
+            int d = b - 10 - PTRS_PER_BLOCK;
+            const char * ptrs = indir_pin(node->double_indirect_offset);
+            if (ptrs == NULL)
+                return -1;
+            int single = ((const uint32_t *) ptrs)[d / PTRS_PER_BLOCK];
+            cache_unpin(ptrs);
+            if (single == 0)
+                skip = PTRS_PER_BLOCK - d % PTRS_PER_BLOCK;
+            else
+                block = bmap(node, b);
+        }
+
+        if (skip > 0){
+            if (!data)
+                return b;
+            b += skip;
+        }
+        else if ((block != 0) == data)
+            return b;
+        else
+            b++;
+    }
+    return end;
+}
+
+// Readahead helper that reads count blocks of file inum starting at file block first into the
+// cache, stopping at the end of the file (a deleted file has size 0, so nothing is read)
+void readahead_run(int inum, int first, int count){
+    pthread_rwlock_rdlock(&vol->inode_locks[inum]);
+    struct inode * node = &vol->curTable[inum];
+    int end = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (first + count > end)
+        count = end - first;
+
+    // Prefetch runs of file blocks that are next to each other on disk with one read each
+    int i = 0;
+    while (i < count){
+        int block = bmap(node, first + i);
+        if (block == 0 || (block & BLOCK_UNWRITTEN)){
+            i++;
+            continue;
+        }
+        int run = 1;
+        while (i + run < count && bmap(node, first + i + run) == block + run)
+            run++;
+        if (cache_prefetch(block, run) < 0)
+            break;
+        i += run;
+    }
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+}
+
+// Readahead helper called by fs_read (holding the descriptor lock) after reading nbyte bytes at
+// offset. A read starting where the last one ended grows the window (doubling up to
+// READAHEAD_BLOCKS) and queues the blocks after it once half a window has been used up; any other
+// read turns readahead off for the descriptor until reads are sequential again
+void readahead_update(int fd, int inum, off_t offset, int nbyte){
+    struct fd * f = &vol->fileDescriptors[fd];
+    int sequential = (offset == f->ra_next);
+    f->ra_next = offset + nbyte;
+    if (!sequential){
+        f->ra_window = 0;
+        return;
+    }
+
+    f->ra_window = f->ra_window ? f->ra_window * 2 : READAHEAD_MIN;
+    if (f->ra_window > READAHEAD_BLOCKS)
+        f->ra_window = READAHEAD_BLOCKS;
+
+    int next_block = (f->ra_next + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (f->ra_queued < next_block)
+        f->ra_queued = next_block;
+    int target = next_block + f->ra_window;
+    if (target - f->ra_queued < f->ra_window / 2)
+        return;
+
+    pthread_mutex_lock(&vol->ra_lock);
+    if (vol->ra_running && vol->ra_count < READAHEAD_QUEUE){
+        struct readahead * req = &vol->raQueue[(vol->ra_head + vol->ra_count) % READAHEAD_QUEUE];
+        req->inum = inum;
+        req->first = f->ra_queued;
+        req->count = target - f->ra_queued;
+        vol->ra_count++;
+        f->ra_queued = target;
+        pthread_cond_signal(&vol->ra_cond);
+    }
+    pthread_mutex_unlock(&vol->ra_lock);
 }
 
 // File system function that opens file and generates a file descriptor if file name valid
 int fs_open(const char *name){
+    OP_BEGIN(FS_OP_OPEN);
+    pthread_mutex_lock(&vol->dir_lock);
 
     // If the file doesn't exist, print error
     int inum = fs_exists(name);
     if (inum < 0){
+        pthread_mutex_unlock(&vol->dir_lock);
         printf("ERROR: File %s does not exist\n", name);
         return -1;
     }
+    if (inode_load(inum) < 0){
+        pthread_mutex_unlock(&vol->dir_lock);
+        return -1;
+    }
 
     // Check if number of file descriptors is at max
-    if (fd_count >= MAX_OPEN_FILES){
+    pthread_mutex_lock(&vol->fd_table_lock);
+    if (vol->fd_count >= MAX_OPEN_FILES){
+        pthread_mutex_unlock(&vol->fd_table_lock);
+        pthread_mutex_unlock(&vol->dir_lock);
         printf("ERROR: Unable to open file: Max Number of File Descriptors\n");
         return -1;
     }
@@ -438,35 +3411,49 @@ int fs_open(const char *name){
     // Get first free file descriptor (shouldn't reach error if above passed)
     int fd = fs_freefd();
     if (fd < 0){
+        pthread_mutex_unlock(&vol->fd_table_lock);
+        pthread_mutex_unlock(&vol->dir_lock);
         printf("ERROR: No open file descriptors");
         return -1;
     }
-    fileDescriptors[fd].file_offset = 0;
-    fileDescriptors[fd].open = 1;
-    fileDescriptors[fd].inode = inum;
-    fd_count++;
-
+    pthread_mutex_lock(&vol->fileDescriptors[fd].lock);
+    vol->fileDescriptors[fd].file_offset = 0;
+    vol->fileDescriptors[fd].open = 1;
+    vol->fileDescriptors[fd].inode = inum;
+    vol->fileDescriptors[fd].ra_next = 0;
+    vol->fileDescriptors[fd].ra_window = 0;
+    vol->fileDescriptors[fd].ra_queued = 0;
+    vol->fd_count++;
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+
+    pthread_mutex_unlock(&vol->fd_table_lock);
+    pthread_mutex_unlock(&vol->dir_lock);
     return fd;
 }
 
 // File system function that closes file descriptor
 int fs_close(int fd){
-    // Check that the fd is valid
-    if (validfd(fd) != 0){
+    OP_BEGIN(FS_OP_CLOSE);
+    // Check that the fd is valid (waits for any read or write in progress on it)
+    pthread_mutex_lock(&vol->fd_table_lock);
+    if (fd_lock(fd) != 0){
+        pthread_mutex_unlock(&vol->fd_table_lock);
         return -1;
     }
 
     // If fd valid, close it and set fd as unused
-    fileDescriptors[fd].file_offset = 0;
-    fileDescriptors[fd].open = 0;
-    fileDescriptors[fd].inode = 0;
-    fd_count--;
+    vol->fileDescriptors[fd].file_offset = 0;
+    vol->fileDescriptors[fd].open = 0;
+    vol->fileDescriptors[fd].inode = 0;
+    vol->fd_count--;
 
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+    pthread_mutex_unlock(&vol->fd_table_lock);
     return 0;
 }
 
-// File system function that creates a new empty file of given name
-int fs_create(const char *name){
+// File system helper function that does the work of fs_create while holding dir_lock
+int fs_create_locked(const char *name){
     // Check that name is valid
     if (strlen(name) < 0 || strlen(name) > 15){
         printf("ERROR: File name exceeds limit\n");
@@ -474,26 +3461,26 @@ int fs_create(const char *name){
     }
 
     // Check that file name doesn't already exist
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        if (strcmp(name, curDir[i].name) == 0){
-            printf("ERROR: File name already exists\n");
-            return -1;
-        }
+    if (de_find(name) >= 0){
+        printf("ERROR: File name already exists\n");
+        return -1;
     }
 
     // Check that directory is not full
-    if (file_count >= MAX_NUM_FILES){
+    if (vol->file_count >= vol->max_files){
         printf("ERROR: Root directory is full\n");
         return -1;
     }
     
     // Find first free inode number (shouldn't fail if passed above)
-    int inum = find1stFree(curFreeInodes, MAX_NUM_FILES);
+    int inum = find1stFree(vol->curFreeInodes, vol->max_files);
     
     if (inum < 0){
         printf("ERROR: No free inodes\n");
         return -1;
     }
+    if (inode_load(inum) < 0)
+        return -1;
 
     // Find first free directory entry (shouldn't fail if passed above)
     int dirEntry = de_free();
@@ -503,28 +3490,51 @@ int fs_create(const char *name){
     }
 
     // Initialize directory entry
-    curDir[dirEntry].inode_number = inum;
-    curDir[dirEntry].is_used = 1;
-    strcpy(curDir[dirEntry].name, name);
+    vol->curDir[dirEntry].inode_number = inum;
+    vol->curDir[dirEntry].is_used = 1;
+    strncpy(vol->curDir[dirEntry].name, name, sizeof(vol->curDir[dirEntry].name));
+    dir_index_add(dirEntry);
+    dir_mark(dirEntry);
+    vol->file_count++;
 
     // Set inode bitmap bit to used
-    setNbit(curFreeInodes, MAX_NUM_FILES, inum, 0);
-
-    // Initialize inode (most initialization will happen on first write)
-    curTable[inum].file_size = 0;
-    curTable[inum].file_type = 1;
+    setNbit(vol->curFreeInodes, vol->max_files, inum, 0);
+    meta_mark(vol->curSuper_block->free_inode_bitmap + inum / (8 * BLOCK_SIZE));
+
+    // Initialize inode: files start out inline and get blocks once they outgrow the inode. The
+    // readahead thread may still be finishing a request for the file that had the inode before
+    pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+    vol->curTable[inum].file_size = 0;
+    vol->curTable[inum].file_type = FILE_TYPE_INLINE;
+    memset(vol->curTable[inum].inline_data, 0, sizeof(vol->curTable[inum].inline_data));
+    inode_mark(inum);
+    vol->inodeSeq[inum] = vol->jseq;
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
 
     return 0;
 }
 
-// File system function that deletes file of given name if exists and is closed
-int fs_delete(const char *name){
+// File system function that creates a new empty file of given name
+int fs_create(const char *name){
+    OP_BEGIN(FS_OP_CREATE);
+    journal_begin();
+    pthread_mutex_lock(&vol->dir_lock);
+    int ret = fs_create_locked(name);
+    pthread_mutex_unlock(&vol->dir_lock);
+    journal_end();
+    return ret;
+}
+
+// File system helper function that does the work of fs_delete while holding dir_lock and fd_table_lock
+int fs_delete_locked(const char *name){
     // Check if file exists in directory entries
     int inum = fs_exists(name);
     if (inum < 0){
         printf("ERROR: File %s does not exist\n", name);
         return -1;
     }
+    if (inode_load(inum) < 0)
+        return -1;
 
     // Check if file is open
     if (fs_isopen(name)){
@@ -532,184 +3542,140 @@ int fs_delete(const char *name){
         return -1;
     }
 
-    // Delete file:
-
-    // 1. Close directory entry
-    curDir[de_find(name)].is_used = 0;
-    file_count--;
-
-    // 2. Set inode entry to free
-    setNbit(curFreeInodes, MAX_NUM_FILES, inum, 1);
-    
-    // 3. Free inode values (all indirect blocks)
-    int numblocks = (curTable[inum].file_size / BLOCK_SIZE);
-    if (curTable[inum].file_size % BLOCK_SIZE)
-        numblocks++;
-    uint16_t single_indir_block[BLOCK_SIZE / 2];
-    uint16_t double_indir_block[BLOCK_SIZE/2];
-    uint16_t current_double_block[BLOCK_SIZE/2];
-
-    int num_direct = 10;
-    if (numblocks < 10)
-        num_direct = numblocks;
-
-    // Free all direct offsets
-    for (int i = 0; i < num_direct; i++){
-        setNbit(curFreeData, DISK_BLOCKS, curTable[inum].direct_offset[i], 1);
-        curTable[inum].direct_offset[i] = 0;
-    }
-
-    // Free all indirect offsets (if there are any)
-    if (numblocks > 10){
-        if (block_read(curTable[inum].single_indirect_offset, single_indir_block) < 0){
-            printf("ERROR: Failed to read single indirection block from disk\n");
-            return -1;
-        }
-
-        int index = 0;
-        while ((index < BLOCK_SIZE/2) && (single_indir_block[index] != 0)){
-            setNbit(curFreeData, DISK_BLOCKS, single_indir_block[index], 1);
-            index++;
-        }
-        // Free the single indirection offset value
-        setNbit(curFreeData, DISK_BLOCKS, curTable[inum].single_indirect_offset, 1);
+    // Wait for positional and async reads/writes that looked the inode up before the file was
+    // closed, and for the readahead thread if it's reading the file. No new ones can start since
+    // the file isn't open and can't be opened while dir_lock is held. The inode lock is held until
+    // the inode is emptied, and readahead queued for the file is dropped, so nothing reads its
+    // blocks once they're freed
+    pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+    readahead_drop(inum);
+    if (vol->delayed != NULL){
+        __atomic_store_n(&vol->delayed[inum].len, 0, __ATOMIC_RELAXED);
+        free(vol->delayed[inum].data);
+        vol->delayed[inum].data = NULL;
+        vol->delayed[inum].size = 0;
     }
-    
-    // Free all double indirection offsets (if there are any)
-    if (numblocks > (10 + BLOCK_SIZE / 2)){
-        if (block_read(curTable[inum].double_indirect_offset, double_indir_block) < 0){
-            printf("ERROR: Failed to read single indirection block from disk\n");
-            return -1;
-        }
-        
-        int double_index = 0;
-        while ((double_index < BLOCK_SIZE/2) && (double_indir_block[double_index] != 0)){
-            if (block_read(double_indir_block[double_index], current_double_block) < 0){
-                printf("ERROR: Failed to read single indirection block from disk\n");
-                return -1;
-            }
-            int single_index = 0;
-            // Free each block in each value of the double indirection block (and the blocks that hold them)
-            while ((single_index < BLOCK_SIZE/2) && (current_double_block[single_index] != 0)){
-                setNbit(curFreeData, DISK_BLOCKS, current_double_block[single_index], 1);
-                single_index++;
-            }
-            
-            // Free the single indirection block that was just iterated through
-            setNbit(curFreeData, DISK_BLOCKS, double_indir_block[double_index], 1);
-            double_index++;
+    aio_wait_inode(inum);
 
-        }
+    // Delete file:
 
-        // Free the double indirection offset value
-        setNbit(curFreeData, DISK_BLOCKS, curTable[inum].double_indirect_offset, 1);
-    }
+    // 1. Close directory entry and drop it from the directory index
+    int dirEntry = de_find(name);
+    dir_index_remove(dirEntry);
+    vol->curDir[dirEntry].is_used = 0;
+    dir_mark(dirEntry);
+    vol->file_count--;
 
+    // 2. Set inode entry to free
+    setNbit(vol->curFreeInodes, vol->max_files, inum, 1);
+    meta_mark(vol->curSuper_block->free_inode_bitmap + inum / (8 * BLOCK_SIZE));
+    inode_mark(inum);
     
-    curTable[inum].file_size = 0;
-    curTable[inum].single_indirect_offset = 0;
-    curTable[inum].double_indirect_offset = 0;
-
+    // 3. Free inode values (all extents, or all direct and indirect blocks)
+    struct inode * node = &vol->curTable[inum];
+    int ret = inode_truncate(node, 0);
+    if (ret == 0)
+        node->file_size = 0;
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    return ret;
+}
 
-    return 0;
+// File system function that deletes file of given name if exists and is closed
+int fs_delete(const char *name){
+    OP_BEGIN(FS_OP_DELETE);
+    // With the directory and descriptor table locked, nobody can have the file open (so nobody
+    // can be reading or writing it) and nobody can open it until it's gone
+    journal_begin();
+    pthread_mutex_lock(&vol->dir_lock);
+    pthread_mutex_lock(&vol->fd_table_lock);
+    int ret = fs_delete_locked(name);
+    pthread_mutex_unlock(&vol->fd_table_lock);
+    pthread_mutex_unlock(&vol->dir_lock);
+    journal_end();
+    return ret;
 }
 
-// File system function that reads nbytes from file into buf
-int fs_read(int fd, void *buf, size_t nbyte){
-    // Check if file descriptor is valid
-    if (validfd(fd) != 0){
-        return -1;
-    }
-    
+// File system helper function that reads nbyte bytes at offset of inode inum into buf while
+// holding the inode lock (doesn't use or move any file descriptor offset). With an async request,
+// whole-block runs that aren't cached are read by the disk engine after this returns
+int fs_read_locked(int inum, void *buf, size_t nbyte, off_t offset, struct fs_aio *aio){
     // Initialize variables to be used when iterating through blocks
-    char block_buf[BLOCK_SIZE]; // Buffer that will read from blocks in disk
-    int cur_block = fileDescriptors[fd].file_offset / BLOCK_SIZE;       // Current block (starts based on offset)
-    int block_offset = fileDescriptors[fd].file_offset % BLOCK_SIZE;    // Byte offset (due to file offset)
+    int cur_block = offset / BLOCK_SIZE;       // Current block (starts based on offset)
+    int block_offset = offset % BLOCK_SIZE;    // Byte offset (due to file offset)
     int bytes_read = 0; // How many bytes have been read so far
-    struct inode * node = &curTable[fileDescriptors[fd].inode];    // inode
-    uint16_t single_indirect_block[BLOCK_SIZE/2];
-    int single_indirect_open = 0;
-    uint16_t double_indir_block[BLOCK_SIZE/2];
-    uint16_t current_double_block[BLOCK_SIZE/2];
-    int current_open_double = -1;
-    
+    struct inode * node = &vol->curTable[inum];    // inode
 
     // Calculate number of blocks that can be read (assuming all metadata is correct)
     int bytes_left;
-    int bytesRemaining = curTable[fileDescriptors[fd].inode].file_size - fileDescriptors[fd].file_offset;
-    int double_indir_open = 0;
+    int bytesRemaining = inode_size(inum) - offset;
 
+    // If at or past the end of file or file empty, set read to 0
+    if (bytesRemaining <= 0)
+        bytes_left = 0;
     // If there are enough bytes to read nbyte bytes, set read to nbytes
-    if (bytesRemaining >= nbyte)
+    else if (bytesRemaining >= nbyte)
         bytes_left = nbyte;
-    // If at end of file or file empty, set read to 0
-    else if (bytesRemaining <= 0)
-        bytes_left = 0;
     else
     // Otherwise, just set number able to read to the rest of the bytes left in the file
         bytes_left = bytesRemaining;
 
+    // Bytes past the end of the file on disk are still in the delayed allocation buffer
+    int buffered = 0;
+    if (offset + bytes_left > node->file_size){
+        buffered = (offset > node->file_size) ? bytes_left : offset + bytes_left - node->file_size;
+        bytes_left -= buffered;
+    }
+
+    // An inline file's bytes are in the inode itself
+    if (node->file_type == FILE_TYPE_INLINE && bytes_left > 0){
+        memcpy(buf, node->inline_data + offset, bytes_left);
+        bytes_read = bytes_left;
+        bytes_left = 0;
+    }
+
     // Loop through reading block by block until there are no more bytes left to read
     while (bytes_left > 0){
 
-        // Calculate the block number (mainly for indirection purposes)
-        int block;
-        int double_index = (cur_block - 10 - BLOCK_SIZE/2) / (BLOCK_SIZE / 2);
-        int double_offset = (cur_block - 10 - BLOCK_SIZE/2) % (BLOCK_SIZE / 2);
-        // Case 1: Direct block number, just use regular index
-        if (cur_block < 10)
-            block = node->direct_offset[cur_block];
-        // Case 2: Single indirection = read from
-        else if (cur_block >= 10 && cur_block < (BLOCK_SIZE / 2 + 10)){
-            // Check if single indirect block has been read from yet (don't want to open twice)
-            if (!single_indirect_open){
-                if (block_read(node->single_indirect_offset, single_indirect_block) < 0){
-                    printf("ERROR: Failed to read single indirect offset block\n");
-                    return bytes_read;
-                }
-                // printf("!read single indirect open\n");
-                single_indirect_open = 1;
-            }
-
-            // Read block number from the single indirect block
-            block = single_indirect_block[cur_block - 10];
+        // Find the disk block (direct, indirect, or extent) holding the current file block
+        int block = bmap(node, cur_block);
+
+        // A hole or an unwritten block (from fs_fallocate) reads as zeros
+        if (block == 0 || (block & BLOCK_UNWRITTEN)){
+            int read_size = BLOCK_SIZE - block_offset;
+            if (read_size > bytes_left)
+                read_size = bytes_left;
+            memset(buf + bytes_read, 0, read_size);
+            bytes_read += read_size;
+            bytes_left -= read_size;
+            block_offset = 0;
+            cur_block++;
+            continue;
         }
-        // Case 3: Double indirection, read from blocks assuming that double indirection exists if got here
-        else if (cur_block >= (BLOCK_SIZE / 2 + 10) && cur_block < (BLOCK_SIZE * BLOCK_SIZE / 4 + BLOCK_SIZE / 2 + 10)){
-            // Open double indirection block
-            if (!double_indir_open){
-                if (block_read(node->double_indirect_offset, double_indir_block) < 0){
-                    printf("ERROR: Failed to read double indirection block from disk\n");
-                    return bytes_read;
-                }
-                double_indir_open = 1;
-                // printf("!read double indirect open\n");
-            }
 
-            // Check if in the correct double indirection block
-            if (double_index != current_open_double){
-                // Set the double indirection block and index
-                if (block_read(double_indir_block[double_index], current_double_block) < 0){
-                    printf("ERROR: Failed to read single indirection block from disk\n");
-                }
-                current_open_double = double_index;
-                // printf("!read double single indirect open\n");
+        // Whole blocks: also take the following file blocks that sit right after this one on disk,
+        // and read all of them into the caller's buffer with a single disk read
+        if (block_offset == 0 && bytes_left >= BLOCK_SIZE){
+            int run = 1;
+            while (run < bytes_left / BLOCK_SIZE && bmap(node, cur_block + run) == block + run)
+                run++;
+
+            if (aio_read_range(aio, block, run, buf + bytes_read) != 0){
+                printf("ERROR: Unable to read from block\n");
+                return -1;
             }
-            block = current_double_block[double_offset];
-        }
-        else{
-            printf("ERROR: Idk how you got here\n");
-            return bytes_read;
+            bytes_read += run * BLOCK_SIZE;
+            bytes_left -= run * BLOCK_SIZE;
+            cur_block += run;
+            continue;
         }
 
-        // Index into block number and read block into block buffer (TO ADD: INDIRECTION)
-        if (block_read(block, block_buf) != 0){
+        // Partial block: copy the needed bytes out of the cached block
+        const char * data = cache_pin(block);
+        if (data == NULL){
             printf("ERROR: Unable to read from block\n");
             return -1;
         }
         
-        // printf("Cur block: %d Block: %d Offset: %d\n", cur_block, block, fileDescriptors[fd].file_offset);
-
         // Set the buffer size to be read from the file
         int read_size = 0;
         if (block_offset + bytes_left >= BLOCK_SIZE)    // If enough bytes left to read into next block
@@ -718,7 +3684,8 @@ int fs_read(int fd, void *buf, size_t nbyte){
             read_size = bytes_left;
         
         // Store bytes into the buf
-        memcpy(buf + bytes_read, block_buf + block_offset, read_size);
+        memcpy(buf + bytes_read, data + block_offset, read_size);
+        cache_unpin(data);
         
         // Prep for the next iteration of the loop (or for it to end)
         bytes_read += read_size;
@@ -727,418 +3694,1395 @@ int fs_read(int fd, void *buf, size_t nbyte){
             block_offset = 0;
         cur_block++;
     }
-    fileDescriptors[fd].file_offset += bytes_read;
+
+    if (buffered > 0){
+        memcpy(buf + bytes_read, vol->delayed[inum].data + (offset + bytes_read - node->file_size), buffered);
+        bytes_read += buffered;
+    }
     return bytes_read;
 }
 
-// File system function that writes nbytes of buf into file using file descriptor
-int fs_write(int fd, void *buf, size_t nbyte){
-    // Check if file descriptor is valid
-    if (validfd(fd) != 0){
+// File system function that reads nbytes from file into buf
+int fs_read(int fd, void *buf, size_t nbyte){
+    OP_BEGIN(FS_OP_READ);
+    if (fd_lock(fd) != 0)
         return -1;
+    int inum = vol->fileDescriptors[fd].inode;
+    pthread_rwlock_rdlock(&vol->inode_locks[inum]);
+    int ret = fs_read_locked(inum, buf, nbyte, vol->fileDescriptors[fd].file_offset, NULL);
+    if (ret > 0){
+        readahead_update(fd, inum, vol->fileDescriptors[fd].file_offset, ret);
+        vol->fileDescriptors[fd].file_offset += ret;
+    }
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+    return ret;
+}
+
+// Inline data helper that writes nbyte bytes of buf at offset of inline inode inum, which must end
+// within INODE_INLINE bytes. The bytes between the old end of the file and offset are already
+// zeros. Without buf (fs_fallocate), the file only grows. Called with the inode lock held
+int inline_write(int inum, const void *buf, size_t nbyte, off_t offset){
+    struct inode * node = &vol->curTable[inum];
+    int grows = (offset + nbyte > node->file_size);
+    if (buf != NULL)
+        memcpy(node->inline_data + offset, buf, nbyte);
+    if (grows)
+        node->file_size = offset + nbyte;
+    if (buf != NULL || grows){
+        inode_mark(inum);
+        vol->inodeSeq[inum] = vol->jseq;
+    }
+    return nbyte;
+}
+
+int inline_spill(int inum);     // Defined after fs_write_blocks, which it uses
+
+// File system helper function that writes nbyte bytes of buf at offset of inode inum to disk
+// blocks, allocating the ones that aren't mapped yet (past the end of the file or in a hole).
+// Called with the inode lock held (doesn't use or move any file descriptor offset). With an async request, whole-block runs are written by
+// the disk engine after this returns. Without buf (fs_fallocate), new blocks are only mapped, as
+// unwritten. An inline file keeps the write in its inode while it fits there
+int fs_write_blocks(int inum, const void *buf, size_t nbyte, off_t offset, struct fs_aio *aio){
+    struct inode * node = &vol->curTable[inum];
+    if (node->file_type == FILE_TYPE_INLINE){
+        if (offset + nbyte <= INODE_INLINE)
+            return inline_write(inum, buf, nbyte, offset);
+        if (inline_spill(inum) < 0)
+            return 0;
     }
 
     // Initialize variables to know where to start writing
-    int cur_block = fileDescriptors[fd].file_offset / BLOCK_SIZE;       // Current block (starts based on offset)
-    int block_offset = fileDescriptors[fd].file_offset % BLOCK_SIZE;    // Byte offset (due to file offset)
-    struct inode * node = &curTable[fileDescriptors[fd].inode];
-    uint16_t single_indirect_block[BLOCK_SIZE / 2];
+    int cur_block = offset / BLOCK_SIZE;       // Current block (starts based on offset)
+    int block_offset = offset % BLOCK_SIZE;    // Byte offset (due to file offset)
+    struct inode before = *node;    // To tell whether the inode needs saving
+    uint32_t fresh = (buf == NULL) ? BLOCK_UNWRITTEN : 0;  // Flag for the new blocks
+    uint32_t single_indirect_block[PTRS_PER_BLOCK];
     int bytes_written = 0;
     int bytes_left = nbyte;
     int single_indir_open = 0;
+    int single_indir_dirty = 0;
 
-    //Variables for double indirection
+    //Variables for double indirection. Indirection blocks are changed in memory and each one is
+    // written once (when moving on to the next second-level block, or at the end of the write)
     int double_indir_open = 0;
-    uint16_t double_indir_block[BLOCK_SIZE/2];
-    uint16_t current_double_block[BLOCK_SIZE/2];
+    int double_indir_dirty = 0;
+    uint32_t double_indir_block[PTRS_PER_BLOCK];
+    uint32_t current_double_block[PTRS_PER_BLOCK];
     int current_open_double = -1;
+    int current_double_dirty = 0;
+
+    // Variables for extent inodes
+    struct extent more_extents[BLOCK_EXTENTS];
+    int extents_open = 0;
+    int extents_dirty = 0;
+    int extents_end = 0;    // File blocks covered by the extents
+
+    // Run of whole blocks waiting to be written (disk blocks run_start onwards, from buf + run_data).
+    // A run is either all new blocks or all blocks that held data already (run_new), so a run that
+    // fails to write is known to have left new blocks holding whatever the disk had there
+    int run_start = 0;
+    int run_len = 0;
+    int run_data = 0;
+    int run_new = 0;
+    int run_failed = 0;
+    off_t start = offset;
 
     // Calculate the number of blocks that will be written to (accounting for nonzero offsets)
     int num_block_write = (nbyte + block_offset) / BLOCK_SIZE;
     if ((nbyte + block_offset) % BLOCK_SIZE) num_block_write++;
 
+    // The data blocks past the end of the file are taken up front as one contiguous run (when the
+    // disk has one), so other files allocating at the same time can't end up interleaved with them.
+    // Blocks filling a hole are allocated one at a time
+    struct reserve res = { 0, 0 };
+    int first_new = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (first_new < cur_block)
+        first_new = cur_block;
+    int append_blocks = cur_block + num_block_write - first_new;
+    if (append_blocks > 1)
+        reserve_take(&res, append_blocks);
+
     // Iterate through all blocks need to write
     for(int i = 0; i < num_block_write; i++){
 
-        // If writing current block requires a new block, grab first free block to be used
+        // A block that isn't mapped yet (0) is allocated, and zero filled around the data
         uint8_t new_block = 0;
         int block;
-        int double_index = (cur_block - 10 - BLOCK_SIZE/2) / (BLOCK_SIZE / 2);
-        int double_offset = (cur_block - 10 - BLOCK_SIZE/2) % (BLOCK_SIZE / 2);
-
-        if (node->file_size == 0 || (node->file_size <= (BLOCK_SIZE * (cur_block)))){
-            new_block = 1;
+        int double_index = (cur_block - 10 - PTRS_PER_BLOCK) / PTRS_PER_BLOCK;
+        int double_offset = (cur_block - 10 - PTRS_PER_BLOCK) % PTRS_PER_BLOCK;
+
+        // Set which block writing to (check if extent, direct, single indirect, or double indirect)
+        // Case 0: Extent inode, new blocks past the last extent grow it when the next disk block is
+        // free (after a hole extent for any gap), and blocks in a hole split it
+        if (node->file_type == FILE_TYPE_EXTENT){
+            if (!extents_open){
+                if (extent_load(node, more_extents) < 0)
+                    break;
+                extents_open = 1;
+                for (int e = 0; e < INODE_EXTENTS + BLOCK_EXTENTS && extent_get(node, more_extents, e)->length != 0; e++)
+                    extents_end += extent_get(node, more_extents, e)->length;
+            }
+            if (cur_block >= extents_end){
+                if (cur_block > extents_end && extent_hole(node, more_extents, &extents_dirty, cur_block - extents_end) < 0)
+                    break;
+                extents_end = cur_block;
+                block = extent_append(node, more_extents, &extents_dirty, &res, fresh);
+                if (block < 0)
+                    break;
+                extents_end++;
+                new_block = 1;
+            }
+            else{
+                block = extent_lookup(node, more_extents, cur_block, NULL);
+                if (block == 0){
+                    block = alloc_data(&res);
+                    if (block < 0){
+                        printf("ERROR: Disk is full\n");
+                        break;
+                    }
+                    if (extent_set(node, more_extents, cur_block, block | fresh, &extents_dirty) < 0){
+                        free_block(block);
+                        break;
+                    }
+                    new_block = 1;
+                }
+                // Writing an unwritten block: it's zero filled around the data and marked written
+                else if ((block & BLOCK_UNWRITTEN) && buf != NULL){
+                    block &= ~BLOCK_UNWRITTEN;
+                    if (extent_set(node, more_extents, cur_block, block, &extents_dirty) < 0)
+                        break;
+                    new_block = 1;
+                }
+            }
         }
-        // If writing to a block that already exists, simply set block number to current block
-
-        // Set which block writing to (check if direct, single indirect, or double indirect)
         // Case 1: Direct, if new block allocate but otherwise just set to next one in direct
-        if (cur_block < 10){
-            if (new_block){
-                block = find1stFree(curFreeData, DISK_BLOCKS);
+        else if (cur_block < 10){
+            if (node->direct_offset[cur_block] == 0){
+                block = alloc_data(&res);
                 // If full, return bytes_written (number of bytes currently written to disk)
                 if (block < 0){
                     printf("ERROR: Disk is full\n");
-                    return bytes_written;
+                    break;
                 }
-                node->direct_offset[cur_block] = block;
-                setNbit(curFreeData, DISK_BLOCKS, block, 0);
+                node->direct_offset[cur_block] = block | fresh;
+                new_block = 1;
             }
-            else
+            else{
                 block = node->direct_offset[cur_block];
+                if ((block & BLOCK_UNWRITTEN) && buf != NULL){
+                    block &= ~BLOCK_UNWRITTEN;
+                    node->direct_offset[cur_block] = block;
+                    new_block = 1;
+                }
+            }
         }
         // Case 2: Single indirect, check if need to create indirect block
-        else if (cur_block >= 10 && cur_block < (BLOCK_SIZE / 2 + 10)){
+        else if (cur_block >= 10 && cur_block < (PTRS_PER_BLOCK + 10)){
 
-            // Create indirect block if not already set and update metadata
+            // Create indirect block if not already set and update metadata (it starts out all
+            // zeros in memory and is written at the end)
             if (node->single_indirect_offset == 0){
-                int indir_block = find1stFree(curFreeData, DISK_BLOCKS);
+                int indir_block = alloc_block();
                 if (indir_block < 0){
                     printf("ERROR: Disk is full\n");
-                    return bytes_written;
+                    break;
                 }
-                char write_buf[BLOCK_SIZE];
-                memset(write_buf, 0, BLOCK_SIZE);
-                if (block_write(indir_block, write_buf) < 0){
-                    printf("ERROR: Failed to initialize single indirection block\n");
-                    return bytes_written;
-                }
-                setNbit(curFreeData, DISK_BLOCKS, indir_block, 0);
+                memset(single_indirect_block, 0, sizeof(single_indirect_block));
+                single_indir_open = 1;
+                single_indir_dirty = 1;
                 node->single_indirect_offset = indir_block;
             }
             
             // Check if single indirect block has been read from yet (don't want to open twice)
             if (!single_indir_open){
-                if (block_read(node->single_indirect_offset, single_indirect_block) < 0){
+                if (indir_read(node->single_indirect_offset, single_indirect_block) < 0){
                     printf("ERROR: Failed to read single indirect offset block\n");
-                    return bytes_written;
+                    break;
                 }
                 // printf("!write single indirect open\n");
                 single_indir_open = 1;
             }
 
-            // Repeat code but done so that will only find 1st free block if had space to create indirect
-            if (new_block){
-                block = find1stFree(curFreeData, DISK_BLOCKS);
-                // If full, return bytes_written (number of bytes currently written to disk)
-                if (block < 0){
-                    printf("ERROR: Disk is full\n");
-                    return bytes_written;
-                }
-                single_indirect_block[cur_block - 10] = block;
-                setNbit(curFreeData, DISK_BLOCKS, block, 0);
-            }
-            else
-                block = single_indirect_block[cur_block - 10];
-        }
-        // Case 3: Double indirection, have to read in double indirection block and individual indirection blocks
-        else if (cur_block >= (BLOCK_SIZE / 2 + 10) && cur_block < (BLOCK_SIZE * BLOCK_SIZE / 4 + BLOCK_SIZE / 2 + 10)){
+            // Repeat code but done so that will only find 1st free block if had space to create indirect
+            if (single_indirect_block[cur_block - 10] == 0){
+                block = alloc_data(&res);
+                // If full, return bytes_written (number of bytes currently written to disk)
+                if (block < 0){
+                    printf("ERROR: Disk is full\n");
+                    break;
+                }
+                single_indirect_block[cur_block - 10] = block | fresh;
+                single_indir_dirty = 1;
+                new_block = 1;
+            }
+            else{
+                block = single_indirect_block[cur_block - 10];
+                if ((block & BLOCK_UNWRITTEN) && buf != NULL){
+                    block &= ~BLOCK_UNWRITTEN;
+                    single_indirect_block[cur_block - 10] = block;
+                    single_indir_dirty = 1;
+                    new_block = 1;
+                }
+            }
+        }
+        // Case 3: Double indirection, have to read in double indirection block and individual indirection blocks
+        else if (cur_block >= (PTRS_PER_BLOCK + 10) && cur_block < (PTRS_PER_BLOCK * PTRS_PER_BLOCK + PTRS_PER_BLOCK + 10)){
+
+            // Create double indirection block (all zeros in memory, written at the end)
+            if (node->double_indirect_offset == 0){
+                int free_double = alloc_block();
+                if (free_double < 0){
+                    printf("ERROR: Not enough disk space to allocate double block\n");
+                    break;
+                }
+                memset(double_indir_block, 0, sizeof(double_indir_block));
+                double_indir_open = 1;
+                double_indir_dirty = 1;
+                node->double_indirect_offset = free_double;
+                // printf("Find first free double indirect: %d\n", free_double);
+            }
+
+            // Open double indirection block
+            if (!double_indir_open){
+                if (indir_read(node->double_indirect_offset, double_indir_block) < 0){
+                    printf("ERROR: Failed to read double indirection block from disk\n");
+                    break;
+                }
+                double_indir_open = 1;
+                // printf("!write double indirect open\n");
+            }
+
+            // Check if in the correct double indirection block
+            if (double_index != current_open_double || (current_open_double == -1)){
+                // Save the second-level block being left behind (once, however many entries changed)
+                if (current_double_dirty){
+                    if (journal_write(double_indir_block[current_open_double], current_double_block) < 0){
+                        printf("ERROR: Failed to save double single indirection block to disk\n");
+                        break;
+                    }
+                    current_double_dirty = 0;
+                }
+
+                // If single indir block in double indirection block isn't made, initialize it
+                // to all zeros in memory
+                if (double_indir_block[double_index] == 0){
+                    int free_single = alloc_block();
+                    if (free_single < 0){
+                        printf("ERROR: Not enough disk space to write indirection block\n");
+                        break;
+                    }
+                    memset(current_double_block, 0, sizeof(current_double_block));
+                    current_double_dirty = 1;
+                    double_indir_block[double_index] = free_single;
+                    double_indir_dirty = 1;
+                    // printf("Find first free single indirect: %d\n", free_single);
+                }
+                // Set the double indirection block and index
+                else if (indir_read(double_indir_block[double_index], current_double_block) < 0){
+                    printf("ERROR: Failed to read single indirection block from disk\n");
+                    break;
+                }
+                current_open_double = double_index;
+            }
+
+            // Now have the single indirection block, so find block number
+            if (current_double_block[double_offset] == 0){
+                block = alloc_data(&res);
+                // If full, return bytes_written (number of bytes currently written to disk)
+                if (block < 0){
+                    printf("ERROR: Disk is full\n");
+                    break;
+                }
+                current_double_block[double_offset] = block | fresh;
+                current_double_dirty = 1;
+                new_block = 1;
+                // printf("Find first free double indirect: %d\n", block);
+            }
+            else{
+                block = current_double_block[double_offset];
+                if ((block & BLOCK_UNWRITTEN) && buf != NULL){
+                    block &= ~BLOCK_UNWRITTEN;
+                    current_double_block[double_offset] = block;
+                    current_double_dirty = 1;
+                    new_block = 1;
+                }
+            }
+        }
+        else {
+            printf("ERROR: Reached maximum file size\n");
+            break;
+        }
+
+        // printf("Cur block: %d Block: %d Offset: %d\n", cur_block, block, offset);
+        // Calculate the number of blocks to be written on this write
+        int this_write = 0;
+        if (bytes_left + block_offset >= BLOCK_SIZE)
+            this_write = BLOCK_SIZE - block_offset;
+        else
+            this_write = bytes_left;
+
+        // Whole blocks aren't written yet: consecutive ones are collected into a run that goes
+        // to disk in one write (straight from the caller's buffer) once the run is broken
+        if (buf == NULL){
+            // fs_fallocate: the block is only mapped
+        }
+        else if (this_write == BLOCK_SIZE){
+            if (run_len > 0 && (block != run_start + run_len || new_block != run_new)){
+                if (aio_write_range(aio, run_start, run_len, buf + run_data) != 0){
+                    run_failed = 1;
+                    break;
+                }
+                run_len = 0;
+            }
+            if (run_len == 0){
+                run_start = block;
+                run_data = bytes_written;
+                run_new = new_block;
+            }
+            run_len++;
+        }
+        // Write to the block number provided
+        // If new block, set unused bytes to 0. Otherwise, copy current block to write over
+        else{
+            char block_buf[BLOCK_SIZE]; // Buffer that will read from blocks in disk
+            if (new_block)
+                memset(block_buf, 0, sizeof(block_buf));
+            else{
+                if (cache_read(block, block_buf) != 0){
+                    printf("ERROR: Unable to read from file data\n");
+                    break;
+                }
+            }
+
+            // Write to location block_buf + offset this_write bytes
+            memcpy(block_buf + block_offset, buf + bytes_written, this_write);
+            if (cache_write(block, block_buf) != 0){
+                printf("ERROR: Failed to write file data to disk\n");
+                break;
+            }
+        }
+
+        // Prepare for next write
+        if (block_offset) block_offset = 0;
+        bytes_written += this_write;
+        bytes_left -= this_write;
+        
+        // Only grow the file when writing past its end (overwrites keep the size)
+        offset += this_write;
+        if (offset > node->file_size)
+            node->file_size = offset;
+        cur_block++;
+    }
+
+    // Write out the whole blocks still waiting to go to disk as one run
+    if (!run_failed && run_len > 0 && aio_write_range(aio, run_start, run_len, buf + run_data) < 0)
+        run_failed = 1;
+
+    // A run that didn't reach the disk: the file only keeps the bytes before it, and new blocks
+    // of the run that stay inside the file (filling a hole) read as zeros rather than old data.
+    // Blocks mapped past the new end are freed below, once the indirection blocks are saved
+    int trim = 0;
+    if (run_failed){
+        printf("ERROR: Failed to write file data to disk\n");
+        bytes_written = run_data;
+        off_t keep = (start + run_data > before.file_size) ? start + run_data : before.file_size;
+        if (node->file_size > keep){
+            node->file_size = keep;
+            trim = 1;
+        }
+        if (run_new){
+            char zeros[BLOCK_SIZE];
+            memset(zeros, 0, sizeof(zeros));
+            int first = (start + run_data) / BLOCK_SIZE;
+            for (int b = 0; b < run_len && (off_t) (first + b) * BLOCK_SIZE < keep; b++)
+                cache_write(run_start + b, zeros);
+        }
+    }
+    reserve_release(&res);
+
+    if (memcmp(&before, node, sizeof(before)) != 0)
+        inode_mark(inum);
+    if (bytes_written > 0)
+        vol->inodeSeq[inum] = vol->jseq;
+
+    // Update the indirection blocks (or the extent block), also when stopping early on an error
+    if (extents_dirty){
+        if (journal_write(node->single_indirect_offset, more_extents) < 0){
+            printf("ERROR: Failed to update extent block\n");
+            return bytes_written;
+        }
+    }
+    if (single_indir_dirty){
+        if (journal_write(node->single_indirect_offset, single_indirect_block) < 0){
+            printf("ERROR: Failed to update single indirection block\n");
+            return bytes_written;
+        }
+    }
+    if (current_double_dirty){
+        if (journal_write(double_indir_block[current_open_double], current_double_block) < 0){
+            printf("ERROR: Failed to update double indirection block\n");
+            return bytes_written;
+        }
+    }
+    if (double_indir_dirty){
+        if (journal_write(node->double_indirect_offset, double_indir_block) < 0){
+            printf("ERROR: Failed to update double indirection block\n");
+            return bytes_written;
+        }
+    }
+
+    // Cut the file back to where the failed run started, as fs_truncate would
+    if (trim){
+        off_t keep = node->file_size;
+        int block = (keep % BLOCK_SIZE) ? bmap(node, keep / BLOCK_SIZE) : 0;
+        if (block != 0 && !(block & BLOCK_UNWRITTEN)){
+            char block_buf[BLOCK_SIZE];
+            if (cache_read(block, block_buf) == 0){
+                memset(block_buf + keep % BLOCK_SIZE, 0, BLOCK_SIZE - keep % BLOCK_SIZE);
+                cache_write(block, block_buf);
+            }
+        }
+        inode_truncate(node, (keep + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        inode_mark(inum);
+    }
+
+    return bytes_written;
+}
+
+// Inline data helper that moves the bytes of inline inode inum to a data block, turning it into a
+// file mapped the way the disk was made (extents or direct/indirect blocks). Called with the inode
+// lock held, when a write or fs_truncate takes the file past INODE_INLINE bytes. On failure (disk
+// full) the file stays inline
+int inline_spill(int inum){
+    struct inode * node = &vol->curTable[inum];
+    char data[INODE_INLINE];
+    int size = node->file_size;
+    memcpy(data, node->inline_data, size);
+    memset(node->inline_data, 0, sizeof(node->inline_data));
+    node->file_type = (vol->curSuper_block->flags & FS_FORMAT_EXTENTS) ? FILE_TYPE_EXTENT : FILE_TYPE_REGULAR;
+    node->file_size = 0;
+    inode_mark(inum);
+    if (size > 0 && fs_write_blocks(inum, data, size, 0, NULL) != size){
+        inode_truncate(node, 0);
+        node->file_type = FILE_TYPE_INLINE;
+        memset(node->inline_data, 0, sizeof(node->inline_data));
+        memcpy(node->inline_data, data, size);
+        node->file_size = size;
+        printf("ERROR: Unable to move inline data of inode %d to a block\n", inum);
+        return -1;
+    }
+    return 0;
+}
+
+// Inline data helper that cuts inode inum, mapped by blocks, to length bytes (at most
+// INODE_INLINE) and moves them into the inode, freeing all of its blocks. Called with the inode
+// lock held by fs_truncate, with nothing buffered for delayed allocation
+int inline_pack(int inum, int length){
+    struct inode * node = &vol->curTable[inum];
+    char data[INODE_INLINE];
+    if (fs_read_locked(inum, data, length, 0, NULL) != length){
+        printf("ERROR: Unable to read data of inode %d\n", inum);
+        return -1;
+    }
+    if (inode_truncate(node, 0) < 0)
+        return -1;
+    node->file_type = FILE_TYPE_INLINE;
+    memset(node->inline_data, 0, sizeof(node->inline_data));
+    memcpy(node->inline_data, data, length);
+    node->file_size = length;
+    return 0;
+}
+
+// Delayed allocation helper that writes the bytes buffered for file inum to disk, allocating all
+// of their blocks at once. Called with the inode lock held for writing, inside journal_begin and
+// journal_end. What couldn't be written (disk full) stays buffered
+int delalloc_flush(int inum){
+    struct delalloc * d = &vol->delayed[inum];
+    if (d->len == 0)
+        return 0;
+    int written = fs_write_blocks(inum, d->data, d->len, vol->curTable[inum].file_size, NULL);
+    if (written < d->len){
+        if (written > 0){
+            memmove(d->data, d->data + written, d->len - written);
+            __atomic_store_n(&d->len, d->len - written, __ATOMIC_RELAXED);
+        }
+        printf("ERROR: Failed to write buffered data of inode %d\n", inum);
+        return -1;
+    }
+    __atomic_store_n(&d->len, 0, __ATOMIC_RELAXED);
+    free(d->data);
+    d->data = NULL;
+    d->size = 0;
+    return 0;
+}
+
+// Delayed allocation helper that flushes the buffered bytes of every file (for fs_sync and umount_fs),
+// going over them once more if blocks waiting for a commit could be released (journal_reclaim)
+int delalloc_flush_all(){
+    int ret, tries = 0;
+    do {
+        alloc_failed = 0;
+        ret = 0;
+        journal_begin();
+        for (int i = 0; i < vol->max_files; i++){
+            if (__atomic_load_n(&vol->delayed[i].len, __ATOMIC_RELAXED) == 0)
+                continue;
+            pthread_rwlock_wrlock(&vol->inode_locks[i]);
+            if (delalloc_flush(i) < 0)
+                ret = -1;
+            pthread_rwlock_unlock(&vol->inode_locks[i]);
+        }
+        journal_end();
+    } while (ret < 0 && tries++ == 0 && journal_reclaim());
+    return ret;
+}
+
+// File system helper function that writes nbyte bytes of buf at offset of inode inum while
+// holding the inode lock (doesn't use or move any file descriptor offset). With delayed
+// allocation, bytes past the end of the file on disk are only copied to the inode's buffer
+int fs_write_locked(int inum, const void *buf, size_t nbyte, off_t offset, struct fs_aio *aio){
+    struct inode * node = &vol->curTable[inum];
+    if (vol->delayed == NULL || offset + nbyte <= node->file_size)
+        return fs_write_blocks(inum, buf, nbyte, offset, aio);
+
+    // Nothing to gain from buffering bytes that stay in the inode
+    struct delalloc * d = &vol->delayed[inum];
+    if (node->file_type == FILE_TYPE_INLINE && d->len == 0 && offset + nbyte <= INODE_INLINE)
+        return inline_write(inum, buf, nbyte, offset);
+
+    // Async writes, writes too big to be worth buffering and writes leaving a hole (which would
+    // otherwise be buffered as zeros) go straight to disk, after whatever is buffered before them
+    if (aio != NULL || offset > inode_size(inum) || offset + nbyte - node->file_size > DELALLOC_BLOCKS * BLOCK_SIZE){
+        if (delalloc_flush(inum) < 0)
+            return -1;
+        return fs_write_blocks(inum, buf, nbyte, offset, aio);
+    }
+
+    // The part of the write inside the file on disk is written as usual
+    int written = 0;
+    if (offset < node->file_size){
+        written = fs_write_blocks(inum, buf, node->file_size - offset, offset, NULL);
+        if (written < node->file_size - offset)
+            return written;
+        offset += written;
+    }
+
+    // Copy the rest to the buffer (which starts at the end of the file on disk), growing it as needed
+    int start = offset - node->file_size;
+    int end = start + (nbyte - written);
+    if (end > d->size){
+        int size = d->size ? d->size : 16 * BLOCK_SIZE;
+        while (size < end)
+            size *= 2;
+        char * grown = (char *) realloc(d->data, size);
+        if (grown == NULL){
+            printf("ERROR: Failed to allocate delayed allocation buffer\n");
+            return written;
+        }
+        d->data = grown;
+        d->size = size;
+    }
+    memcpy(d->data + start, buf + written, nbyte - written);
+    if (end > d->len)
+        __atomic_store_n(&d->len, end, __ATOMIC_RELAXED);
+
+    // A full buffer is written out now. Its bytes were already taken, so a failure (disk full)
+    // only shows at the next flush
+    if (d->len >= DELALLOC_BLOCKS * BLOCK_SIZE)
+        delalloc_flush(inum);
+    return nbyte;
+}
+
+// File system helper that writes like fs_write_locked (called with journal_begin and the inode
+// lock held, and without a request). If the disk fills up while blocks freed since the last
+// commit are waiting for it, both locks are dropped while journal_reclaim releases those blocks,
+// and the rest of the write is tried again once (everything that was waiting is free by then)
+int fs_write_retry(int inum, const void *buf, size_t nbyte, off_t offset){
+    alloc_failed = 0;
+    int total = fs_write_locked(inum, buf, nbyte, offset, NULL);
+    if (alloc_failed && vol->journaling && (total < 0 || (size_t) total < nbyte)){
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        journal_end();
+        int again = journal_reclaim();
+        journal_begin();
+        pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+        int done = (total > 0) ? total : 0;
+        int ret = again ? fs_write_locked(inum, (const char *) buf + done, nbyte - done, offset + done, NULL) : -1;
+        if (ret > 0)
+            total = done + ret;
+    }
+    return total;
+}
+
+// File system function that writes nbytes of buf into file using file descriptor. If the disk
+// fills up while blocks freed since the last commit are waiting for it, every lock is dropped
+// while journal_reclaim releases them, and the rest is written (once) as if by another call
+int fs_write(int fd, void *buf, size_t nbyte){
+    OP_BEGIN(FS_OP_WRITE);
+    int total = 0, tries = 0, ret;
+    do {
+        journal_begin();
+        if (fd_lock(fd) != 0){
+            journal_end();
+            return total > 0 ? total : -1;
+        }
+        int inum = vol->fileDescriptors[fd].inode;
+        pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+        alloc_failed = 0;
+        ret = fs_write_locked(inum, (char *) buf + total, nbyte - total, vol->fileDescriptors[fd].file_offset, NULL);
+        if (ret > 0){
+            vol->fileDescriptors[fd].file_offset += ret;
+            total += ret;
+        }
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+        journal_end();
+    } while ((size_t) total < nbyte && tries++ == 0 && journal_reclaim());
+    return total > 0 ? total : ret;
+}
+
+// Helper function that takes the lock of the inode behind an open file descriptor (for reading, or
+// for writing if write is set) and returns its inode number. The descriptor lock is only held
+// while looking it up, so positional I/O on a shared descriptor runs in parallel
+int fd_inode_lock(int fd, int write){
+    if (fd_lock(fd) != 0)
+        return -1;
+    int inum = vol->fileDescriptors[fd].inode;
+    if (write)
+        pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+    else
+        pthread_rwlock_rdlock(&vol->inode_locks[inum]);
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+    return inum;
+}
+
+// File system function that reads nbyte bytes at offset into buf (the descriptor offset doesn't move)
+int fs_pread(int fd, void *buf, size_t nbyte, off_t offset){
+    OP_BEGIN(FS_OP_PREAD);
+    if (offset < 0){
+        printf("ERROR: offset out of range\n");
+        return -1;
+    }
+
+    int inum = fd_inode_lock(fd, 0);
+    if (inum < 0)
+        return -1;
+    int ret = fs_read_locked(inum, buf, nbyte, offset, NULL);
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    return ret;
+}
+
+// File system function that writes nbyte bytes of buf at offset (the descriptor offset doesn't move)
+int fs_pwrite(int fd, const void *buf, size_t nbyte, off_t offset){
+    OP_BEGIN(FS_OP_PWRITE);
+    journal_begin();
+    int inum = fd_inode_lock(fd, 1);
+    if (inum < 0){
+        journal_end();
+        return -1;
+    }
+
+    // Writes can start anywhere, past the end of the file leaving a hole
+    if (offset < 0 || offset > UINT32_MAX){
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        journal_end();
+        printf("ERROR: offset out of range\n");
+        return -1;
+    }
+
+    int ret = fs_write_retry(inum, buf, nbyte, offset);
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    journal_end();
+    return ret;
+}
 
-            // Create double indirection block
-            if (node->double_indirect_offset == 0){
-                int free_double = find1stFree(curFreeData, DISK_BLOCKS);
-                if (free_double < 0){
-                    printf("ERROR: Not enough disk space to allocate double block\n");
-                    return bytes_written;
-                }
-                char zeros[BLOCK_SIZE];
-                memset(zeros, 0, BLOCK_SIZE);
-                if (block_write(free_double, zeros) < 0){
-                    printf("ERROR: Failed to write double indirection to disk\n");
-                    return bytes_written;
-                }
-                setNbit(curFreeData, DISK_BLOCKS, free_double, 0);
-                node->double_indirect_offset = free_double;
-                // printf("Find first free double indirect: %d\n", free_double);
-            }
+// File system function that reads into each buffer of iov in turn, starting at offset. Stops at
+// the end of the file and returns the total number of bytes read
+int fs_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset){
+    OP_BEGIN(FS_OP_PREADV);
+    if (offset < 0 || iovcnt < 0){
+        printf("ERROR: offset out of range\n");
+        return -1;
+    }
 
-            // Open double indirection block
-            if (!double_indir_open){
-                if (block_read(node->double_indirect_offset, double_indir_block) < 0){
-                    printf("ERROR: Failed to read double indirection block from disk\n");
-                    return bytes_written;
-                }
-                double_indir_open = 1;
-                // printf("!write double indirect open\n");
-            }
+    int inum = fd_inode_lock(fd, 0);
+    if (inum < 0)
+        return -1;
 
-            // Check if in the correct double indirection block
-            if (double_index != current_open_double || (current_open_double == -1)){
-                // If single indir block in double indirection block isn't made, initialize it
-                if (double_indir_block[double_index] == 0){
-                    int free_single = find1stFree(curFreeData, DISK_BLOCKS);
-                    if (free_single < 0){
-                        printf("ERROR: Not enough disk space to write indirection block\n");
-                        return bytes_written;
-                    }
-                    // Initialize to all zeros
-                    char zeros[BLOCK_SIZE];
-                    memset(zeros, 0, BLOCK_SIZE);
-                    if (block_write(free_single, zeros) < 0){
-                        printf("ERROR: Failed to write double indirection to disk\n");
-                        return bytes_written;
-                    }
-                    
-                    setNbit(curFreeData, DISK_BLOCKS, free_single, 0);
-                    double_indir_block[double_index] = free_single;
-                    // printf("Find first free single indirect: %d\n", free_single);
-                }
-                // Set the double indirection block and index
-                if (block_read(double_indir_block[double_index], current_double_block) < 0){
-                    printf("ERROR: Failed to read single indirection block from disk\n");
-                }
-                current_open_double = double_index;
-            }
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++){
+        int ret = fs_read_locked(inum, iov[i].iov_base, iov[i].iov_len, offset + total, NULL);
+        if (ret < 0 && total == 0)
+            total = -1;
+        if (ret <= 0)
+            break;
+        total += ret;
+        if (ret < iov[i].iov_len)
+            break;
+    }
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    return total;
+}
 
-            // Now have the single indirection block, so find block number
-            if (current_double_block[double_offset] == 0){
-                block = find1stFree(curFreeData, DISK_BLOCKS);
-                // If full, return bytes_written (number of bytes currently written to disk)
-                if (block < 0){
-                    printf("ERROR: Disk is full\n");
-                    return bytes_written;
-                }
-                current_double_block[double_offset] = block;
-                setNbit(curFreeData, DISK_BLOCKS, block, 0);
-                new_block = 1;
-                // printf("Find first free double indirect: %d\n", block);
-            }
-            else{
-                block = current_double_block[double_offset];
-            }
+// File system function that writes each buffer of iov in turn, starting at offset, as one
+// atomic write. Returns the total number of bytes written
+int fs_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset){
+    OP_BEGIN(FS_OP_PWRITEV);
+    journal_begin();
+    int inum = fd_inode_lock(fd, 1);
+    if (inum < 0){
+        journal_end();
+        return -1;
+    }
 
-            // If next double block will be different, save the single indirection block
-            if (current_open_double != ((cur_block + 1 - 10 - BLOCK_SIZE) / BLOCK_SIZE)){
-                if (block_write(double_indir_block[current_open_double], current_double_block) < 0){
-                    printf("ERROR: Failed to save double single indirection block to disk\n");
-                    return bytes_written;
-                }
-            }
-        }
-        else {
-            printf("ERROR: Reached maximum file size\n");
-            return bytes_written;
-        }
+    if (offset < 0 || iovcnt < 0 || offset > UINT32_MAX){
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        journal_end();
+        printf("ERROR: offset out of range\n");
+        return -1;
+    }
 
-        // printf("Cur block: %d Block: %d Offset: %d\n", cur_block, block, fileDescriptors[fd].file_offset);
-        // Calculate the number of blocks to be written on this write
-        int this_write = 0;
-        if (bytes_left + block_offset >= BLOCK_SIZE)
-            this_write = BLOCK_SIZE - block_offset;
-        else
-            this_write = bytes_left;
+    int total = 0;
+    for (int i = 0; i < iovcnt; i++){
+        int ret = fs_write_retry(inum, iov[i].iov_base, iov[i].iov_len, offset + total);
+        if (ret < 0 && total == 0)
+            total = -1;
+        if (ret <= 0)
+            break;
+        total += ret;
+        if (ret < iov[i].iov_len)
+            break;
+    }
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    journal_end();
+    return total;
+}
 
-        // Write to the block number provided
-        // If new block, set unused bytes to 0. Otherwise, copy current block to write over
-        char block_buf[BLOCK_SIZE]; // Buffer that will read from blocks in disk
-        if (new_block)
-            memset(block_buf, 0, sizeof(block_buf));
-        else{
-            if (block_read(block, block_buf) != 0){
-                printf("ERROR: Unable to read from file data\n");
-                return bytes_written;
-            }
-        }
+// Async helper that finishes submitting request req for inode inum (whose lock is still held): ret
+// is what the read or write mapped, and the submitter's reference on the request is dropped
+void aio_submitted(struct fs_aio * req, int inum, int ret){
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    pthread_mutex_lock(&vol->aio_lock);
+    req->result = ret;
+    if (ret < 0)
+        req->error = 1;
+    aio_put(req);
+    pthread_mutex_unlock(&vol->aio_lock);
+}
 
-        // Write to location block_buf + offset this_write bytes
-        memcpy(block_buf + block_offset, buf + bytes_written, this_write);
-        if (block_write(block, block_buf) != 0){
-            printf("ERROR: Failed to write file data to disk\n");
-            return bytes_written;
-        }
+// Async helper that starts request req on inode inum (whose lock is held) with one reference for
+// the submitter
+void aio_begin(struct fs_aio * req, int inum){
+    req->inum = inum;
+    req->pending = 1;
+    req->error = 0;
+    pthread_mutex_lock(&vol->aio_lock);
+    vol->aioPending[inum]++;
+    vol->aio_inflight++;
+    pthread_mutex_unlock(&vol->aio_lock);
+}
 
-        // Prepare for next write
-        if (block_offset) block_offset = 0;
-        bytes_written += this_write;
-        bytes_left -= this_write;
-        
-        node->file_size += this_write;
-        fileDescriptors[fd].file_offset += this_write;
-        cur_block++;
+// File system function that starts reading req->nbyte bytes at req->offset of req->fildes into
+// req->buf without waiting for the disk. Returns -1 if the request couldn't be started, otherwise
+// it completes later (result holds the bytes read, or -1) and is returned by fs_aio_wait
+int fs_aio_read(struct fs_aio *req){
+    OP_BEGIN(FS_OP_AIO_READ);
+    if (req->offset < 0){
+        printf("ERROR: offset out of range\n");
+        return -1;
+    }
 
-        if (double_indir_open){
-            if (block_write(node->double_indirect_offset, double_indir_block) < 0){
-                printf("ERROR: Failed to update double indirection block\n");
-                return bytes_written;
-            }
+    int inum = fd_inode_lock(req->fildes, 0);
+    if (inum < 0)
+        return -1;
+    aio_begin(req, inum);
+    int ret = fs_read_locked(inum, req->buf, req->nbyte, req->offset, req);
+    aio_submitted(req, inum, ret);
+    return 0;
+}
 
-            if (block_write(double_indir_block[double_index], current_double_block) < 0){
-                printf("ERROR: Failed to update double indirection block\n");
-                return bytes_written;
-            }
-        }
+// File system function that starts writing req->nbyte bytes of req->buf at req->offset of
+// req->fildes. Blocks are allocated and partial blocks written before it returns, whole blocks are
+// written by the disk engine afterwards. The buffer must stay untouched until the request completes
+int fs_aio_write(struct fs_aio *req){
+    OP_BEGIN(FS_OP_AIO_WRITE);
+    journal_begin();
+    int inum = fd_inode_lock(req->fildes, 1);
+    if (inum < 0){
+        journal_end();
+        return -1;
+    }
 
-        // If done, then update the indirection blocks
-        if (bytes_left == 0){
-            if (single_indir_open){
-                if (block_write(node->single_indirect_offset, single_indirect_block) < 0){
-                    printf("ERROR: Failed to update single indirection block\n");
-                    return bytes_written;
-                }
-            }
-            if (double_indir_open){
-                if (block_write(node->double_indirect_offset, double_indir_block) < 0){
-                    printf("ERROR: Failed to update double indirection block\n");
-                    return bytes_written;
-                }
-            }
-        }
+    // Writes can start anywhere in the file or right at its end
+    if (req->offset < 0 || req->offset > UINT32_MAX){
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        journal_end();
+        printf("ERROR: offset out of range\n");
+        return -1;
     }
 
-    return bytes_written;
+    aio_begin(req, inum);
+    int ret = fs_write_locked(inum, req->buf, req->nbyte, req->offset, req);
+    aio_submitted(req, inum, ret);
+    journal_end();
+    return 0;
+}
+
+// File system function that returns up to max completed async requests in done (in completion
+// order). If wait is set and none are ready, it waits for one unless nothing is in flight
+int fs_aio_wait(struct fs_aio **done, int max, int wait){
+    OP_BEGIN(FS_OP_AIO_WAIT);
+    int n = 0;
+    pthread_mutex_lock(&vol->aio_lock);
+    while (1){
+        // Pick up whatever the disk finished without blocking, then hand back completed requests
+        if (vol->aio_inflight > 0 && !vol->aio_reaping)
+            aio_reap_locked(0);
+        while (n < max && vol->aioDone){
+            done[n++] = vol->aioDone;
+            vol->aioDone = vol->aioDone->next;
+        }
+        if (n > 0 || !wait || vol->aio_inflight == 0)
+            break;
+        aio_reap_locked(1);
+    }
+    pthread_mutex_unlock(&vol->aio_lock);
+    return n;
 }
 
 // File system function that returns the filesize of given file
 int fs_get_filesize(int fd){
+    OP_BEGIN(FS_OP_GET_FILESIZE);
     
     // Check if the file descriptor is valid
-    if (validfd(fd) != 0){
+    if (fd_lock(fd) != 0){
         return -1;
     }
 
     // Return the file size of the inode pointed to by file descriptor
-    return (int) curTable[fileDescriptors[fd].inode].file_size;
+    int inum = vol->fileDescriptors[fd].inode;
+    pthread_rwlock_rdlock(&vol->inode_locks[inum]);
+    int size = inode_size(inum);
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+    return size;
 }
 
 // File system function that creates a NULL terminated array of file names in root directory
 int fs_listfiles(char ***files){
+    OP_BEGIN(FS_OP_LISTFILES);
     // Iterate through all files in directory, if open then add name
+    pthread_mutex_lock(&vol->dir_lock);
     int curNum = 0;
-    char ** values = (char**) malloc(15 * MAX_NUM_FILES);
-    for (int i = 0; i < MAX_NUM_FILES; i++){
-        if (curDir[i].is_used){
+    char ** values = (char**) malloc((vol->file_count + 1) * sizeof(char *));
+    for (int i = 0; i < vol->max_files; i++){
+        if (vol->curDir[i].is_used){
             char * name = (char*) malloc(16 * sizeof(char));
-            strncpy(name, curDir[i].name, 15);
+            strncpy(name, vol->curDir[i].name, 15);
             *(values + curNum) = name;
             curNum++;
         }
     }
     // Set last value to be NULL
     *(values + curNum) = NULL;
+    pthread_mutex_unlock(&vol->dir_lock);
     *files = values;
     return 0;
 }
 
-// File system function that sets the file pointer offset of a file descriptor
+// File system function that sets the file pointer offset of a file descriptor. It can go past the
+// end of the file: reads there return nothing, and a write there leaves a hole
 int fs_lseek(int fd, off_t offset){
+    OP_BEGIN(FS_OP_LSEEK);
     
     // Check if file descriptor is valid
-    if (validfd(fd) != 0){
+    if (fd_lock(fd) != 0){
         return -1;
     }
 
-    int filesize = curTable[fileDescriptors[fd].inode].file_size;
-    if (offset < 0 || offset > filesize){
+    if (offset < 0 || offset > INT_MAX){
+        pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
         printf("ERROR: offset out of range\n");
         return -1;
     }
 
-    fileDescriptors[fd].file_offset = offset;
+    vol->fileDescriptors[fd].file_offset = offset;
 
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
     return 0;
 }
 
-// File system function that truncates bytes (can't extend length)
-int fs_truncate(int fd, off_t length){
+// File system function that moves the file pointer offset of a file descriptor like lseek: to
+// offset from the start (SEEK_SET), the current offset (SEEK_CUR) or the end of the file (SEEK_END),
+// or to the first byte at or after offset that holds data (SEEK_DATA) or is in a hole (SEEK_HOLE,
+// the end of the file counts as one). Returns the new offset, or -1 (also when SEEK_DATA finds no
+// data after offset)
+off_t fs_llseek(int fd, off_t offset, int whence){
+    OP_BEGIN(FS_OP_LLSEEK);
+    if (fd_lock(fd) != 0){
+        return -1;
+    }
+
+    int inum = vol->fileDescriptors[fd].inode;
+    pthread_rwlock_rdlock(&vol->inode_locks[inum]);
+    struct inode * node = &vol->curTable[inum];
+    off_t size = inode_size(inum);
+    off_t pos = -1;
+    if (whence == SEEK_SET)
+        pos = offset;
+    else if (whence == SEEK_CUR)
+        pos = vol->fileDescriptors[fd].file_offset + offset;
+    else if (whence == SEEK_END)
+        pos = size + offset;
+    else if ((whence == SEEK_DATA || whence == SEEK_HOLE) && offset >= 0 && offset < size){
+        // Bytes buffered for delayed allocation (past the blocks on disk) are data
+        int end = (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int b = bmap_seek(node, offset / BLOCK_SIZE, end, whence == SEEK_DATA);
+        if (b >= 0 && b < end)
+            pos = ((off_t) b * BLOCK_SIZE > offset) ? (off_t) b * BLOCK_SIZE : offset;
+        else if (b == end && whence == SEEK_HOLE)
+            pos = size;
+        else if (b == end && size > node->file_size)
+            pos = (offset > node->file_size) ? offset : node->file_size;
+    }
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+
+    if (pos < 0 || pos > INT_MAX){
+        pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+        printf("ERROR: offset out of range\n");
+        return -1;
+    }
+    vol->fileDescriptors[fd].file_offset = pos;
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+    return pos;
+}
+
+// File system helper function that does the work of fs_truncate while holding the descriptor and inode locks
+int fs_truncate_locked(int fd, off_t length){
     // Check if file descriptor is valid
     if (validfd(fd) != 0){
         return -1;
     }
 
-    struct inode * node = &curTable[fileDescriptors[fd].inode];
+    int inum = vol->fileDescriptors[fd].inode;
+    struct inode * node = &vol->curTable[inum];
 
-    // Check if requested length is greater than the file size
-    if (length > node->file_size){
-        printf("ERROR: Requested file length exceeds file size\n");
-        return -1;
+    // Growing the file leaves a hole at its end: nothing is allocated (the rest of the last block
+    // is already zeros). Buffered bytes are written out first, since the buffer ends the file. An
+    // inline file grown past the inode moves its bytes to a block
+    if (length > inode_size(inum)){
+        if (length > UINT32_MAX){
+            printf("ERROR: Requested file length is too large\n");
+            return -1;
+        }
+        if (vol->delayed != NULL && delalloc_flush(inum) < 0)
+            return -1;
+        if (node->file_type == FILE_TYPE_INLINE && length > INODE_INLINE && inline_spill(inum) < 0)
+            return -1;
+        node->file_size = length;
+        return 0;
+    }
+
+    // Bytes buffered for delayed allocation are cut from the buffer, or dropped if the file gets
+    // shorter than its part on disk
+    if (vol->delayed != NULL && vol->delayed[inum].len > 0){
+        if (length >= node->file_size){
+            __atomic_store_n(&vol->delayed[inum].len, length - node->file_size, __ATOMIC_RELAXED);
+            if (length < vol->fileDescriptors[fd].file_offset)
+                vol->fileDescriptors[fd].file_offset = length;
+            return 0;
+        }
+        __atomic_store_n(&vol->delayed[inum].len, 0, __ATOMIC_RELAXED);
     }
 
     // If no change is made to the length, do nothing
     if (length == node->file_size)
         return 0;
 
+    // A file cut to what fits in the inode goes back to being inline, and an inline file only has
+    // the bytes it loses zeroed
+    if (length <= INODE_INLINE){
+        if (node->file_type != FILE_TYPE_INLINE && inline_pack(inum, length) < 0)
+            return -1;
+        memset(node->inline_data + length, 0, node->file_size - length);
+        node->file_size = length;
+        if (length < vol->fileDescriptors[fd].file_offset)
+            vol->fileDescriptors[fd].file_offset = length;
+        return 0;
+    }
 
-    int bytes_delete = node->file_size - length;
-    int blocks_delete = bytes_delete / BLOCK_SIZE;
-
-    int block_start = (length / BLOCK_SIZE);
-    int block_offset = length % BLOCK_SIZE;
-
-    // If there are bytes in a block being deleted, delete them (sets them to zeros)
-    if (block_offset){
-        char read_buf[BLOCK_SIZE];
-        char write_buf[BLOCK_SIZE];
-
-        if (block_start < 10){
-            if (block_read(node->direct_offset[block_start], read_buf) < 0){
+    // Zero the tail of the last kept block (an unwritten one already reads as zeros), then free
+    // every block after it
+    if (length % BLOCK_SIZE){
+        int block = bmap(node, length / BLOCK_SIZE);
+        if (block != 0 && !(block & BLOCK_UNWRITTEN)){
+            char block_buf[BLOCK_SIZE];
+            if (cache_read(block, block_buf) < 0){
                 printf("ERROR: Failed to read block from disk\n");
                 return -1;
             }
-            memset(write_buf, 0, BLOCK_SIZE);
-            memcpy(write_buf, read_buf, block_offset);
-
-            if (block_write(node->direct_offset[block_start], write_buf) < 0){
+            memset(block_buf + length % BLOCK_SIZE, 0, BLOCK_SIZE - length % BLOCK_SIZE);
+            if (cache_write(block, block_buf) < 0){
                 printf("ERROR: Failed to write block to disk\n");
                 return -1;
             }
         }
-        else{
-            uint16_t single_indir_block[BLOCK_SIZE / 2];
-            if (block_read(node->single_indirect_offset, single_indir_block) < 0){
-                printf("ERROR: Failed to read single indirection block from disk\n");
-                return -1;
-            }
+    }
 
-            if (block_read(single_indir_block[block_start - 10], read_buf) < 0){
-                printf("ERROR: Failed to read single indirection block from disk\n");
-                return -1;
-            }
+    int first = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (inode_truncate(node, first) < 0)
+        return -1;
 
-            memset(write_buf, 0, BLOCK_SIZE);
-            memcpy(write_buf, read_buf, block_offset);
+    // Update file length (and file descriptor offset if necessary)
+    node->file_size = length;
+    if (node->file_size < vol->fileDescriptors[fd].file_offset)
+        vol->fileDescriptors[fd].file_offset = length;
 
-            if (block_read(single_indir_block[block_start - 10], write_buf) < 0){
-                printf("ERROR: Failed to write single indirection block to disk\n");
-                return -1;
-            }
-        }
+    return 0;
+}
 
-        block_start++;
+// File system function that sets the length of a file, cutting bytes or growing it with a hole
+int fs_truncate(int fd, off_t length){
+    OP_BEGIN(FS_OP_TRUNCATE);
+    journal_begin();
+    if (fd_lock(fd) != 0){
+        journal_end();
+        return -1;
     }
-    uint16_t single_indir_block[BLOCK_SIZE/2];
-    int single_indir_open = 0;
+    int inum = vol->fileDescriptors[fd].inode;
+    pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+    aio_wait_inode(inum);
+    struct inode before = vol->curTable[inum];
+    int ret = fs_truncate_locked(fd, length);
+    if (memcmp(&before, &vol->curTable[inum], sizeof(before)) != 0){
+        inode_mark(inum);
+        vol->inodeSeq[inum] = vol->jseq;
+    }
+    pthread_rwlock_unlock(&vol->inode_locks[inum]);
+    pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+    journal_end();
+    return ret;
+}
 
-    // Now, all the blocks should just be FULL blocks (don't need to set to zeros, just free the disk block)
-    for (int i = block_start; i < block_start + blocks_delete; i++){
-        // Case 1: Direct offset
-        if (i < 10){
-            setNbit(curFreeData, DISK_BLOCKS, node->direct_offset[i], 1);
-            node->direct_offset[i] = 0;
-        }
-        // Case 2: Single indirect offset
-        else{
-            // If first time reading from single indirection block, grab it from memory
-            if (!single_indir_open){
-                if (block_read(node->single_indirect_offset, single_indir_block) < 0){
-                    printf("ERROR: Failed to read single indirection block from disk\n");
-                    return -1;
-                }
-            }
-            setNbit(curFreeData, DISK_BLOCKS, single_indir_block[i - 10], 1);
-            single_indir_block[i - 10] = 0;
+// File system function that makes an open file durable: its data and the metadata blocks that
+// changed are written and the disk is synced, after the file's async requests in flight finish.
+// Returns right away if the file hasn't changed since the last sync. Metadata blocks are shared
+// between files, so this syncs every change made up to the file's last one (see fs_sync)
+int fs_fsync(int fd){
+    OP_BEGIN(FS_OP_FSYNC);
+    int inum, ret, tries = 0;
+    uint32_t target;
+    do {
+        alloc_failed = 0;
+        journal_begin();
+        if (fd_lock(fd) != 0){
+            journal_end();
+            return -1;
         }
+        inum = vol->fileDescriptors[fd].inode;
+        pthread_rwlock_wrlock(&vol->inode_locks[inum]);
+        ret = (vol->delayed != NULL) ? delalloc_flush(inum) : 0;
+        target = vol->inodeSeq[inum];
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        pthread_mutex_unlock(&vol->fileDescriptors[fd].lock);
+        journal_end();
+    } while (ret < 0 && tries++ == 0 && journal_reclaim());
+    if (ret < 0)
+        return -1;
+
+    aio_wait_inode(inum);
+    return journal_commit(target, 1);
+}
+
+// File system function that makes every change made before it was called durable: dirty cached
+// data and the metadata blocks that changed are written, then the disk is synced. Threads calling
+// it (or fs_fsync) at the same time share one sync. Async requests still in flight aren't waited for
+int fs_sync(){
+    OP_BEGIN(FS_OP_SYNC);
+    if (vol->delayed != NULL && delalloc_flush_all() < 0)
+        return -1;
+    return journal_commit(__atomic_load_n(&vol->jseq, __ATOMIC_ACQUIRE), 1);
+}
+
+// File system function that allocates the blocks of bytes offset to offset + len of a file ahead
+// of writing them (filling any holes), growing the file if it ends before offset + len. New blocks
+// past the end are taken as one contiguous run when the disk has one. They're all marked
+// unwritten: they read as zeros, and writing them later needs no allocation
+int fs_fallocate(int fd, off_t offset, off_t len){
+    OP_BEGIN(FS_OP_FALLOCATE);
+    if (offset < 0 || len <= 0 || offset + len > UINT32_MAX){
+        printf("ERROR: Invalid range to allocate\n");
+        return -1;
     }
-    if (single_indir_open){
-        if (block_write(node->single_indirect_offset, single_indir_block) < 0){
-            printf("ERROR: Failed to update single indirection block to disk\n");
+    // Tried once more if the disk was only full of blocks waiting for a commit (journal_reclaim)
+    int ret, tries = 0;
+    do {
+        alloc_failed = 0;
+        journal_begin();
+        int inum = fd_inode_lock(fd, 1);
+        if (inum < 0){
+            journal_end();
             return -1;
         }
+
+        // Bytes buffered for delayed allocation sit at the end of the file on disk, so they go first
+        ret = 0;
+        if (vol->delayed != NULL)
+            ret = delalloc_flush(inum);
+
+        // Mapping without data leaves the blocks already mapped alone
+        struct inode * node = &vol->curTable[inum];
+        off_t size = node->file_size;
+        if (ret == 0 && fs_write_blocks(inum, NULL, len, offset, NULL) != len){
+            // Give back what was mapped past the old end (holes it filled just read as zeros still)
+            if (offset + len > size && inode_truncate(node, (size + BLOCK_SIZE - 1) / BLOCK_SIZE) == 0)
+                node->file_size = size;
+            ret = -1;
+        }
+        pthread_rwlock_unlock(&vol->inode_locks[inum]);
+        journal_end();
+    } while (ret < 0 && tries++ == 0 && journal_reclaim());
+    return ret;
+}
+
+// Trace function that starts recording the block transfers of the volume's disk in a ring of the
+// newest records (from mount_fs on if called before it, and through umount_fs)
+int fs_trace_start(int records){
+    return disk_trace_start(records);
+}
+
+// Trace function that stops recording and drops the records (after transfers being recorded by
+// other threads, such as readahead or the journal's commits, are done with them)
+int fs_trace_stop(){
+    return disk_trace_stop();
+}
+
+// Trace function that writes the recorded block transfers to a trace file for the replay tool
+int fs_trace_save(const char *path){
+    return disk_trace_save(path);
+}
+
+// Volume helper that switches the calling thread to volume v (and its disk), returning the volume
+// it was on for vol_leave
+struct fs_volume * vol_enter(struct fs_volume * v){
+    struct fs_volume * prev = vol;
+    vol = v;
+    disk_use(v->disk);
+    return prev;
+}
+
+// Volume helper that switches the calling thread back to volume prev
+void vol_leave(struct fs_volume * prev){
+    vol = prev;
+    disk_use(prev->disk);
+}
+
+// Volume function that mounts a disk as a volume of its own, next to the one mount_fs uses and any
+// other fsv_mount volumes. Returns NULL if the disk can't be mounted
+struct fs_volume * fsv_mount(const char *disk_name, const struct fs_options *opts){
+    struct fs_volume * v = (struct fs_volume *) malloc(sizeof(struct fs_volume));
+    if (v == NULL){
+        printf("ERROR: Could not allocate memory\n");
+        return NULL;
+    }
+    *v = (struct fs_volume) VOLUME_INIT;
+    v->disk = disk_new();
+    if (v->disk == NULL){
+        free(v);
+        return NULL;
     }
 
-    // Update file length (and file descriptor offset if necessary)
-    node->file_size = length;
-    if (node->file_size < fileDescriptors[fd].file_offset)
-        fileDescriptors[fd].file_offset = length;
+    struct fs_volume * prev = vol_enter(v);
+    int ret = (opts != NULL) ? mount_fs_opts(disk_name, opts) : mount_fs(disk_name);
+    vol_leave(prev);
+    if (ret < 0){
+        disk_free(v->disk);
+        free(v);
+        return NULL;
+    }
+    return v;
+}
 
-    return 0;
+// Volume function that unmounts a volume from fsv_mount and frees it (even if saving it failed).
+// A volume umount_fs left mounted (its buffered data didn't fit on the disk) isn't freed, so
+// fsv_umount can be called again once there's room
+int fsv_umount(struct fs_volume * v){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = umount_fs(NULL);
+    vol_leave(prev);
+    if (ret < 0 && v->curSuper_block != NULL)
+        return -1;
+    disk_free(v->disk);
+    free(v);
+    return ret;
+}
+
+// Volume functions: each runs the fs.h function of the same name on volume v
+int fsv_open(struct fs_volume * v, const char *name){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_open(name);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_close(struct fs_volume * v, int fildes){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_close(fildes);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_create(struct fs_volume * v, const char *name){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_create(name);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_delete(struct fs_volume * v, const char *name){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_delete(name);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_read(struct fs_volume * v, int fildes, void *buf, size_t nbyte){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_read(fildes, buf, nbyte);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_write(struct fs_volume * v, int fildes, void *buf, size_t nbyte){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_write(fildes, buf, nbyte);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_pread(struct fs_volume * v, int fildes, void *buf, size_t nbyte, off_t offset){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_pread(fildes, buf, nbyte, offset);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_pwrite(struct fs_volume * v, int fildes, const void *buf, size_t nbyte, off_t offset){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_pwrite(fildes, buf, nbyte, offset);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_preadv(struct fs_volume * v, int fildes, const struct iovec *iov, int iovcnt, off_t offset){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_preadv(fildes, iov, iovcnt, offset);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_pwritev(struct fs_volume * v, int fildes, const struct iovec *iov, int iovcnt, off_t offset){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_pwritev(fildes, iov, iovcnt, offset);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_aio_read(struct fs_volume * v, struct fs_aio *req){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_aio_read(req);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_aio_write(struct fs_volume * v, struct fs_aio *req){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_aio_write(req);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_aio_wait(struct fs_volume * v, struct fs_aio **done, int max, int wait){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_aio_wait(done, max, wait);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_get_filesize(struct fs_volume * v, int fildes){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_get_filesize(fildes);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_listfiles(struct fs_volume * v, char ***files){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_listfiles(files);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_lseek(struct fs_volume * v, int fildes, off_t offset){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_lseek(fildes, offset);
+    vol_leave(prev);
+    return ret;
+}
+
+off_t fsv_llseek(struct fs_volume * v, int fildes, off_t offset, int whence){
+    struct fs_volume * prev = vol_enter(v);
+    off_t ret = fs_llseek(fildes, offset, whence);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_truncate(struct fs_volume * v, int fildes, off_t length){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_truncate(fildes, length);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_fallocate(struct fs_volume * v, int fildes, off_t offset, off_t len){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_fallocate(fildes, offset, len);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_fsync(struct fs_volume * v, int fildes){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_fsync(fildes);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_sync(struct fs_volume * v){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_sync();
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_trace_start(struct fs_volume * v, int records){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_trace_start(records);
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_trace_stop(struct fs_volume * v){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_trace_stop();
+    vol_leave(prev);
+    return ret;
+}
+
+int fsv_trace_save(struct fs_volume * v, const char *path){
+    struct fs_volume * prev = vol_enter(v);
+    int ret = fs_trace_save(path);
+    vol_leave(prev);
+    return ret;
 }
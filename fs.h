@@ -1,9 +1,108 @@
 #ifndef INCLUDE_FS_H
 #define INCLUDE_FS_H
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifndef SEEK_DATA
+#define SEEK_DATA 3     // fs_llseek: next offset holding data
+#define SEEK_HOLE 4     // fs_llseek: next offset in a hole
+#endif
+
+// Options chosen when a file system is created with make_fs_opts or mounted with mount_fs_opts
+struct fs_options {
+    int flags;
+    int max_files;  // make_fs_opts: number of files the disk can hold (0 for the default of 64)
+    int num_blocks; // make_fs_opts: size of the disk in blocks (0 for the default of DISK_BLOCKS)
+    int journal_blocks; // make_fs_opts with FS_FORMAT_JOURNAL: size of the journal (0 for the default of JOURNAL_BLOCKS)
+};
+#define FS_FORMAT_EXTENTS 0x1   // Files map data with (start, length) extents instead of direct/indirect blocks
+#define FS_FORMAT_JOURNAL 0x2   // Metadata changes are committed to a journal and replayed by mount_fs after a crash
+#define FS_FORMAT_PREALLOC 0x4  // make_fs_opts: reserve the disk file's space up front instead of leaving it sparse
+#define FS_MOUNT_MMAP 0x100     // Serve blocks from an mmap of the disk file instead of read/write calls
+#define FS_MOUNT_NO_READAHEAD 0x200 // Don't prefetch the blocks after sequential fs_read calls
+#define FS_MOUNT_AIO_THREADS 0x400  // Serve async requests with a thread pool even if io_uring is available
+#define FS_MOUNT_DELALLOC 0x800     // Buffer appended data and only allocate its blocks (in bulk) when it's flushed
+
+// An asynchronous read or write, started with fs_aio_read/fs_aio_write and handed back by
+// fs_aio_wait once complete. The caller owns it and must keep it (and buf) alive until then
+struct fs_aio {
+    int fildes;         // Open file descriptor (its offset isn't used or moved)
+    void *buf;          // Buffer to read into or data to write
+    size_t nbyte;       // Number of bytes
+    off_t offset;       // File offset to start at
+    int result;         // Bytes read or written, or -1 (set once complete)
+    void *data;         // For the caller
+
+    // Used by the file system while the request is in flight
+    int inum;
+    int pending;
+    int error;
+    struct fs_aio *next;
+};
+
+// Statistics returned by fs_get_stats, counted since the first fs.h call or the last fs_reset_stats
+// over every mounted volume. Every field is a uint64_t counter. fs.c built with FS_NO_STATS counts
+// nothing (fs_get_stats returns zeros)
+enum fs_op {
+    FS_OP_OPEN, FS_OP_CLOSE, FS_OP_CREATE, FS_OP_DELETE, FS_OP_READ, FS_OP_WRITE, FS_OP_PREAD,
+    FS_OP_PWRITE, FS_OP_PREADV, FS_OP_PWRITEV, FS_OP_AIO_READ, FS_OP_AIO_WRITE, FS_OP_AIO_WAIT,
+    FS_OP_GET_FILESIZE, FS_OP_LISTFILES, FS_OP_LSEEK, FS_OP_LLSEEK, FS_OP_TRUNCATE, FS_OP_FALLOCATE,
+    FS_OP_FSYNC, FS_OP_SYNC,
+    FS_OP_COUNT
+};
+enum fs_io_kind {
+    FS_IO_DATA,         // File data
+    FS_IO_META,         // Superblock, directory, bitmaps and inode table
+    FS_IO_INDIRECT,     // Indirection and extent blocks
+    FS_IO_JOURNAL,      // Journal header and log
+    FS_IO_KINDS
+};
+#define FS_STATS_BUCKETS 304    // Latency histogram buckets (see struct fs_op_stats)
+
+// Calls of one fs.h function. Latencies below 8 ns each get a bucket of hist, then every power of
+// two from 8 ns up is split into 8 equal buckets (each within 12.5% of its values). The last bucket
+// also holds anything from 2^40 ns (about 18 minutes) up
+struct fs_op_stats {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t hist[FS_STATS_BUCKETS];
+};
+// Block transfers between fs.c and disk.c of one kind of block. A range or vectored transfer is
+// one read or write of many blocks
+struct fs_io_stats {
+    uint64_t reads;
+    uint64_t read_blocks;
+    uint64_t writes;
+    uint64_t write_blocks;
+};
+struct fs_stats {
+    struct fs_op_stats ops[FS_OP_COUNT];
+    struct fs_io_stats io[FS_IO_KINDS];
+    uint64_t alloc_calls;       // Searches for a free data block or run of blocks
+    uint64_t alloc_blocks;      // Data blocks handed out by them
+    uint64_t alloc_failures;    // Searches that found nothing
+    uint64_t bitmap_words;      // Bitmap words (64 bits) looked at by searches of either bitmap
+    uint64_t freed_blocks;      // Data, indirection and extent blocks freed
+    uint64_t cache_hits;        // Block reads served by the block cache
+    uint64_t cache_misses;      // Block reads the cache had to go to the disk for
+    uint64_t cache_evictions;   // Cached blocks dropped to make room
+    uint64_t cache_writebacks;  // Dirty cached blocks written to the disk
+    uint64_t readahead_blocks;  // Blocks read into the cache ahead of fs_read
+    uint64_t journal_commits;   // Transactions committed to the journal
+    uint64_t journal_blocks;    // Metadata blocks logged by them
+};
+
+// Block trace (fs_trace_start): the disk of the volume records each block transfer, tagged with the
+// kind of block and the fs.h call it was for (see struct disk_trace_rec in disk.h)
+#define FS_TRACE_TAG(op, kind) ((((op) + 1) << 2) | (kind))
+#define FS_TRACE_OP(tag) ((int) ((tag) >> 2) - 1)  // enum fs_op, or -1 outside any (mount_fs, umount_fs, readahead, commits)
+#define FS_TRACE_KIND(tag) ((int) ((tag) & 3))     // enum fs_io_kind
 
 int make_fs(const char *disk_name);
+int make_fs_opts(const char *disk_name, const struct fs_options *opts);
 int mount_fs(const char *disk_name);
+int mount_fs_opts(const char *disk_name, const struct fs_options *opts);
 int umount_fs(const char *disk_name);
 int fs_open(const char *name);
 int fs_close(int fildes);
@@ -11,8 +110,58 @@ int fs_create(const char *name);
 int fs_delete(const char *name);
 int fs_read(int fildes, void *buf, size_t nbyte);
 int fs_write(int fildes, void *buf, size_t nbyte);
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset);
+int fs_pwrite(int fildes, const void *buf, size_t nbyte, off_t offset);
+int fs_preadv(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+int fs_pwritev(int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+int fs_aio_read(struct fs_aio *req);
+int fs_aio_write(struct fs_aio *req);
+int fs_aio_wait(struct fs_aio **done, int max, int wait);
 int fs_get_filesize(int fildes);
 int fs_listfiles(char ***files);
 int fs_lseek(int fildes, off_t offset);
+off_t fs_llseek(int fildes, off_t offset, int whence);
 int fs_truncate(int fildes, off_t length);
+int fs_fallocate(int fildes, off_t offset, off_t len);
+int fs_fsync(int fildes);
+int fs_sync(void);
+int fs_get_stats(struct fs_stats *stats);
+int fs_reset_stats(void);
+uint64_t fs_stats_percentile(const struct fs_op_stats *op, double p);   // Latency in ns below which a fraction p of calls fall
+const char *fs_stats_op_name(int op);     // "open", "read", ... for an enum fs_op
+int fs_trace_start(int records);
+int fs_trace_stop(void);
+int fs_trace_save(const char *path);
+
+// Volume handle API: fsv_mount mounts a disk as a volume of its own, with its own files,
+// descriptors, cache and threads, so a process can serve many disks at once. Each fsv_ function
+// does what the fs_ function of the same name does, on volume vol. The fs_ functions above work on
+// the volume mounted by mount_fs
+typedef struct fs_volume fs_volume;
+fs_volume *fsv_mount(const char *disk_name, const struct fs_options *opts);
+int fsv_umount(fs_volume *vol);
+int fsv_open(fs_volume *vol, const char *name);
+int fsv_close(fs_volume *vol, int fildes);
+int fsv_create(fs_volume *vol, const char *name);
+int fsv_delete(fs_volume *vol, const char *name);
+int fsv_read(fs_volume *vol, int fildes, void *buf, size_t nbyte);
+int fsv_write(fs_volume *vol, int fildes, void *buf, size_t nbyte);
+int fsv_pread(fs_volume *vol, int fildes, void *buf, size_t nbyte, off_t offset);
+int fsv_pwrite(fs_volume *vol, int fildes, const void *buf, size_t nbyte, off_t offset);
+int fsv_preadv(fs_volume *vol, int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+int fsv_pwritev(fs_volume *vol, int fildes, const struct iovec *iov, int iovcnt, off_t offset);
+int fsv_aio_read(fs_volume *vol, struct fs_aio *req);
+int fsv_aio_write(fs_volume *vol, struct fs_aio *req);
+int fsv_aio_wait(fs_volume *vol, struct fs_aio **done, int max, int wait);
+int fsv_get_filesize(fs_volume *vol, int fildes);
+int fsv_listfiles(fs_volume *vol, char ***files);
+int fsv_lseek(fs_volume *vol, int fildes, off_t offset);
+off_t fsv_llseek(fs_volume *vol, int fildes, off_t offset, int whence);
+int fsv_truncate(fs_volume *vol, int fildes, off_t length);
+int fsv_fallocate(fs_volume *vol, int fildes, off_t offset, off_t len);
+int fsv_fsync(fs_volume *vol, int fildes);
+int fsv_sync(fs_volume *vol);
+int fsv_trace_start(fs_volume *vol, int records);
+int fsv_trace_stop(fs_volume *vol);
+int fsv_trace_save(fs_volume *vol, const char *path);
 #endif /* INCLUDE_FS_H */
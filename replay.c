@@ -0,0 +1,194 @@
+#include "disk.h"
+#include "fs.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Replays a block trace saved with fs_trace_save against a fresh disk: every recorded read or
+// write of the trace is done again, in order, with block_read_range/block_write_range. Traces
+// hold no file contents, so writes carry a fill pattern. Prints one JSON object per line: the
+// whole replay first, then a line per kind of block and per fs.h call seen in the trace, e.g.
+// {"replay":"op","name":"read","ops":...,"blocks":...,"secs":...,"ops_per_sec":...,"mb_per_sec":...,
+//  "lat_ns":{"min":...,"p50":...,"p90":...,"p99":...,"p999":...,"max":...}}
+// Build with `make replay` and run ./replay -h for the options
+
+#define MIB (1024 * 1024)
+
+static const char * kind_names[FS_IO_KINDS] = {"data", "meta", "indirect", "journal"};
+
+// Latencies of one group of replayed records
+struct group {
+    uint64_t * lat;
+    size_t count;
+    size_t cap;
+    uint64_t blocks;
+    uint64_t busy_ns;   // Sum of the latencies
+};
+
+static struct group total;
+static struct group kinds[FS_IO_KINDS];
+static struct group ops[FS_OP_COUNT + 1];  // Last one for transfers outside any fs.h call
+
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void fail(const char * what){
+    fprintf(stderr, "ERROR: %s\n", what);
+    exit(1);
+}
+
+static void sample(struct group * g, uint64_t ns, int blocks){
+    if (g->count == g->cap){
+        g->cap = g->cap ? 2 * g->cap : 1024;
+        g->lat = (uint64_t *) realloc(g->lat, g->cap * sizeof(uint64_t));
+        if (g->lat == NULL)
+            fail("out of memory");
+    }
+    g->lat[g->count++] = ns;
+    g->blocks += blocks;
+    g->busy_ns += ns;
+}
+
+static int cmp_u64(const void * a, const void * b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const struct group * g, double p){
+    return g->lat[(size_t) (p * (double) (g->count - 1) + 0.5)];
+}
+
+// Prints a group's line. Throughput is over secs, the replay's wall time for the whole replay and
+// the group's own busy time otherwise
+static void report(const char * what, const char * name, struct group * g, double secs){
+    if (g->count == 0)
+        return;
+    qsort(g->lat, g->count, sizeof(uint64_t), cmp_u64);
+    if (secs <= 0)
+        secs = (double) g->busy_ns / 1e9;
+    printf("{\"replay\":\"%s\",\"name\":\"%s\",\"ops\":%zu,\"blocks\":%llu,\"secs\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+           "\"lat_ns\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+           what, name, g->count, (unsigned long long) g->blocks, secs,
+           g->count / secs, (double) g->blocks * BLOCK_SIZE / secs / MIB,
+           (unsigned long long) g->lat[0], (unsigned long long) percentile(g, 0.50),
+           (unsigned long long) percentile(g, 0.90), (unsigned long long) percentile(g, 0.99),
+           (unsigned long long) percentile(g, 0.999), (unsigned long long) g->lat[g->count - 1]);
+}
+
+static void usage(const char * prog){
+    fprintf(stderr,
+            "usage: %s [-d disk] [-m] [-r] [-k] trace\n"
+            "  -d disk  disk file to make and replay on (default replay_fs, removed at the end)\n"
+            "  -m       open the disk with the mmap backend\n"
+            "  -r       keep the trace's timing (wait until each record's time) instead of\n"
+            "           replaying as fast as possible\n"
+            "  -k       keep the disk file\n", prog);
+    exit(2);
+}
+
+int main(int argc, char ** argv){
+    const char * disk_name = "replay_fs";
+    int use_mmap = 0, realtime = 0, keep = 0;
+    int c;
+    while ((c = getopt(argc, argv, "d:mrkh")) != -1){
+        switch (c){
+        case 'd': disk_name = optarg; break;
+        case 'm': use_mmap = 1; break;
+        case 'r': realtime = 1; break;
+        case 'k': keep = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    // Load the whole trace
+    FILE * f = fopen(argv[optind], "rb");
+    if (f == NULL)
+        fail("cannot open trace");
+    struct disk_trace_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, DISK_TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+        fail("not a block trace");
+    if (hdr.rec_size != sizeof(struct disk_trace_rec))
+        fail("trace records have a different size");
+    struct disk_trace_rec * recs = (struct disk_trace_rec *) malloc((hdr.count ? hdr.count : 1) * sizeof(struct disk_trace_rec));
+    if (recs == NULL)
+        fail("out of memory");
+    if (fread(recs, sizeof(struct disk_trace_rec), hdr.count, f) != hdr.count)
+        fail("trace is truncated");
+    fclose(f);
+
+    // A fresh disk as large as the traced one (sparse, so this is cheap)
+    int max_count = 1;
+    for (uint64_t i = 0; i < hdr.count; i++){
+        if (recs[i].count > max_count)
+            max_count = recs[i].count;
+    }
+    if (make_disk_size(disk_name, hdr.blocks ? (int) hdr.blocks : 1) < 0)
+        fail("cannot make disk");
+    if ((use_mmap ? open_disk_mmap(disk_name) : open_disk(disk_name)) < 0)
+        fail("cannot open disk");
+    char * buf = (char *) malloc((size_t) max_count * BLOCK_SIZE);
+    if (buf == NULL)
+        fail("out of memory");
+    for (size_t i = 0; i < (size_t) max_count * BLOCK_SIZE; i++)
+        buf[i] = (char) ('a' + i % 26);
+
+    uint64_t reads = 0, writes = 0;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < hdr.count; i++){
+        struct disk_trace_rec * r = &recs[i];
+        if (realtime){
+            uint64_t due = start + (r->time - recs[0].time);
+            uint64_t now = now_ns();
+            if (now < due){
+                struct timespec ts = { (time_t) ((due - now) / 1000000000ull), (long) ((due - now) % 1000000000ull) };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        uint64_t t = now_ns();
+        int ret = (r->flags & DISK_TRACE_WRITE) ? block_write_range(r->block, r->count, buf)
+                                                : block_read_range(r->block, r->count, buf);
+        uint64_t ns = now_ns() - t;
+        if (ret < 0)
+            fail("block transfer failed");
+        if (r->flags & DISK_TRACE_WRITE)
+            writes++;
+        else
+            reads++;
+
+        int op = FS_TRACE_OP(r->tag);
+        sample(&total, ns, r->count);
+        sample(&kinds[FS_TRACE_KIND(r->tag)], ns, r->count);
+        sample(&ops[(op >= 0 && op < FS_OP_COUNT) ? op : FS_OP_COUNT], ns, r->count);
+    }
+    double secs = (double) (now_ns() - start) / 1e9;
+    if (close_disk() < 0)
+        fail("cannot close disk");
+
+    double trace_secs = hdr.count ? (double) (recs[hdr.count - 1].time - recs[0].time) / 1e9 : 0;
+    printf("{\"trace\":\"%s\",\"records\":%llu,\"dropped\":%llu,\"blocks\":%u,\"reads\":%llu,\"writes\":%llu,"
+           "\"trace_secs\":%.6f,\"replay_secs\":%.6f,\"backend\":\"%s\",\"realtime\":%d}\n",
+           argv[optind], (unsigned long long) hdr.count, (unsigned long long) hdr.dropped, hdr.blocks,
+           (unsigned long long) reads, (unsigned long long) writes, trace_secs, secs,
+           use_mmap ? "mmap" : "pread", realtime);
+    report("total", "all", &total, secs);
+    for (int k = 0; k < FS_IO_KINDS; k++)
+        report("kind", kind_names[k], &kinds[k], 0);
+    for (int op = 0; op <= FS_OP_COUNT; op++)
+        report("op", op < FS_OP_COUNT ? fs_stats_op_name(op) : "none", &ops[op], 0);
+
+    if (!keep)
+        unlink(disk_name);
+    free(buf);
+    free(recs);
+    return 0;
+}
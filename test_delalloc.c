@@ -0,0 +1,168 @@
+#include "disk.h"
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+// Tests for FS_MOUNT_DELALLOC: bytes appended to a file sit in a buffer until they're flushed, and
+// every call has to see them as part of the file. Each check compares the file with a copy kept
+// in memory. The tests run on a plain disk and on a journaled one
+
+#define DISK "test_delalloc_fs"
+#define MAX_BYTES (256 * BLOCK_SIZE)
+
+static int failures = 0;
+static struct fs_options opts;
+static char model[MAX_BYTES];   // What the file under test should hold
+static int model_size = 0;
+
+static void check(const char * what, int ok){
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+// Writes n bytes of pattern c at offset of fd, to the file and to the model
+static int write_at(int fd, int offset, int n, char c){
+    static char buf[MAX_BYTES];
+    memset(buf, c, n);
+    memset(model + offset, c, n);
+    if (offset > model_size)
+        memset(model + model_size, 0, offset - model_size);
+    if (offset + n > model_size)
+        model_size = offset + n;
+    return fs_pwrite(fd, buf, n, offset) == n;
+}
+
+// Returns 1 if the file behind fd matches the model (size and every byte)
+static int matches(int fd){
+    static char buf[MAX_BYTES + 1];
+    return fs_get_filesize(fd) == model_size && fs_pread(fd, buf, sizeof(buf), 0) == model_size &&
+           memcmp(buf, model, model_size) == 0;
+}
+
+static int truncate_to(int fd, int length){
+    if (length > model_size)
+        memset(model + model_size, 0, length - model_size);
+    model_size = length;
+    return fs_truncate(fd, length) == 0;
+}
+
+static int remount(){
+    return umount_fs(DISK) == 0 && mount_fs_opts(DISK, &opts) == 0;
+}
+
+static void run(const char * format){
+    printf("-- %s\n", format);
+    if (make_fs_opts(DISK, &opts) != 0 || mount_fs_opts(DISK, &opts) != 0){
+        printf("FAIL: make and mount %s\n", DISK);
+        exit(1);
+    }
+
+    // Small appends stay buffered and read back, with reads spanning the disk part and the buffer
+    model_size = 0;
+    fs_create("f");
+    int fd = fs_open("f");
+    int ok = 1;
+    for (int i = 0; i < 40; i++)
+        ok &= write_at(fd, model_size, 300 + i, 'a' + i % 26);
+    check("buffered appends read back", ok && matches(fd));
+    check("fsync writes the buffer out", fs_fsync(fd) == 0 && matches(fd));
+    ok = 1;
+    for (int i = 0; i < 10; i++)
+        ok &= write_at(fd, model_size, 1000, 'A' + i);
+    ok &= write_at(fd, 5000, 20, 'z');     // Overwrite inside the disk part
+    check("reads across the disk part and the buffer", ok && matches(fd));
+
+    // fs_truncate inside the buffer cuts it, and below the disk part drops it
+    int disk_part = model_size - 10 * 1000;
+    check("truncate inside the buffer", truncate_to(fd, disk_part + 2500) && matches(fd));
+    check("append after truncating the buffer", write_at(fd, model_size, 700, '#') && matches(fd));
+    check("truncate below the disk part", truncate_to(fd, disk_part - 3000) && matches(fd));
+    check("grow with truncate", truncate_to(fd, model_size + 9000) && matches(fd));
+    check("append after growing", write_at(fd, model_size, 100, '$') && matches(fd));
+    fs_close(fd);
+
+    // Unmounting flushes what's still buffered
+    fd = fs_open("f");
+    write_at(fd, model_size, 3333, '%');
+    fs_close(fd);
+    check("remount after buffered appends", remount());
+    fd = fs_open("f");
+    check("buffered bytes survive umount_fs", fd >= 0 && matches(fd));
+
+    // SEEK_DATA and SEEK_HOLE: a hole on disk between a block of data and buffered bytes
+    check("truncate to zero", truncate_to(fd, 0) && matches(fd));
+    write_at(fd, 0, BLOCK_SIZE, 'x');
+    fs_fsync(fd);
+    write_at(fd, 3 * BLOCK_SIZE, 100, 'y');    // Leaves a hole, so it goes straight to disk
+    write_at(fd, model_size, 500, 'w');        // Buffered
+    check("file with a hole and buffered bytes", matches(fd));
+    check("SEEK_DATA at the start", fs_llseek(fd, 0, SEEK_DATA) == 0);
+    check("SEEK_HOLE finds the hole", fs_llseek(fd, 10, SEEK_HOLE) == BLOCK_SIZE);
+    check("SEEK_DATA skips the hole", fs_llseek(fd, BLOCK_SIZE + 5, SEEK_DATA) == 3 * BLOCK_SIZE);
+    check("SEEK_DATA in buffered bytes", fs_llseek(fd, model_size - 10, SEEK_DATA) == model_size - 10);
+    check("SEEK_HOLE in buffered bytes is the end", fs_llseek(fd, model_size - 10, SEEK_HOLE) == model_size);
+    check("SEEK_DATA past the end fails", fs_llseek(fd, model_size, SEEK_DATA) == -1);
+    fs_close(fd);
+
+    // A file small enough to stay inline in the inode
+    model_size = 0;
+    fs_create("small");
+    fd = fs_open("small");
+    check("inline file", write_at(fd, 0, 100, 's') && matches(fd));
+    check("SEEK_DATA in an inline file", fs_llseek(fd, 10, SEEK_DATA) == 10);
+    check("SEEK_HOLE in an inline file is the end", fs_llseek(fd, 10, SEEK_HOLE) == 100);
+    fs_close(fd);
+    check("remount", remount());
+    fd = fs_open("small");
+    check("inline file survives umount_fs", fd >= 0 && matches(fd));
+    fs_close(fd);
+
+    // An inline file grown past the inode by buffered bytes: those are data, even past its block
+    model_size = 0;
+    fs_create("grown");
+    fd = fs_open("grown");
+    check("inline file with buffered bytes", write_at(fd, 0, 7298, 'g') && matches(fd));
+    check("SEEK_DATA in buffered bytes past the inode", fs_llseek(fd, 6242, SEEK_DATA) == 6242);
+    check("SEEK_HOLE in buffered bytes past the inode is the end", fs_llseek(fd, 6242, SEEK_HOLE) == 7298);
+    fs_close(fd);
+
+    umount_fs(DISK);
+
+    // A disk too small for the buffered bytes: umount_fs fails and leaves the disk mounted, so the
+    // file can be cut back and the disk unmounted after all
+    struct fs_options small = opts;
+    small.num_blocks = 200;
+    small.journal_blocks = 16;
+    if (make_fs_opts(DISK, &small) != 0 || mount_fs_opts(DISK, &small) != 0){
+        printf("FAIL: make and mount a small %s\n", DISK);
+        exit(1);
+    }
+    model_size = 0;
+    fs_create("full");
+    fd = fs_open("full");
+    ok = 1;
+    for (int i = 0; i < 300; i++)
+        ok &= write_at(fd, model_size, 3000, 'a' + i % 26);
+    check("buffer more than the disk holds", ok && matches(fd));
+    check("umount_fs on a full disk fails", umount_fs(DISK) == -1);
+    check("disk stays mounted after the failed umount_fs", matches(fd));
+    check("truncate after the failed umount_fs", truncate_to(fd, 10000) && matches(fd));
+    check("umount_fs after freeing space", umount_fs(DISK) == 0);
+    fd = (mount_fs_opts(DISK, &small) == 0) ? fs_open("full") : -1;
+    check("file survives the retried umount_fs", fd >= 0 && matches(fd));
+    fs_close(fd);
+    umount_fs(DISK);
+    unlink(DISK);
+}
+
+int main(){
+    opts.flags = FS_MOUNT_DELALLOC;
+    run("plain disk");
+    opts.flags = FS_MOUNT_DELALLOC | FS_FORMAT_JOURNAL;
+    run("journaled disk");
+    printf("%d failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,209 @@
+#include "disk.h"
+#include "fs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string.h>
+
+// Crash tests for FS_FORMAT_JOURNAL: a child process makes changes and exits without umount_fs
+// (like a crash, the disk file keeps whatever reached it), then the parent mounts again, which
+// replays the journal, and checks what survived. Some tests tear a transaction first by changing
+// its blocks on disk, reached through disk.c while nothing is mounted
+
+#define DISK "test_journal_fs"
+
+static int failures = 0;
+
+static void check(const char * what, int ok){
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+static void make_journaled(int journal_blocks){
+    struct fs_options opts = { .flags = FS_FORMAT_JOURNAL, .journal_blocks = journal_blocks };
+    if (make_fs_opts(DISK, &opts) != 0 || mount_fs(DISK) != 0){
+        printf("FAIL: make and mount %s\n", DISK);
+        exit(1);
+    }
+}
+
+// Writes n bytes of pattern c to a new file
+static void create_file(const char * name, int n, char c){
+    char * buf = malloc(n);
+    memset(buf, c, n);
+    fs_create(name);
+    int fd = fs_open(name);
+    fs_write(fd, buf, n);
+    fs_close(fd);
+    free(buf);
+}
+
+// Returns 1 if file name holds exactly n bytes of pattern c
+static int file_is(const char * name, int n, char c){
+    int fd = fs_open(name);
+    if (fd < 0)
+        return 0;
+    char * buf = malloc(n + 1);
+    int ok = (fs_get_filesize(fd) == n && fs_read(fd, buf, n + 1) == n);
+    for (int i = 0; ok && i < n; i++)
+        ok = (buf[i] == c);
+    fs_close(fd);
+    free(buf);
+    return ok;
+}
+
+static int file_exists(const char * name){
+    int fd = fs_open(name);
+    if (fd >= 0)
+        fs_close(fd);
+    return fd >= 0;
+}
+
+// Runs body in a child that exits without unmounting, and waits for it
+static void crash_after(void (*body)(void)){
+    pid_t pid = fork();
+    if (pid == 0){
+        body();
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// Finds the last transaction in the journal log of the unmounted disk: the block of its first
+// descriptor and of its commit block (journal layout as in fs.c). Returns 0 if there's none
+static int last_transaction(int * desc_block, int * commit_block){
+    char block[BLOCK_SIZE];
+    uint32_t * words = (uint32_t *) block;
+    if (open_disk(DISK) != 0 || block_read(0, block) != 0)
+        return 0;
+    uint32_t journal = words[9], journal_blocks = words[10];
+    block_read(journal, block);
+    uint32_t next = words[1];   // Header: oldest sequence number still replayed
+
+    int found = 0;
+    uint32_t pos = 1;
+    while (pos < journal_blocks){
+        block_read(journal + pos, block);
+        if (words[0] != 0x4a445343 || words[1] < next)     // Descriptor magic and sequence
+            break;
+        uint32_t count = words[2], descs = words[3];
+        *desc_block = journal + pos;
+        *commit_block = journal + pos + descs + count;
+        found = 1;
+        next = words[1] + 1;
+        pos += descs + count + 1;
+    }
+    close_disk();
+    return found;
+}
+
+// Changes one byte of block on the unmounted disk
+static void flip_byte(int b, int offset){
+    char block[BLOCK_SIZE];
+    open_disk(DISK);
+    block_read(b, block);
+    block[offset] ^= 0x5a;
+    block_write(b, block);
+    close_disk();
+}
+
+static void two_commits(){
+    make_journaled(0);
+    create_file("a", 5000, 'a');
+    create_file("b", 10, 'b');
+    fs_sync();
+    create_file("d", 300, 'd');
+    fs_sync();
+}
+
+static void commit_then_change(){
+    make_journaled(0);
+    create_file("a", 5000, 'a');
+    fs_sync();
+    fs_create("c");
+}
+
+static void many_commits(){
+    make_journaled(16);
+    char name[16];
+    for (int i = 0; i < 40; i++){
+        sprintf(name, "f%d", i);
+        create_file(name, 100 + i * 150, 'A' + i % 26);
+        if (i % 5 == 4){
+            sprintf(name, "f%d", i - 2);
+            fs_delete(name);
+        }
+        fs_sync();
+    }
+}
+
+int main(){
+    int desc, commit;
+
+    // Committed transactions are replayed
+    crash_after(two_commits);
+    check("mount after crash", mount_fs(DISK) == 0);
+    check("committed files are replayed", file_is("a", 5000, 'a') && file_is("b", 10, 'b') && file_is("d", 300, 'd'));
+    umount_fs(DISK);
+    check("remount after replay", mount_fs(DISK) == 0 && file_is("d", 300, 'd'));
+    umount_fs(DISK);
+
+    // A change made after the last commit is either all there or not there at all
+    crash_after(commit_then_change);
+    check("mount after crash mid-transaction", mount_fs(DISK) == 0);
+    check("committed file survives", file_is("a", 5000, 'a'));
+    check("uncommitted create is whole or gone", !file_exists("c") || file_is("c", 0, 0));
+    umount_fs(DISK);
+
+    // A torn commit block: the last transaction isn't replayed, the ones before it are
+    crash_after(two_commits);
+    check("journal holds the last transaction", last_transaction(&desc, &commit));
+    flip_byte(commit, 12);     // Checksum
+    check("mount with a torn commit", mount_fs(DISK) == 0);
+    check("transactions before the torn one are replayed", file_is("a", 5000, 'a') && file_is("b", 10, 'b'));
+    check("torn transaction isn't replayed", !file_exists("d"));
+    umount_fs(DISK);
+
+    // A transaction whose image doesn't match its checksum isn't replayed either
+    crash_after(two_commits);
+    check("journal holds the last transaction", last_transaction(&desc, &commit));
+    flip_byte(desc + 1, 100);   // First image of the last transaction
+    check("mount with a corrupted image", mount_fs(DISK) == 0);
+    check("transactions before the corrupted one are replayed", file_is("a", 5000, 'a') && file_is("b", 10, 'b'));
+    check("corrupted transaction isn't replayed", !file_exists("d"));
+    umount_fs(DISK);
+
+    // A small journal checkpoints and starts over many times: only what came after the last
+    // checkpoint is replayed, and stale transactions left behind in the log are not
+    crash_after(many_commits);
+    check("mount after crash with a wrapped journal", mount_fs(DISK) == 0);
+    int ok = 1;
+    char name[16];
+    for (int i = 0; i < 40; i++){
+        sprintf(name, "f%d", i);
+        int deleted = (i % 5 == 2 && i + 2 < 40);
+        ok &= deleted ? !file_exists(name) : file_is(name, 100 + i * 150, 'A' + i % 26);
+    }
+    check("every committed create and delete is there after wrapping", ok);
+    umount_fs(DISK);
+
+    // Blocks freed by a transaction that isn't committed yet can't be reused, but a write that
+    // runs out of space commits it rather than failing while most of the disk is free
+    struct fs_options small = { .flags = FS_FORMAT_JOURNAL, .num_blocks = 2048, .journal_blocks = 256 };
+    check("make and mount a small journaled disk", make_fs_opts(DISK, &small) == 0 && mount_fs(DISK) == 0);
+    ok = 1;
+    for (int i = 0; i < 6; i++){
+        fs_delete("big");
+        create_file("big", 1200 * BLOCK_SIZE, 'a' + i);
+        ok &= file_is("big", 1200 * BLOCK_SIZE, 'a' + i);
+    }
+    check("rewriting most of the disk doesn't wait for the commit thread", ok);
+    umount_fs(DISK);
+
+    unlink(DISK);
+    printf("%d failed\n", failures);
+    return failures != 0;
+}